@@ -0,0 +1,110 @@
+#include <stdio.h>             /* standard I/O routines                      */
+#include <stdlib.h>            /* atoi(), malloc() and rand()                */
+#include <time.h>              /* clock_gettime()                            */
+
+#include "byte-count.h"        /* byte counting kernels                      */
+
+/*
+ * microbenchmark of the byte counting kernels - GB/s of a single core.
+ * compile with:
+ *     gcc -O2 byte-count-bench.c byte-count.c -lpthread -o byte-count-bench
+ */
+
+/* default size of the scanned buffer, in KB, and times it's scanned */
+#define DEFAULT_BUFFER_KB (64 * 1024)
+#define DEFAULT_REPEATS 20
+
+/* one byte in this many of the buffer is a newline (text lines' length) */
+#define LINE_LENGTH 64
+
+/* current time, in seconds. */
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * measure each kernel the CPU supports, counting the newlines of a buffer
+ * of random text. a buffer that fits the caches shows the kernels' own
+ * speed, a bigger one the memory bandwidth of one core. usage:
+ *     byte-count-bench [buffer_kb] [repeats]
+ */
+int main(int argc, char* argv[])
+{
+    const char* names[] = { "scalar", "sse2", "avx2", "avx512" };
+    size_t buffer_size = DEFAULT_BUFFER_KB * 1024UL;
+    int repeats = DEFAULT_REPEATS;
+    unsigned char* buf;
+    size_t expected = 0;
+    size_t i;
+
+    if (argc > 1) {
+        buffer_size = atol(argv[1]) * 1024UL;
+    }
+    if (argc > 2) {
+        repeats = atoi(argv[2]);
+    }
+    if (buffer_size == 0 || repeats <= 0) {
+        fprintf(stderr, "usage: %s [buffer_kb] [repeats]\n", argv[0]);
+        exit(1);
+    }
+
+    buf = (unsigned char*)malloc(buffer_size);
+    if (!buf) {
+        fprintf(stderr, "byte-count-bench: out of memory. exiting\n");
+        exit(1);
+    }
+    for (i = 0; i < buffer_size; i++) {
+        buf[i] = rand() % LINE_LENGTH == 0 ? '\n' : 'a' + rand() % 26;
+        expected += buf[i] == '\n';
+    }
+
+    printf("kernel,buffer_kb,repeats,seconds,gb_per_sec,count,default\n");
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const struct byte_count_kernel* kernel = find_byte_count_kernel(names[i]);
+        size_t count = 0;
+        double start;
+        double elapsed;
+        int r;
+
+        if (!kernel) {
+            continue;
+        }
+
+        /* check it against the newlines put in the buffer - also */
+        /* at unaligned starts and odd lengths.                    */
+        for (r = 0; r < 64; r++) {
+            size_t len = buffer_size > (size_t)r ? buffer_size - r : 0;
+
+            if (kernel->count(buf + (buffer_size - len), len, '\n') !=
+                find_byte_count_kernel("scalar")->count(buf + (buffer_size - len), len, '\n')) {
+                fprintf(stderr, "byte-count-bench: kernel '%s' miscounts. exiting\n",
+                        kernel->name);
+                exit(1);
+            }
+        }
+
+        start = now_seconds();
+        for (r = 0; r < repeats; r++) {
+            count = kernel->count(buf, buffer_size, '\n');
+        }
+        elapsed = now_seconds() - start;
+        if (count != expected) {
+            fprintf(stderr, "byte-count-bench: kernel '%s' counted '%zu', not '%zu'. exiting\n",
+                    kernel->name, count, expected);
+            exit(1);
+        }
+
+        printf("%s,%zu,%d,%.4f,%.2f,%zu,%s\n", kernel->name, buffer_size / 1024, repeats,
+               elapsed, (double)buffer_size * repeats / elapsed / 1e9, count,
+               kernel == get_byte_count_kernel() ? "yes" : "no");
+        fflush(stdout);
+    }
+
+    free(buf);
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+#include <string.h>            /* strcmp()                                   */
+#include <stdint.h>            /* uint64_t                                   */
+#include <pthread.h>           /* pthread_once()                             */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>         /* SSE2, AVX2 and AVX-512 intrinsics          */
+#define BYTE_COUNT_X86 1
+#endif
+
+#include "byte-count.h"        /* byte counting kernels                      */
+
+/*
+ * the vector kernels count matches in per-byte counters - subtracting
+ * each comparison's all-ones (-1) bytes - and fold them into 64 bit sums
+ * before any of them may wrap, every this many vectors.
+ */
+#define BYTE_COUNTER_MAX 255
+
+/*
+ * count a byte one byte at a time.
+ */
+static size_t count_bytes_scalar(const void* buf, size_t len, unsigned char byte)
+{
+    const unsigned char* p = (const unsigned char*)buf;
+    size_t count = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        count += p[i] == byte;
+    }
+
+    return count;
+}
+
+#ifdef BYTE_COUNT_X86
+
+/*
+ * count a byte 16 bytes at a time.
+ * algorithm: compares 16 bytes to the byte, and subtracts the result
+ *            (-1 for a match) from 16 byte counters. every
+ *            BYTE_COUNTER_MAX vectors, sums the counters with psadbw
+ *            into two 64 bit sums. the tail is counted byte by byte.
+ */
+__attribute__((target("sse2")))
+static size_t count_bytes_sse2(const void* buf, size_t len, unsigned char byte)
+{
+    const unsigned char* p = (const unsigned char*)buf;
+    const __m128i needle = _mm_set1_epi8((char)byte);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sums = _mm_setzero_si128();
+    uint64_t lanes[2];
+    size_t i = 0;
+
+    while (len - i >= 16) {
+        __m128i counters = _mm_setzero_si128();
+        int n;
+
+        for (n = 0; n < BYTE_COUNTER_MAX && len - i >= 16; n++, i += 16) {
+            __m128i data = _mm_loadu_si128((const __m128i*)(p + i));
+
+            counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(data, needle));
+        }
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(counters, zero));
+    }
+    _mm_storeu_si128((__m128i*)lanes, sums);
+
+    return lanes[0] + lanes[1] + count_bytes_scalar(p + i, len - i, byte);
+}
+
+/*
+ * count a byte 32 bytes at a time - like count_bytes_sse2(), with
+ * twice wider vectors.
+ */
+__attribute__((target("avx2")))
+static size_t count_bytes_avx2(const void* buf, size_t len, unsigned char byte)
+{
+    const unsigned char* p = (const unsigned char*)buf;
+    const __m256i needle = _mm256_set1_epi8((char)byte);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sums = _mm256_setzero_si256();
+    uint64_t lanes[4];
+    size_t i = 0;
+
+    while (len - i >= 32) {
+        __m256i counters = _mm256_setzero_si256();
+        int n;
+
+        for (n = 0; n < BYTE_COUNTER_MAX && len - i >= 32; n++, i += 32) {
+            __m256i data = _mm256_loadu_si256((const __m256i*)(p + i));
+
+            counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(data, needle));
+        }
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(counters, zero));
+    }
+    _mm256_storeu_si256((__m256i*)lanes, sums);
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           count_bytes_scalar(p + i, len - i, byte);
+}
+
+/*
+ * count a byte 64 bytes at a time.
+ * algorithm: compares 64 bytes to the byte into a 64 bit mask, and adds
+ *            its population count. the tail is loaded with a mask, so
+ *            it's never read past the buffer's end.
+ */
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static size_t count_bytes_avx512(const void* buf, size_t len, unsigned char byte)
+{
+    const unsigned char* p = (const unsigned char*)buf;
+    const __m512i needle = _mm512_set1_epi8((char)byte);
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; len - i >= 64; i += 64) {
+        __m512i data = _mm512_loadu_si512((const void*)(p + i));
+
+        count += _mm_popcnt_u64(_mm512_cmpeq_epi8_mask(data, needle));
+    }
+    if (i < len) {
+        __mmask64 tail = _cvtu64_mask64((~0ULL) >> (64 - (len - i)));
+        __m512i data = _mm512_maskz_loadu_epi8(tail, (const void*)(p + i));
+
+        count += _mm_popcnt_u64(_mm512_mask_cmpeq_epi8_mask(tail, data, needle));
+    }
+
+    return count;
+}
+
+#endif /* BYTE_COUNT_X86 */
+
+/* the kernels, fastest first. */
+static const struct byte_count_kernel byte_count_kernels[] = {
+#ifdef BYTE_COUNT_X86
+    { "avx512", count_bytes_avx512 },
+    { "avx2", count_bytes_avx2 },
+    { "sse2", count_bytes_sse2 },
+#endif
+    { "scalar", count_bytes_scalar },
+};
+
+#define NUM_BYTE_COUNT_KERNELS \
+    (sizeof(byte_count_kernels) / sizeof(byte_count_kernels[0]))
+
+/* the kernel picked for this CPU, once. */
+static const struct byte_count_kernel* byte_count_kernel;
+static pthread_once_t byte_count_once = PTHREAD_ONCE_INIT;
+
+/*
+ * does the CPU (and the OS, saving its registers) support a kernel?
+ * tells by the CPUID instruction's feature bits.
+ */
+static int byte_count_kernel_supported(const struct byte_count_kernel* kernel)
+{
+#ifdef BYTE_COUNT_X86
+    __builtin_cpu_init();
+    if (strcmp(kernel->name, "avx512") == 0) {
+        return __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt");
+    }
+    if (strcmp(kernel->name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (strcmp(kernel->name, "sse2") == 0) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+
+    return strcmp(kernel->name, "scalar") == 0;
+}
+
+/* pick the fastest kernel the CPU supports */
+static void select_byte_count_kernel(void)
+{
+    size_t i;
+
+    for (i = 0; i < NUM_BYTE_COUNT_KERNELS; i++) {
+        if (byte_count_kernel_supported(&byte_count_kernels[i])) {
+            byte_count_kernel = &byte_count_kernels[i];
+            return;
+        }
+    }
+}
+
+/* get the kernel count_bytes() uses. */
+const struct byte_count_kernel* get_byte_count_kernel(void)
+{
+    pthread_once(&byte_count_once, select_byte_count_kernel);
+
+    return byte_count_kernel;
+}
+
+/* find a kernel the CPU supports by name. */
+const struct byte_count_kernel* find_byte_count_kernel(const char* name)
+{
+    size_t i;
+
+    for (i = 0; i < NUM_BYTE_COUNT_KERNELS; i++) {
+        if (strcmp(byte_count_kernels[i].name, name) == 0) {
+            return byte_count_kernel_supported(&byte_count_kernels[i]) ?
+                   &byte_count_kernels[i] : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/* count the occurrences of a byte in a buffer. */
+size_t count_bytes(const void* buf, size_t len, unsigned char byte)
+{
+    return get_byte_count_kernel()->count(buf, len, byte);
+}
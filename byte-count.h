@@ -0,0 +1,31 @@
+#ifndef BYTE_COUNT_H
+#define BYTE_COUNT_H
+
+#include <stddef.h>      /* size_t                                    */
+
+/* a kernel counting the occurrences of a byte in a buffer */
+typedef size_t (*byte_count_function)(const void* buf, size_t len, unsigned char byte);
+
+/* a byte counting kernel, for a given instruction set */
+struct byte_count_kernel {
+    const char* name;            /* "avx512", "avx2", "sse2" or "scalar". */
+    byte_count_function count;   /* the kernel itself.                    */
+};
+
+/*
+ * count the occurrences of 'byte' (e.g. '\n') in the 'len' bytes of
+ * 'buf', with the fastest kernel the CPU supports - picked once, on
+ * the first call.
+ */
+extern size_t count_bytes(const void* buf, size_t len, unsigned char byte);
+
+/* get the kernel count_bytes() uses on this CPU */
+extern const struct byte_count_kernel* get_byte_count_kernel(void);
+
+/*
+ * find a kernel by name - NULL if there's no such kernel, or the CPU
+ * doesn't support it.
+ */
+extern const struct byte_count_kernel* find_byte_count_kernel(const char* name);
+
+#endif /* BYTE_COUNT_H */
@@ -0,0 +1,174 @@
+#include <string.h>            /* memset()                                   */
+#include <errno.h>             /* errno, EBUSY, EINTR                        */
+#include <unistd.h>            /* syscall() and close()                      */
+#include <stdatomic.h>         /* C11 atomic types and operations            */
+#include <sys/mman.h>          /* mmap() and munmap()                        */
+#include <sys/syscall.h>       /* __NR_io_uring_setup, __NR_io_uring_enter   */
+
+#include "io-ring.h"           /* io_uring instance                          */
+
+/* the ring indexes are shared with the kernel - access them atomically */
+#define RING_LOAD_ACQUIRE(p) atomic_load_explicit((atomic_uint*)(p), memory_order_acquire)
+#define RING_STORE_RELEASE(p, v) \
+    atomic_store_explicit((atomic_uint*)(p), (v), memory_order_release)
+
+/* the io_uring system calls, which glibc doesn't wrap */
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/*
+ * set up a ring.
+ * algorithm: creates the ring, and maps its submission queue, completion
+ *            queue (in the same mapping, if the kernel allows) and
+ *            submission entries. the kernel may round the number of
+ *            entries up to a power of 2.
+ */
+int init_io_ring(struct io_ring* ring, unsigned entries)
+{
+    struct io_uring_params params;
+    char* sq;
+    char* cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        return -errno;
+    }
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = 0;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = ring->sq_map;
+    if (ring->cq_map_size > 0 && ring->sq_map != MAP_FAILED) {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)MAP_FAILED;
+    if (ring->cq_map != MAP_FAILED) {
+        ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_POPULATE, ring->fd,
+                                                IORING_OFF_SQES);
+    }
+    if (ring->sqes == MAP_FAILED) {
+        int err = -errno;
+
+        if (ring->cq_map_size > 0 && ring->cq_map != MAP_FAILED) {
+            munmap(ring->cq_map, ring->cq_map_size);
+        }
+        if (ring->sq_map != MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_map_size);
+        }
+        close(ring->fd);
+        return err;
+    }
+
+    sq = (char*)ring->sq_map;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    cq = (char*)ring->cq_map;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    ring->to_submit = 0;
+
+    return 0;
+}
+
+/* queue a read. */
+int io_ring_queue_read(struct io_ring* ring, int fd, const struct iovec* iov,
+                       off_t offset, unsigned long long user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index;
+    struct io_uring_sqe* sqe;
+
+    if (tail - RING_LOAD_ACQUIRE(ring->sq_head) >= ring->sq_entries) {
+        return -EBUSY;
+    }
+
+    index = tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)iov;
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+
+    /* publish the entry to the kernel */
+    RING_STORE_RELEASE(ring->sq_tail, tail + 1);
+    ring->to_submit++;
+
+    return 0;
+}
+
+/* submit the queued reads, and wait for completions. */
+int io_ring_submit(struct io_ring* ring, unsigned wait_nr)
+{
+    int rc;
+
+    do {
+        rc = sys_io_uring_enter(ring->fd, ring->to_submit, wait_nr,
+                                wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (rc >= 0) {
+            ring->to_submit -= rc;
+        }
+    } while ((rc < 0 && errno == EINTR) || (rc >= 0 && ring->to_submit > 0));
+
+    return rc < 0 ? -errno : 0;
+}
+
+/* reap a completion. */
+int io_ring_reap(struct io_ring* ring, unsigned long long* user_data, int* res)
+{
+    unsigned head = *ring->cq_head;
+    struct io_uring_cqe* cqe;
+
+    if (head == RING_LOAD_ACQUIRE(ring->cq_tail)) {
+        return 0;
+    }
+
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+
+    /* hand the entry back to the kernel */
+    RING_STORE_RELEASE(ring->cq_head, head + 1);
+
+    return 1;
+}
+
+/* tear a ring down. */
+void delete_io_ring(struct io_ring* ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map_size > 0) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
@@ -0,0 +1,64 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <sys/types.h>   /* off_t                                     */
+#include <sys/uio.h>     /* struct iovec                              */
+#include <linux/io_uring.h> /* io_uring structures and constants      */
+
+/*
+ * a minimal io_uring instance - set up with the raw system calls, no
+ * liburing. owned by a single thread, which queues reads, submits them
+ * and reaps their completions.
+ */
+struct io_ring {
+    int fd;                          /* the ring's file descriptor.        */
+    unsigned* sq_head;               /* submission queue - consumed by     */
+    unsigned* sq_tail;               /* the kernel from head, produced by  */
+    unsigned* sq_mask;               /* us at tail.                        */
+    unsigned* sq_array;              /* indexes of the queued entries.     */
+    struct io_uring_sqe* sqes;       /* the submission entries.            */
+    unsigned sq_entries;             /* number of submission entries.      */
+    unsigned* cq_head;               /* completion queue - consumed by us  */
+    unsigned* cq_tail;               /* from head, produced by the kernel  */
+    unsigned* cq_mask;               /* at tail.                           */
+    struct io_uring_cqe* cqes;       /* the completion entries.            */
+    unsigned to_submit;              /* entries queued, not submitted yet. */
+    void* sq_map;                    /* the mapped rings, and their sizes. */
+    size_t sq_map_size;              /* the completion queue shares the    */
+    void* cq_map;                    /* submission queue's mapping on      */
+    size_t cq_map_size;              /* kernels with IORING_FEAT_SINGLE_MMAP. */
+    size_t sqes_size;
+};
+
+/*
+ * set up a ring of 'entries' submission entries.
+ * returns 0, or a negative errno - e.g. -ENOSYS or -EPERM where io_uring
+ * isn't available (old kernels, containers, or disabled by sysctl).
+ */
+extern int init_io_ring(struct io_ring* ring, unsigned entries);
+
+/*
+ * queue a read of 'iov' from 'fd' at 'offset'. 'user_data' comes back with
+ * its completion. the iovec must stay valid till the read completes.
+ * returns 0, or -EBUSY if the submission queue is full.
+ */
+extern int io_ring_queue_read(struct io_ring* ring, int fd, const struct iovec* iov,
+                              off_t offset, unsigned long long user_data);
+
+/*
+ * submit the queued reads, and wait till at least 'wait_nr' reads (not
+ * only of these) completed. returns 0, or a negative errno.
+ */
+extern int io_ring_submit(struct io_ring* ring, unsigned wait_nr);
+
+/*
+ * reap a completion, if any.
+ * returns 1, with the read's user data and result (bytes read, or a
+ * negative errno), or 0 if no read completed.
+ */
+extern int io_ring_reap(struct io_ring* ring, unsigned long long* user_data, int* res);
+
+/* tear a ring down. reads still in flight must be reaped first. */
+extern void delete_io_ring(struct io_ring* ring);
+
+#endif /* IO_RING_H */
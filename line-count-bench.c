@@ -0,0 +1,158 @@
+#define _GNU_SOURCE            /* posix_fadvise() and mincore()              */
+#include <stdio.h>             /* standard I/O routines                      */
+#include <stdlib.h>            /* atoi(), malloc() and exit()                */
+#include <unistd.h>            /* close() and sysconf()                      */
+#include <fcntl.h>             /* open() and posix_fadvise()                 */
+#include <time.h>              /* clock_gettime()                            */
+#include <sys/stat.h>          /* fstat()                                    */
+#include <sys/mman.h>          /* mmap() and mincore()                       */
+
+#include "line-count-engine.h" /* parallel line counting engine              */
+
+/*
+ * benchmark of the line counter's I/O backends, on a cold and a warm
+ * page cache. compile with:
+ *     gcc -O2 line-count-bench.c line-count-engine.c io-ring.c byte-count.c -lpthread \
+ *         -o line-count-bench
+ */
+
+/* default number of timed counts of each backend and cache state */
+#define DEFAULT_REPEATS 3
+
+/* page cache states the backends are measured in */
+#define CACHE_COLD 0   /* the file's pages evicted before each count.  */
+#define CACHE_WARM 1   /* the whole file read into the cache before.   */
+
+/* current time, in seconds. */
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* open a file, or exit */
+static int open_file(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+
+    return fd;
+}
+
+/*
+ * evict the (clean) pages of a file from the page cache - no root
+ * privileges needed, unlike dropping the whole cache.
+ */
+static void evict_file(const char* path)
+{
+    int fd = open_file(path);
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/*
+ * get the share of a file's pages in the page cache, in percent - so a
+ * "cold" run whose file the system wouldn't evict shows for what it is.
+ */
+static double resident_percent(const char* path)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    int fd = open_file(path);
+    struct stat st;
+    unsigned char* pages;
+    size_t num_pages;
+    size_t resident = 0;
+    size_t i;
+    void* map;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    num_pages = (st.st_size + page_size - 1) / page_size;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    pages = (unsigned char*)malloc(num_pages);
+    if (map == MAP_FAILED || !pages || mincore(map, st.st_size, pages) != 0) {
+        perror("line-count-bench: mincore");
+        exit(1);
+    }
+    for (i = 0; i < num_pages; i++) {
+        resident += pages[i] & 1;
+    }
+
+    free(pages);
+    munmap(map, st.st_size);
+    close(fd);
+
+    return 100.0 * resident / num_pages;
+}
+
+/*
+ * time counting a file's lines with each backend, cold and warm, and
+ * print the mean as CSV. usage:
+ *     line-count-bench file [repeats]
+ */
+int main(int argc, char* argv[])
+{
+    const char* cache_names[] = { "cold", "warm" };
+    int repeats = DEFAULT_REPEATS;
+    struct stat st;
+    int backend;
+    int cache;
+    int fd;
+
+    if (argc > 2) {
+        repeats = atoi(argv[2]);
+    }
+    if (argc < 2 || argc > 3 || repeats <= 0) {
+        fprintf(stderr, "usage: %s file [repeats]\n", argv[0]);
+        exit(1);
+    }
+    fd = open_file(argv[1]);
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        exit(1);
+    }
+    close(fd);
+
+    printf("backend,cache,resident_pct,bytes,seconds,gb_per_sec,lines\n");
+    for (backend = 0; backend < NUM_LINE_COUNT_BACKENDS; backend++) {
+        for (cache = CACHE_COLD; cache <= CACHE_WARM; cache++) {
+            double resident = 0;
+            double elapsed = 0;
+            long lines = 0;
+            int r;
+
+            for (r = 0; r < repeats; r++) {
+                double start;
+
+                if (cache == CACHE_COLD) {
+                    evict_file(argv[1]);
+                }
+                else {
+                    count_file_lines(argv[1], LINE_COUNT_READ, NULL, NULL);
+                }
+                resident += resident_percent(argv[1]);
+
+                start = now_seconds();
+                lines = count_file_lines(argv[1], backend, NULL, NULL);
+                elapsed += now_seconds() - start;
+            }
+            elapsed /= repeats;
+
+            printf("%s,%s,%.0f,%lld,%.4f,%.2f,%ld\n", line_count_backend_name(backend),
+                   cache_names[cache], resident / repeats, (long long)st.st_size,
+                   elapsed, elapsed > 0 ? st.st_size / elapsed / 1e9 : 0.0, lines);
+            fflush(stdout);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,788 @@
+#define _GNU_SOURCE            /* O_DIRECT, MADV_HUGEPAGE                    */
+#include <stdio.h>             /* standard I/O routines                      */
+#include <stdlib.h>            /* posix_memalign(), free() and exit()        */
+#include <string.h>            /* strcmp()                                   */
+#include <errno.h>             /* errno, EINTR, EINVAL                       */
+#include <time.h>              /* clock_gettime()                            */
+#include <unistd.h>            /* pread(), close() and sysconf()             */
+#include <fcntl.h>             /* open(), O_DIRECT                           */
+#include <sys/stat.h>          /* fstat()                                    */
+#include <sys/mman.h>          /* mmap(), madvise() and munmap()             */
+
+#include "line-count-engine.h" /* line counting engine                       */
+#include "byte-count.h"        /* count_bytes()                              */
+#include "io-ring.h"           /* io_uring instance                          */
+
+/* names of the backends, by LINE_COUNT_* number */
+static const char* backend_names[NUM_LINE_COUNT_BACKENDS] = {
+    "read", "mmap", "direct", "uring"
+};
+
+/*
+ * the two buffers of a double buffered worker, and their reader.
+ * a buffer is full when its length is 0 or more, and empty at -1.
+ */
+struct direct_buffers {
+    struct line_count_job* job;  /* the job read for.                  */
+    char* buf[2];                /* the buffers (page aligned).        */
+    ssize_t len[2];              /* bytes read into each, or -1.       */
+    int done;                    /* the reader read all it will.       */
+    pthread_mutex_t lock;        /* guards 'len' and 'done'.           */
+    pthread_cond_t  changed;     /* signaled when a buffer is filled,  */
+                                 /* emptied, or the reader is done.    */
+};
+
+/* a buffer of an io_uring pipeline */
+struct uring_buffer {
+    char* data;                  /* the buffer (page aligned).         */
+    struct iovec iov;            /* the part of it being read into.    */
+    off_t offset;                /* file offset of its first byte.     */
+    size_t len;                  /* bytes to read into it.             */
+    size_t filled;               /* bytes read into it so far.         */
+};
+
+/*
+ * an io_uring pipeline - a reader thread keeps up to URING_QUEUE_DEPTH
+ * reads of the file in flight, in file order, and queues the buffers
+ * they complete for the workers to count. counted buffers are read into
+ * again.
+ */
+struct uring_pipeline {
+    struct line_count_job* job;  /* the job read for.                  */
+    struct io_ring ring;         /* the ring the reads go through.     */
+    int num_buffers;             /* number of buffers.                 */
+    struct uring_buffer* buffers;/* the buffers.                       */
+    int* free_buffers;           /* buffers to read into (a stack).    */
+    int num_free;                /* number of those.                   */
+    int* ready_buffers;          /* buffers read, waiting to be        */
+    int ready_head;              /* counted (a circular queue).        */
+    int num_ready;               /* number of those.                   */
+    int done;                    /* the reader read all it will.       */
+    pthread_mutex_t lock;        /* guards the buffer lists, 'done'.   */
+    pthread_cond_t  read_done;   /* signaled when a buffer is read,    */
+                                 /* or the reader is done.             */
+    pthread_cond_t  count_done;  /* signaled when a buffer is counted. */
+    pthread_t reader;            /* reader thread's handle.            */
+};
+
+/*
+ * was the job stopped - by a cancel of its caller, or to clean up?
+ * checked between buffers.
+ */
+static int count_stopped(struct line_count_job* job)
+{
+    return atomic_load(&job->stop) || (job->cancel && atomic_load(job->cancel));
+}
+
+/* current time of the monotonic clock, in nanoseconds */
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * count the newlines of a buffer into the worker's count, and publish
+ * them - a couple of relaxed atomic adds per buffer.
+ */
+static void count_buffer(struct count_worker* worker, const char* buf, size_t len)
+{
+    struct line_count_progress* progress = worker->job->progress;
+    long lines = count_bytes(buf, len, '\n');
+
+    worker->count += lines;
+    if (progress) {
+        atomic_fetch_add_explicit(&progress->bytes_done, len, memory_order_relaxed);
+        atomic_fetch_add_explicit(&progress->lines, lines, memory_order_relaxed);
+    }
+}
+
+/* allocate a page aligned buffer of the given size */
+static char* alloc_aligned_buffer(long alignment, size_t size)
+{
+    void* buf;
+
+    if (posix_memalign(&buf, alignment, size) != 0) {
+        fprintf(stderr, "alloc_aligned_buffer: out of memory. exiting\n");
+        exit(1);
+    }
+
+    return (char*)buf;
+}
+
+/*
+ * take the next range of the job not taken yet.
+ * output:    1, with the range's start and end offsets, or 0 if there
+ *            are no ranges left - or the job was stopped.
+ */
+static int take_range(struct line_count_job* job, off_t* pos, off_t* end)
+{
+    long range;
+
+    if (count_stopped(job)) {
+        return 0;
+    }
+    range = atomic_fetch_add(&job->next_range, 1);
+    if (range >= job->num_ranges) {
+        return 0;
+    }
+    *pos = range * job->range_size;
+    *end = *pos + job->range_size;
+    if (*end > job->file_size) {
+        *end = job->file_size;
+    }
+
+    return 1;
+}
+
+/*
+ * read from the file, retrying an interrupted read.
+ * output:    number of bytes read, 0 at the end of the file.
+ */
+static ssize_t read_block(int fd, char* buf, size_t size, off_t pos)
+{
+    ssize_t n;
+
+    do {
+        n = pread(fd, buf, size, pos);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        perror("pread");
+        exit(1);
+    }
+
+    return n;
+}
+
+/*
+ * read a block with O_DIRECT - all of it, up to the file's end.
+ * algorithm: a read may return less than asked for before the end of the
+ *            file - and O_DIRECT only reads on from a page aligned offset.
+ *            so only the whole pages of a short read are kept, and the
+ *            rest is read again from the page it starts on. a read short
+ *            of a whole page is an error.
+ * output:    number of bytes read, 0 at the end of the file.
+ */
+static ssize_t read_direct_block(struct line_count_job* job, char* buf, size_t size, off_t pos)
+{
+    size_t filled = 0;
+
+    while (filled < size) {
+        ssize_t n = read_block(job->fd, buf + filled, size - filled, pos + filled);
+        size_t aligned;
+
+        if (n == 0) {
+            /* the end of the file - or it was truncated while we count it */
+            break;
+        }
+        if (pos + (off_t)(filled + n) >= job->file_size) {
+            filled += n;
+            break;
+        }
+        aligned = (filled + n) / job->page_size * job->page_size;
+        if (aligned == filled) {
+            fprintf(stderr, "read_direct_block: short O_DIRECT read of %zd bytes at "
+                    "offset %lld. exiting\n", n, (long long)(pos + filled));
+            exit(1);
+        }
+        filled = aligned;
+    }
+
+    return filled;
+}
+
+/*
+ * count the newlines of a range with pread(), block by block.
+ * check for a stop between blocks, so a cancel takes effect soon.
+ */
+static void count_range_read(struct count_worker* worker, char* buf, off_t pos, off_t end)
+{
+    struct line_count_job* job = worker->job;
+
+    while (pos < end && !count_stopped(job)) {
+        size_t size = end - pos < COUNT_READ_SIZE ? end - pos : COUNT_READ_SIZE;
+        ssize_t n = read_block(job->fd, buf, size, pos);
+
+        if (n == 0) {
+            /* the file was truncated while we count it */
+            break;
+        }
+        count_buffer(worker, buf, n);
+        pos += n;
+    }
+}
+
+/*
+ * count the newlines of a range by mapping it - no copy at all. the
+ * kernel is told the mapping is read sequentially (so it reads ahead
+ * aggressively, and drops pages behind), and may use huge pages where
+ * the file system supports them.
+ */
+static void count_range_mmap(struct count_worker* worker, off_t pos, off_t end)
+{
+    struct line_count_job* job = worker->job;
+    size_t len = end - pos;
+    size_t offset;
+    char* map;
+
+    map = (char*)mmap(NULL, len, PROT_READ, MAP_PRIVATE, job->fd, pos);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    madvise(map, len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(map, len, MADV_HUGEPAGE);
+#endif
+
+    for (offset = 0; offset < len && !count_stopped(job); offset += COUNT_READ_SIZE) {
+        size_t size = len - offset < COUNT_READ_SIZE ? len - offset : COUNT_READ_SIZE;
+
+        count_buffer(worker, map + offset, size);
+    }
+
+    munmap(map, len);
+}
+
+/*
+ * read the ranges of a double buffered worker with O_DIRECT - into
+ * whichever of its buffers the worker emptied, while it counts the other.
+ * O_DIRECT reads whole pages from page aligned offsets, so the read of a
+ * range's last block is rounded up - a read past the file's end is short.
+ */
+static void* direct_reader(void* data)
+{
+    struct direct_buffers* buffers = (struct direct_buffers*)data;
+    struct line_count_job* job = buffers->job;
+    int next = 0;
+    off_t pos;
+    off_t end;
+
+    while (take_range(job, &pos, &end)) {
+        while (pos < end && !count_stopped(job)) {
+            size_t size = end - pos < COUNT_READ_SIZE ? end - pos : COUNT_READ_SIZE;
+            ssize_t n;
+
+            size = (size + job->page_size - 1) / job->page_size * job->page_size;
+
+            pthread_mutex_lock(&buffers->lock);
+            while (buffers->len[next] >= 0) {
+                pthread_cond_wait(&buffers->changed, &buffers->lock);
+            }
+            pthread_mutex_unlock(&buffers->lock);
+
+            n = read_direct_block(job, buffers->buf[next], size, pos);
+            if (n == 0) {
+                break;
+            }
+            if (n > end - pos) {
+                n = end - pos;
+            }
+
+            pthread_mutex_lock(&buffers->lock);
+            buffers->len[next] = n;
+            pthread_cond_signal(&buffers->changed);
+            pthread_mutex_unlock(&buffers->lock);
+
+            next = 1 - next;
+            pos += n;
+        }
+    }
+
+    pthread_mutex_lock(&buffers->lock);
+    buffers->done = 1;
+    pthread_cond_signal(&buffers->changed);
+    pthread_mutex_unlock(&buffers->lock);
+
+    return NULL;
+}
+
+/*
+ * count the newlines of the buffers a direct_reader() thread fills, in
+ * the order it fills them, till it's done.
+ */
+static void count_direct(struct count_worker* worker)
+{
+    struct line_count_job* job = worker->job;
+    struct direct_buffers buffers;
+    pthread_t reader;
+    int next = 0;
+    int i;
+
+    buffers.job = job;
+    for (i = 0; i < 2; i++) {
+        buffers.buf[i] = alloc_aligned_buffer(job->page_size, COUNT_READ_SIZE);
+        buffers.len[i] = -1;
+    }
+    buffers.done = 0;
+    pthread_mutex_init(&buffers.lock, NULL);
+    pthread_cond_init(&buffers.changed, NULL);
+
+    pthread_create(&reader, NULL, direct_reader, &buffers);
+
+    for (;;) {
+        ssize_t len;
+
+        pthread_mutex_lock(&buffers.lock);
+        while (buffers.len[next] < 0 && !buffers.done) {
+            pthread_cond_wait(&buffers.changed, &buffers.lock);
+        }
+        len = buffers.len[next];
+        pthread_mutex_unlock(&buffers.lock);
+        if (len < 0) {
+            /* the buffers are filled in turn - none is left */
+            break;
+        }
+
+        count_buffer(worker, buffers.buf[next], len);
+
+        pthread_mutex_lock(&buffers.lock);
+        buffers.len[next] = -1;
+        pthread_cond_signal(&buffers.changed);
+        pthread_mutex_unlock(&buffers.lock);
+        next = 1 - next;
+    }
+
+    pthread_join(reader, NULL);
+    pthread_cond_destroy(&buffers.changed);
+    pthread_mutex_destroy(&buffers.lock);
+    for (i = 0; i < 2; i++) {
+        free(buffers.buf[i]);
+    }
+}
+
+/*
+ * queue a read of the rest of an io_uring pipeline's buffer.
+ */
+static void queue_uring_read(struct uring_pipeline* pipeline, int index)
+{
+    struct uring_buffer* buffer = &pipeline->buffers[index];
+
+    buffer->iov.iov_base = buffer->data + buffer->filled;
+    buffer->iov.iov_len = buffer->len - buffer->filled;
+    if (io_ring_queue_read(&pipeline->ring, pipeline->job->fd, &buffer->iov,
+                           buffer->offset + buffer->filled, index) != 0) {
+        fprintf(stderr, "queue_uring_read: submission queue overflow. exiting\n");
+        exit(1);
+    }
+}
+
+/*
+ * the reader of an io_uring pipeline.
+ * algorithm: fills the ring with reads of the next blocks of the file,
+ *            into free buffers, submits them and waits for any to
+ *            complete. a completed read's buffer is queued for the
+ *            workers - a short read is first read on, from where it
+ *            stopped. once stopped, it submits no more reads, but still
+ *            waits for those in flight - the kernel writes into their
+ *            buffers.
+ */
+static void* uring_reader(void* data)
+{
+    struct uring_pipeline* pipeline = (struct uring_pipeline*)data;
+    struct line_count_job* job = pipeline->job;
+    off_t pos = 0;
+    int in_flight = 0;
+
+    for (;;) {
+        unsigned long long index;
+        int res;
+        int rc;
+
+        /* keep the ring full, while there's more to read */
+        pthread_mutex_lock(&pipeline->lock);
+        while (pos < job->file_size && !count_stopped(job) &&
+               pipeline->num_free > 0 && in_flight < URING_QUEUE_DEPTH) {
+            int free_index = pipeline->free_buffers[--pipeline->num_free];
+            struct uring_buffer* buffer = &pipeline->buffers[free_index];
+
+            buffer->offset = pos;
+            buffer->len = job->file_size - pos < COUNT_READ_SIZE ?
+                          job->file_size - pos : COUNT_READ_SIZE;
+            buffer->filled = 0;
+            queue_uring_read(pipeline, free_index);
+            pos += buffer->len;
+            in_flight++;
+        }
+        if (in_flight == 0) {
+            if (pos >= job->file_size || count_stopped(job)) {
+                pthread_mutex_unlock(&pipeline->lock);
+                break;
+            }
+            /* the workers have all the buffers - wait for one */
+            pthread_cond_wait(&pipeline->count_done, &pipeline->lock);
+            pthread_mutex_unlock(&pipeline->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pipeline->lock);
+
+        rc = io_ring_submit(&pipeline->ring, 1);
+        if (rc < 0) {
+            errno = -rc;
+            perror("io_uring_enter");
+            exit(1);
+        }
+
+        while (io_ring_reap(&pipeline->ring, &index, &res)) {
+            struct uring_buffer* buffer = &pipeline->buffers[index];
+
+            if (res == -EINTR || res == -EAGAIN) {
+                queue_uring_read(pipeline, (int)index);
+                continue;
+            }
+            if (res < 0) {
+                errno = -res;
+                perror("io_uring read");
+                exit(1);
+            }
+            buffer->filled += res;
+            if (res > 0 && buffer->filled < buffer->len) {
+                queue_uring_read(pipeline, (int)index);
+                continue;
+            }
+
+            /* read (or the file was truncated) - hand it to the workers */
+            in_flight--;
+            pthread_mutex_lock(&pipeline->lock);
+            pipeline->ready_buffers[(pipeline->ready_head + pipeline->num_ready) %
+                                    pipeline->num_buffers] = (int)index;
+            pipeline->num_ready++;
+            pthread_cond_signal(&pipeline->read_done);
+            pthread_mutex_unlock(&pipeline->lock);
+        }
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->done = 1;
+    pthread_cond_broadcast(&pipeline->read_done);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+/*
+ * count the newlines of the buffers an io_uring pipeline read, in the
+ * order they were read, till its reader is done. a stopped count still
+ * hands the buffers back, uncounted, so the reader can finish.
+ */
+static void count_uring(struct count_worker* worker)
+{
+    struct line_count_job* job = worker->job;
+    struct uring_pipeline* pipeline = job->pipeline;
+
+    for (;;) {
+        struct uring_buffer* buffer;
+        int index;
+
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->num_ready == 0 && !pipeline->done) {
+            pthread_cond_wait(&pipeline->read_done, &pipeline->lock);
+        }
+        if (pipeline->num_ready == 0) {
+            pthread_mutex_unlock(&pipeline->lock);
+            break;
+        }
+        index = pipeline->ready_buffers[pipeline->ready_head];
+        pipeline->ready_head = (pipeline->ready_head + 1) % pipeline->num_buffers;
+        pipeline->num_ready--;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        buffer = &pipeline->buffers[index];
+        if (!count_stopped(job)) {
+            count_buffer(worker, buffer->data, buffer->filled);
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->free_buffers[pipeline->num_free++] = index;
+        pthread_cond_signal(&pipeline->count_done);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+}
+
+/*
+ * set up the io_uring pipeline of a job - a buffer for each read in
+ * flight, and one for each worker to count.
+ * output:    the pipeline, or NULL if io_uring isn't available.
+ */
+static struct uring_pipeline* init_uring_pipeline(struct line_count_job* job)
+{
+    struct uring_pipeline* pipeline;
+    int i;
+
+    pipeline = (struct uring_pipeline*)malloc(sizeof(struct uring_pipeline));
+    if (!pipeline) {
+        fprintf(stderr, "init_uring_pipeline: out of memory. exiting\n");
+        exit(1);
+    }
+    if (init_io_ring(&pipeline->ring, URING_QUEUE_DEPTH) != 0) {
+        free(pipeline);
+        return NULL;
+    }
+
+    pipeline->job = job;
+    pipeline->num_buffers = URING_QUEUE_DEPTH + job->num_workers;
+    pipeline->buffers = (struct uring_buffer*)malloc(pipeline->num_buffers *
+                                                     sizeof(struct uring_buffer));
+    pipeline->free_buffers = (int*)malloc(pipeline->num_buffers * sizeof(int));
+    pipeline->ready_buffers = (int*)malloc(pipeline->num_buffers * sizeof(int));
+    if (!pipeline->buffers || !pipeline->free_buffers || !pipeline->ready_buffers) {
+        fprintf(stderr, "init_uring_pipeline: out of memory. exiting\n");
+        exit(1);
+    }
+    for (i = 0; i < pipeline->num_buffers; i++) {
+        pipeline->buffers[i].data = alloc_aligned_buffer(job->page_size, COUNT_READ_SIZE);
+        pipeline->free_buffers[i] = i;
+    }
+    pipeline->num_free = pipeline->num_buffers;
+    pipeline->ready_head = 0;
+    pipeline->num_ready = 0;
+    pipeline->done = 0;
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->read_done, NULL);
+    pthread_cond_init(&pipeline->count_done, NULL);
+
+    return pipeline;
+}
+
+/*
+ * wait for the reader of an io_uring pipeline to finish, and free the
+ * pipeline.
+ */
+static void delete_uring_pipeline(struct uring_pipeline* pipeline)
+{
+    int i;
+
+    pthread_join(pipeline->reader, NULL);
+    delete_io_ring(&pipeline->ring);
+    pthread_cond_destroy(&pipeline->count_done);
+    pthread_cond_destroy(&pipeline->read_done);
+    pthread_mutex_destroy(&pipeline->lock);
+    for (i = 0; i < pipeline->num_buffers; i++) {
+        free(pipeline->buffers[i].data);
+    }
+    free(pipeline->ready_buffers);
+    free(pipeline->free_buffers);
+    free(pipeline->buffers);
+    free(pipeline);
+}
+
+/*
+ * Count_worker - counts the newlines of ranges of the file.
+ * Takes the next range not taken yet, and counts its newlines through
+ * the job's backend - till no ranges are left, or the job is stopped.
+ */
+static void* count_worker(void* data)
+{
+    struct count_worker* worker = (struct count_worker*)data;
+    struct line_count_job* job = worker->job;
+    char* buf = NULL;
+    off_t pos;
+    off_t end;
+
+    if (job->backend == LINE_COUNT_DIRECT) {
+        count_direct(worker);
+        return NULL;
+    }
+    if (job->backend == LINE_COUNT_URING) {
+        count_uring(worker);
+        return NULL;
+    }
+
+    if (job->backend == LINE_COUNT_READ) {
+        buf = alloc_aligned_buffer(job->page_size, COUNT_READ_SIZE);
+    }
+    while (take_range(job, &pos, &end)) {
+        if (job->backend == LINE_COUNT_MMAP) {
+            count_range_mmap(worker, pos, end);
+        }
+        else {
+            count_range_read(worker, buf, pos, end);
+        }
+    }
+
+    free(buf);
+
+    return NULL;
+}
+
+/*
+ * stop the workers of a line counting job (and its pipeline's reader),
+ * wait for them, and close its file. serves as a cleanup function for
+ * the thread counting the lines.
+ */
+static void stop_count_workers(void* data)
+{
+    struct line_count_job* job = (struct line_count_job*)data;
+
+    atomic_store(&job->stop, 1);
+    for (; job->num_joined < job->num_workers; job->num_joined++) {
+        pthread_join(job->workers[job->num_joined].thread, NULL);
+    }
+    if (job->pipeline) {
+        delete_uring_pipeline(job->pipeline);
+        job->pipeline = NULL;
+    }
+    close(job->fd);
+}
+
+/*
+ * open the file to count, for the given backend.
+ * output:    the file descriptor. the backend becomes LINE_COUNT_READ if
+ *            the file system refuses O_DIRECT.
+ */
+static int open_count_file(const char* path, int* backend)
+{
+    int fd = open(path, O_RDONLY | (*backend == LINE_COUNT_DIRECT ? O_DIRECT : 0));
+
+    if (fd < 0 && errno == EINVAL && *backend == LINE_COUNT_DIRECT) {
+        fprintf(stderr, "count_file_lines: no O_DIRECT for '%s' - "
+                "reading through the page cache\n", path);
+        *backend = LINE_COUNT_READ;
+        fd = open(path, O_RDONLY);
+    }
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+
+    return fd;
+}
+
+/*
+ * count the lines of a file.
+ * algorithm: splits the file into page aligned ranges, and lets a worker
+ *            per CPU count the newlines of the ranges - each taking the
+ *            next range once done with its previous one, so a slow range
+ *            holds up only its own worker. the partial counts are then
+ *            summed.
+ *            with io_uring, a reader thread reads the file in order
+ *            instead, and the workers count the buffers it read.
+ *            setting the cancel flag, or canceling the calling thread
+ *            (it's canceled while waiting for the workers), stops the
+ *            workers after the buffer they're at.
+ * output:    the number of lines - of the buffers counted, if canceled.
+ */
+long count_file_lines(const char* path, int backend, atomic_int* cancel,
+                      struct line_count_progress* progress)
+{
+    struct line_count_job job;
+    struct stat st;
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long wc = 0;
+    int i;
+
+    job.backend = backend;
+    job.fd = open_count_file(path, &job.backend);
+    if (fstat(job.fd, &st) != 0) {
+	    perror("fstat");
+	    exit(1);
+    }
+
+    job.page_size = sysconf(_SC_PAGESIZE);
+    job.file_size = st.st_size;
+    job.range_size = (COUNT_RANGE_SIZE + job.page_size - 1) / job.page_size * job.page_size;
+    job.num_ranges = (job.file_size + job.range_size - 1) / job.range_size;
+    atomic_init(&job.next_range, 0);
+    atomic_init(&job.stop, 0);
+    job.cancel = cancel;
+    job.progress = progress;
+    if (progress) {
+        atomic_store(&progress->total_bytes, job.file_size);
+        atomic_store(&progress->start_ns, now_ns());
+    }
+    job.pipeline = NULL;
+    job.num_workers = num_cpus < 1 ? 1 : num_cpus;
+    if (job.num_workers > MAX_COUNT_WORKERS) {
+        job.num_workers = MAX_COUNT_WORKERS;
+    }
+    if (job.num_workers > job.num_ranges) {
+        job.num_workers = job.num_ranges > 0 ? job.num_ranges : 1;
+    }
+    job.num_joined = 0;
+    if (job.backend == LINE_COUNT_URING) {
+        job.pipeline = init_uring_pipeline(&job);
+        if (!job.pipeline) {
+            fprintf(stderr, "count_file_lines: no io_uring - reading with a pool of "
+                    "pread() workers\n");
+            job.backend = LINE_COUNT_READ;
+        }
+    }
+
+    /* register cleanup handler - if we're canceled, it stops the workers. */
+    /* deferred cancelation (the default) lets it run only while we wait   */
+    /* for the workers.                                                     */
+    pthread_cleanup_push(stop_count_workers, &job);
+
+    for (i = 0; i < job.num_workers; i++) {
+        job.workers[i].job = &job;
+        job.workers[i].count = 0;
+        pthread_create(&job.workers[i].thread, NULL, count_worker, &job.workers[i]);
+    }
+    if (job.pipeline) {
+        pthread_create(&job.pipeline->reader, NULL, uring_reader, job.pipeline);
+    }
+
+    /* wait for the workers */
+    for (; job.num_joined < job.num_workers; job.num_joined++) {
+        pthread_join(job.workers[job.num_joined].thread, NULL);
+    }
+
+    /* pop cleanup handler, while executing it, to close the file. */
+    pthread_cleanup_pop(1);
+
+    /* reduce the workers' partial counts - after the cleanup region,  */
+    /* as a local changed inside it may be clobbered by its longjmp.   */
+    for (i = 0; i < job.num_workers; i++) {
+        wc += job.workers[i].count;
+    }
+
+    return wc;
+}
+
+/* zero a progress struct. */
+void init_line_count_progress(struct line_count_progress* progress)
+{
+    atomic_init(&progress->total_bytes, 0);
+    atomic_init(&progress->bytes_done, 0);
+    atomic_init(&progress->lines, 0);
+    atomic_init(&progress->start_ns, 0);
+}
+
+/* get the throughput of a count so far. */
+double line_count_throughput(struct line_count_progress* progress)
+{
+    long long start = atomic_load(&progress->start_ns);
+    long long elapsed = now_ns() - start;
+
+    if (start == 0 || elapsed <= 0) {
+        return 0;
+    }
+
+    return atomic_load_explicit(&progress->bytes_done, memory_order_relaxed) * 1e9 / elapsed;
+}
+
+/* get a backend by its name. */
+int line_count_backend(const char* name)
+{
+    int backend;
+
+    for (backend = 0; backend < NUM_LINE_COUNT_BACKENDS; backend++) {
+        if (strcmp(name, backend_names[backend]) == 0) {
+            return backend;
+        }
+    }
+
+    return -1;
+}
+
+/* get the name of a backend. */
+const char* line_count_backend_name(int backend)
+{
+    if (backend < 0 || backend >= NUM_LINE_COUNT_BACKENDS) {
+        return "unknown";
+    }
+
+    return backend_names[backend];
+}
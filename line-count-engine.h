@@ -0,0 +1,96 @@
+#ifndef LINE_COUNT_ENGINE_H
+#define LINE_COUNT_ENGINE_H
+
+#include <sys/types.h>   /* off_t                                     */
+#include <stdatomic.h>   /* C11 atomic types and operations           */
+#include <pthread.h>     /* pthread functions and data structures     */
+
+/* the file is split into ranges of this size (rounded up to whole pages), */
+/* which the counting workers take one at a time - and read in blocks of   */
+/* this size.                                                              */
+#define COUNT_RANGE_SIZE (16 * 1024 * 1024)
+#define COUNT_READ_SIZE (1024 * 1024)
+
+/* most counting workers, whatever the number of CPUs */
+#define MAX_COUNT_WORKERS 64
+
+/* how the workers get at the file's bytes */
+#define LINE_COUNT_READ   0  /* pread() into large page aligned buffers.     */
+#define LINE_COUNT_MMAP   1  /* map each range, with sequential/huge page hints. */
+#define LINE_COUNT_DIRECT 2  /* O_DIRECT reads past the page cache, double   */
+                             /* buffered - a reader thread per worker fills  */
+                             /* one buffer while the worker counts the other. */
+#define LINE_COUNT_URING  3  /* an io_uring keeps many reads in flight, and  */
+                             /* feeds their buffers to the workers.          */
+#define NUM_LINE_COUNT_BACKENDS 4
+
+/* reads an io_uring count keeps in flight - enough to keep an NVMe */
+/* drive's queue busy.                                              */
+#define URING_QUEUE_DEPTH 16
+
+struct uring_pipeline;
+
+/*
+ * progress of a line count - published by the workers after each buffer
+ * they count, and read by any thread without locking.
+ */
+struct line_count_progress {
+    atomic_llong total_bytes;    /* size of the file, once opened.     */
+    atomic_llong bytes_done;     /* bytes counted so far.              */
+    atomic_long lines;           /* newlines counted in those.         */
+    atomic_llong start_ns;       /* when the count started (monotonic  */
+                                 /* clock), 0 till then.               */
+};
+
+/* a counting worker - counts the newlines of the ranges it takes */
+struct count_worker {
+    struct line_count_job* job;  /* the job it works on.               */
+    long count;                  /* newlines it counted so far.        */
+    pthread_t thread;            /* worker thread's handle.            */
+};
+
+/* counting the lines of a file, by a pool of workers */
+struct line_count_job {
+    int fd;                      /* the file.                          */
+    int backend;                 /* LINE_COUNT_* I/O backend.          */
+    long page_size;              /* the system's page size.            */
+    off_t file_size;             /* its size, in bytes.                */
+    off_t range_size;            /* size of a range (whole pages).     */
+    long num_ranges;             /* number of ranges in the file.      */
+    atomic_long next_range;      /* next range for a worker to take.   */
+    atomic_int stop;             /* set to make the workers stop.      */
+    atomic_int* cancel;          /* the caller's cancel flag, or NULL. */
+    struct line_count_progress* progress; /* where to publish progress, or NULL. */
+    struct uring_pipeline* pipeline; /* an io_uring count's pipeline.  */
+    int num_workers;             /* number of workers started.         */
+    int num_joined;              /* number of workers joined so far.   */
+    struct count_worker workers[MAX_COUNT_WORKERS];
+};
+
+/*
+ * count the lines of a file, on a worker per CPU, reading it with the
+ * given LINE_COUNT_* backend. a LINE_COUNT_DIRECT count of a file system
+ * without O_DIRECT support, and a LINE_COUNT_URING count where io_uring
+ * isn't available, fall back to LINE_COUNT_READ.
+ * setting '*cancel' (if not NULL) to non-zero stops the count - every
+ * worker checks it between buffers, and the lines counted so far are
+ * returned. the calling thread may also be canceled (with deferred
+ * cancelation) while the workers count.
+ * the count's progress is published in '*progress', if not NULL.
+ */
+extern long count_file_lines(const char* path, int backend, atomic_int* cancel,
+                             struct line_count_progress* progress);
+
+/* zero a progress struct, before a count */
+extern void init_line_count_progress(struct line_count_progress* progress);
+
+/* get the throughput of a count so far, in bytes per second */
+extern double line_count_throughput(struct line_count_progress* progress);
+
+/* get a backend by its name ("read", "mmap", "direct" or "uring"), or -1 */
+extern int line_count_backend(const char* name);
+
+/* get the name of a backend */
+extern const char* line_count_backend_name(int backend);
+
+#endif /* LINE_COUNT_ENGINE_H */
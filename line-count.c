@@ -1,17 +1,39 @@
-
 #include <stdio.h>             /* standard I/O routines                      */
+#include <stdlib.h>            /* system() and exit()                        */
+#include <unistd.h>            /* read(), STDIN_FILENO                       */
+#include <poll.h>              /* poll()                                     */
 #include <pthread.h>           /* pthread functions and data structures      */
+#include <stdatomic.h>         /* C11 atomic types and operations            */
+
+/* link with line-count-engine.c, io-ring.c and byte-count.c */
+#include "line-count-engine.h" /* parallel line counting engine              */
 
 #define DATA_FILE "very_large_data_file"
 
+/* how often the user input thread renders the count's progress, in milliseconds */
+#define PROGRESS_INTERVAL_MS 200
+
 /* global mutex for our program. assignment initializes it. */
 pthread_mutex_t action_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* global condition variable for our program. assignment initializes it. */
 pthread_cond_t  action_cond  = PTHREAD_COND_INITIALIZER;
 
-/**flag to denote if the user requested to cancel the operation in the middle, 0 means 'no'. */
-int cancel_operation = 0;
+/**flag to denote if the user requested to cancel the operation in the middle, 0 means 'no'.
+ * atomic, since the counting workers check it between buffers. */
+atomic_int cancel_operation = 0;
+
+/**flag to denote if the lines were counted, 0 means 'no'. guarded by action_mutex. */
+int count_done = 0;
+
+/**how to read the file - LINE_COUNT_READ, LINE_COUNT_MMAP, LINE_COUNT_DIRECT or LINE_COUNT_URING. */
+int count_backend = LINE_COUNT_READ;
+
+/**progress of the count - published by the counting workers, rendered by the user input thread. */
+struct line_count_progress count_progress;
+
+/**flag to denote if the progress was rendered, 0 means 'no'. read once the user input thread exits. */
+int progress_shown = 0;
 
 /**
  * Restore normal screen mode.
@@ -38,29 +60,78 @@ void restore_coocked_mode(void* dummy)
 #endif
 }
 
+/*
+ * Render the progress of the count, over the status line.
+ * In raw screen mode a newline doesn't return the carriage, so each
+ * rendering starts with a carriage return, and overwrites the last one.
+ */
+void print_progress(void)
+{
+    long long total = atomic_load(&count_progress.total_bytes);
+    long long done = atomic_load_explicit(&count_progress.bytes_done, memory_order_relaxed);
+    long lines = atomic_load_explicit(&count_progress.lines, memory_order_relaxed);
+
+    if (atomic_load(&count_progress.start_ns) == 0) {
+        /* not started yet */
+        return;
+    }
+
+    printf("\rChecking file size (press 'e' to cancel operation)... "
+           "%3.0f%% (%lld of %lld MB), '%ld' lines, %.2f GB/s ",
+           total > 0 ? 100.0 * done / total : 100.0, done >> 20, total >> 20, lines,
+           line_count_throughput(&count_progress) / 1e9);
+    fflush(stdout);
+    progress_shown = 1;
+}
+
 /*
  * Read user input while long operation in progress.
  * Put screen in raw mode (without echo), to allow for unbuffered input.
- * Perform an endless loop of reading user input. If user
- * pressed 'e', signal our condition variable and end the thread.
+ * Perform an endless loop of waiting for user input, rendering the
+ * progress whenever none came for a while. If user pressed 'e', signal
+ * our condition variable and end the thread.
  */
 void* read_user_input(void* data)
 {
-    int c;
+    struct pollfd input;
+    char c;
 
     /* register cleanup handler */
     pthread_cleanup_push(restore_coocked_mode, NULL);
 
-    /* make sure we're in asynchronous cancelation mode so   */
-    /* we can be canceled even when blocked on reading data. */
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+    /* we're canceled (deferred) while waiting for input - no need for */
+    /* asynchronous cancelation, as we never block for more than       */
+    /* PROGRESS_INTERVAL_MS.                                           */
 
     /* put screen in raw data mode */
     system("stty raw -echo");
 
+    input.fd = STDIN_FILENO;
+    input.events = POLLIN;
+
     /* "endless" loop - read data from the user.            */
     /* terminate the loop if we got a 'e', or are canceled. */
-    while ((c = getchar()) != EOF) {
+    for (;;) {
+        int rc = poll(&input, 1, PROGRESS_INTERVAL_MS);
+
+        if (rc == 0) {
+            int state;
+
+            /* don't get canceled in the middle of the rendering */
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+            print_progress();
+            pthread_setcancelstate(state, NULL);
+            continue;
+        }
+        if (rc < 0) {
+            /* interrupted */
+            continue;
+        }
+        if (read(STDIN_FILENO, &c, 1) != 1) {
+            /* no more input - keep rendering the progress, though */
+            input.fd = -1;
+            continue;
+        }
         if (c == 'e') {
 
 #if 0
@@ -71,9 +142,11 @@ void* read_user_input(void* data)
 #endif
 
             /* mark that there was a cancel request by the user */
+            pthread_mutex_lock(&action_mutex);
             cancel_operation = 1;
             /* signify that we are done */
             pthread_cond_signal(&action_cond);
+            pthread_mutex_unlock(&action_mutex);
             pthread_exit(NULL);
         }
     }
@@ -84,34 +157,23 @@ void* read_user_input(void* data)
 
 /*
  * File_line_count - counts the number of lines in the given file.
- * Open the data file, read it character by character, and count all newline characters.
+ * The engine splits the file into page aligned ranges, and counts them
+ * on a worker per CPU, reading it with the chosen I/O backend.
+ * the workers check cancel_operation between buffers, and stop once the
+ * user set it - this thread is never canceled asynchronously, and
+ * returns the lines of the buffers counted till then.
  */
 void* file_line_count(void* data)
 {
     char* data_file = (char*)data;
-    FILE* f = fopen(data_file, "r");
-    int wc = 0;
-    int c;
-
-    if (!f) {
-	    perror("fopen");
-	    exit(1);
-    }
-
-    /* make sure we're in asynchronous cancelation mode so   */
-    /* we can be canceled even when blocked on reading data. */
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-
-    while ((c = getc(f)) != EOF) {
-        if (c == '\n') {
-            wc++;
-        }
-    }
-
-    fclose(f);
+    long wc = count_file_lines(data_file, count_backend, &cancel_operation,
+                               &count_progress);
 
     /* signify that we are done. */
+    pthread_mutex_lock(&action_mutex);
+    count_done = 1;
     pthread_cond_signal(&action_cond);
+    pthread_mutex_unlock(&action_mutex);
 
     return (void*)wc;
 }
@@ -122,19 +184,30 @@ int main(int argc, char* argv[])
     pthread_t thread_line_count; /* 'handle' of line-counting thread.        */
     pthread_t thread_user_input; /* 'handle' of user-input thread.           */
     void* line_count;		 /* return value from line-counting thread.  */
+    char* data_file = argc > 1 ? argv[1] : DATA_FILE; /* file to count.     */
+
+    /* usage: line-count [file] [read|mmap|direct|uring] */
+    if (argc > 2 && (count_backend = line_count_backend(argv[2])) < 0) {
+        fprintf(stderr, "usage: %s [file] [read|mmap|direct|uring]\n", argv[0]);
+        exit(1);
+    }
 
     printf("Checking file size (press 'e' to cancel operation)...");
     fflush(stdout);
 
+    init_line_count_progress(&count_progress);
+
     /* spawn the line counting thread */
-    pthread_create(&thread_line_count, NULL, file_line_count, (void*)DATA_FILE);
+    pthread_create(&thread_line_count, NULL, file_line_count, (void*)data_file);
     /* spawn the user-reading thread */
-    pthread_create(&thread_user_input, NULL, read_user_input, (void*)DATA_FILE);
+    pthread_create(&thread_user_input, NULL, read_user_input, (void*)data_file);
 
     /* lock the mutex, and wait on the condition variable, */
     /* till one of the threads finishes up and signals it. */
     pthread_mutex_lock(&action_mutex);
-    pthread_cond_wait(&action_cond, &action_mutex);
+    while (!cancel_operation && !count_done) {
+        pthread_cond_wait(&action_cond, &action_mutex);
+    }
     pthread_mutex_unlock(&action_mutex);
 
 #if 0
@@ -151,11 +224,16 @@ int main(int argc, char* argv[])
         /* screen mode before we print out.           */
         pthread_join(thread_user_input, NULL);
 
-        printf("operation canceled\n");
-        fflush(stdout);
+        /* the file-checking thread's workers saw the cancel flag - */
+        /* wait till they stopped, after the buffers they were at,  */
+        /* and get the lines they counted so far.                   */
+        pthread_join(thread_line_count, &line_count);
 
-        /* cancel the file-checking thread */
-        pthread_cancel(thread_line_count);
+        printf("%soperation canceled - '%ld' lines in the %lld of %lld MB counted\n",
+               progress_shown ? "\n" : "", (long)line_count,
+               atomic_load(&count_progress.bytes_done) >> 20,
+               atomic_load(&count_progress.total_bytes) >> 20);
+        fflush(stdout);
     }
     else {
         /* join the file line-counting thread, to get its results */
@@ -168,7 +246,7 @@ int main(int argc, char* argv[])
         pthread_join(thread_user_input, NULL);
 
     	/* and print the result */
-        printf("'%d' lines.\n", (int)line_count);
+        printf("%s'%ld' lines.\n", progress_shown ? "\n" : "", (long)line_count);
     }
 
     return 0;
@@ -0,0 +1,404 @@
+#include <stdio.h>       /* vsnprintf()                               */
+#include <stdlib.h>      /* malloc() and free()                       */
+#include <stdarg.h>      /* va_list                                   */
+#include <string.h>      /* strlen()                                  */
+#include <errno.h>       /* EINTR                                     */
+#include <unistd.h>      /* write()                                   */
+#include <sys/uio.h>     /* writev()                                  */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <time.h>        /* nanosleep()                               */
+#include <assert.h>      /* assert()                                  */
+
+#include "async_logger.h"     /* logger functions and macros          */
+#include "request_ring.h"     /* CACHE_LINE_SIZE                      */
+
+/* a single formatted message */
+struct log_record {
+    int length;                                 /* bytes in 'text'.     */
+    char text[LOG_RECORD_SIZE - sizeof(int)];   /* the message itself.  */
+};
+
+/*
+ * single producer (the owning thread) / single consumer (the writer
+ * thread) ring of log records. the producer only writes 'head', the
+ * consumer only writes 'tail', each on its own cache line.
+ */
+struct log_ring {
+    struct log_record records[LOG_RING_RECORDS];
+    atomic_size_t head;          /* next record to fill.                 */
+    char pad0[CACHE_LINE_SIZE - sizeof(atomic_size_t)];
+    atomic_size_t tail;          /* next record to write.                */
+    char pad1[CACHE_LINE_SIZE - sizeof(atomic_size_t)];
+    atomic_int owned;            /* is a thread logging into this ring?  */
+    atomic_long dropped;         /* messages dropped since the ring was full. */
+};
+
+atomic_int log_level = LOG_LEVEL_DEBUG;
+
+/* rings of all threads that ever logged. slots are reused, never freed */
+/* until the logger stops.                                             */
+static struct log_ring* rings[MAX_LOG_RINGS];
+static atomic_int num_rings = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the calling thread's ring, and the key releasing it when it exits */
+static __thread struct log_ring* my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+/* the writer thread's state */
+static int log_fd = -1;
+static atomic_int writer_running = 0;
+static atomic_int writer_stop = 0;
+static pthread_t writer_thread;
+
+/*
+ * write a whole buffer, retrying interrupted and partial writes.
+ */
+static void write_all(int fd, const char* buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buffer += written;
+        length -= written;
+    }
+}
+
+/*
+ * write a vector of buffers, retrying interrupted and partial writes.
+ */
+static void writev_all(int fd, struct iovec* iov, int count)
+{
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        /* skip what was written, maybe ending in the middle of a buffer */
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+/*
+ * when a thread that logged exits - give its ring up. the writer keeps
+ * draining it, and the next thread to claim it continues from its head.
+ */
+static void release_ring(void* a_ring)
+{
+    struct log_ring* ring = (struct log_ring*)a_ring;
+
+    atomic_store_explicit(&ring->owned, 0, memory_order_release);
+}
+
+static void create_ring_key(void)
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+
+/*
+ * get the calling thread's ring - claim a released one, or create one.
+ * output:    the ring, or NULL if all MAX_LOG_RINGS are in use.
+ */
+static struct log_ring* get_my_ring(void)
+{
+    int i;
+
+    if (my_ring) {
+        return my_ring;
+    }
+
+    pthread_once(&ring_key_once, create_ring_key);
+
+    pthread_mutex_lock(&rings_lock);
+    for (i = 0; i < atomic_load(&num_rings); i++) {
+        int expected = 0;
+
+        if (atomic_compare_exchange_strong(&rings[i]->owned, &expected, 1)) {
+            my_ring = rings[i];
+            break;
+        }
+    }
+    if (!my_ring && atomic_load(&num_rings) < MAX_LOG_RINGS) {
+        struct log_ring* ring = (struct log_ring*)malloc(sizeof(struct log_ring));
+
+        if (!ring) {
+            fprintf(stderr, "get_my_ring: out of memory. exiting\n");
+            exit(1);
+        }
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->owned, 1);
+        atomic_init(&ring->dropped, 0);
+        rings[atomic_load(&num_rings)] = ring;
+        /* publish the ring only once it's initialized */
+        atomic_store(&num_rings, atomic_load(&num_rings) + 1);
+        my_ring = ring;
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (my_ring) {
+        pthread_setspecific(ring_key, my_ring);
+    }
+
+    return my_ring;
+}
+
+/*
+ * log a message.
+ * algorithm: formats the message straight into the next free record of
+ *            the calling thread's ring, and publishes it by moving the
+ *            ring's head. no locks, no system calls. a full ring drops
+ *            the message rather than wait for the writer (unless it's
+ *            an error).
+ *            without a writer thread (or a ring), formats it on the
+ *            stack and writes it at once.
+ */
+void log_printf(int level, const char* format, ...)
+{
+    struct log_ring* ring = NULL;
+    va_list args;
+    int length;
+
+    if (atomic_load_explicit(&writer_running, memory_order_acquire)) {
+        ring = get_my_ring();
+    }
+
+    /* errors are never dropped - if the ring is full, write them directly */
+    if (ring && level <= LOG_LEVEL_ERROR &&
+        atomic_load_explicit(&ring->head, memory_order_relaxed) -
+        atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_RECORDS) {
+        ring = NULL;
+    }
+
+    if (ring) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        struct log_record* record;
+
+        if (head - tail >= LOG_RING_RECORDS) {
+            atomic_store_explicit(&ring->dropped,
+                                  atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                                  memory_order_relaxed);
+            return;
+        }
+
+        record = &ring->records[head % LOG_RING_RECORDS];
+        va_start(args, format);
+        length = vsnprintf(record->text, sizeof(record->text), format, args);
+        va_end(args);
+        if (length < 0) {
+            return;
+        }
+        if (length >= (int)sizeof(record->text)) {
+            length = sizeof(record->text) - 1;
+        }
+        record->length = length;
+
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        return;
+    }
+
+    {
+        char text[LOG_RECORD_SIZE];
+
+        va_start(args, format);
+        length = vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        if (length < 0) {
+            return;
+        }
+        if (length >= (int)sizeof(text)) {
+            length = sizeof(text) - 1;
+        }
+        write_all(log_fd >= 0 ? log_fd : STDOUT_FILENO, text, length);
+    }
+}
+
+/*
+ * write out the records pending in all rings.
+ * algorithm: gathers up to LOG_WRITE_BATCH records at a time, from one
+ *            ring or more, into a single writev(), and only then frees
+ *            their slots. reports messages dropped by full rings.
+ * output:    number of records written.
+ */
+static int drain_rings(void)
+{
+    struct iovec iov[LOG_WRITE_BATCH];
+    struct log_ring* batch_rings[LOG_WRITE_BATCH];
+    size_t batch_tails[LOG_WRITE_BATCH];
+    int num_batch_rings = 0;
+    int count = 0;
+    int total = 0;
+    int n = atomic_load(&num_rings);
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        struct log_ring* ring = rings[i];
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+
+        if (dropped > 0) {
+            char text[LOG_RECORD_SIZE];
+            int length = snprintf(text, sizeof(text),
+                                  "logger: dropped '%ld' messages\n", dropped);
+
+            atomic_fetch_sub(&ring->dropped, dropped);
+            write_all(log_fd, text, length);
+        }
+
+        while (tail != head) {
+            struct log_record* record = &ring->records[tail % LOG_RING_RECORDS];
+
+            iov[count].iov_base = record->text;
+            iov[count].iov_len = record->length;
+            count++;
+            tail++;
+
+            if (count == LOG_WRITE_BATCH || tail == head) {
+                batch_rings[num_batch_rings] = ring;
+                batch_tails[num_batch_rings] = tail;
+                num_batch_rings++;
+            }
+            if (count == LOG_WRITE_BATCH) {
+                writev_all(log_fd, iov, count);
+                for (j = 0; j < num_batch_rings; j++) {
+                    atomic_store_explicit(&batch_rings[j]->tail, batch_tails[j],
+                                          memory_order_release);
+                }
+                total += count;
+                count = 0;
+                num_batch_rings = 0;
+            }
+        }
+    }
+
+    if (count > 0) {
+        writev_all(log_fd, iov, count);
+        for (j = 0; j < num_batch_rings; j++) {
+            atomic_store_explicit(&batch_rings[j]->tail, batch_tails[j],
+                                  memory_order_release);
+        }
+        total += count;
+    }
+
+    return total;
+}
+
+/*
+ * the writer thread's loop - drain the rings, sleep a little when they
+ * are empty, until asked to stop. then drain them one last time.
+ */
+static void* write_log(void* data)
+{
+    (void)data;
+
+    while (!atomic_load(&writer_stop)) {
+        if (drain_rings() == 0) {
+            struct timespec delay;
+
+            delay.tv_sec = 0;
+            delay.tv_nsec = LOG_IDLE_SLEEP_US * 1000L;
+            nanosleep(&delay, NULL);
+        }
+    }
+    while (drain_rings() > 0)
+        ;
+
+    return NULL;
+}
+
+/* set the run time log level */
+void set_log_level(int level)
+{
+    atomic_store(&log_level, level);
+}
+
+/*
+ * start the writer thread.
+ * input:     file descriptor to write all messages to.
+ */
+void start_logger(int fd)
+{
+    assert(fd >= 0);
+    assert(!atomic_load(&writer_running));
+
+    log_fd = fd;
+    atomic_store(&writer_stop, 0);
+    pthread_create(&writer_thread, NULL, write_log, NULL);
+    atomic_store_explicit(&writer_running, 1, memory_order_release);
+}
+
+/*
+ * wait until all the messages logged so far were written.
+ */
+void flush_logger(void)
+{
+    int i;
+
+    if (!atomic_load(&writer_running)) {
+        return;
+    }
+
+    for (i = 0; i < atomic_load(&num_rings); i++) {
+        size_t head = atomic_load(&rings[i]->head);
+
+        while (atomic_load(&rings[i]->tail) < head) {
+            struct timespec delay;
+
+            delay.tv_sec = 0;
+            delay.tv_nsec = LOG_IDLE_SLEEP_US * 1000L;
+            nanosleep(&delay, NULL);
+        }
+    }
+}
+
+/*
+ * stop the writer thread, once it wrote all pending messages, and free
+ * the rings. messages logged afterwards are written directly.
+ * must be called once all other threads that logged have exited.
+ */
+void stop_logger(void)
+{
+    int i;
+
+    if (!atomic_load(&writer_running)) {
+        return;
+    }
+
+    atomic_store(&writer_running, 0);
+    atomic_store(&writer_stop, 1);
+    pthread_join(writer_thread, NULL);
+
+    /* the calling thread's ring is about to be freed - forget it */
+    if (my_ring) {
+        pthread_setspecific(ring_key, NULL);
+        my_ring = NULL;
+    }
+    pthread_mutex_lock(&rings_lock);
+    for (i = 0; i < atomic_load(&num_rings); i++) {
+        free(rings[i]);
+        rings[i] = NULL;
+    }
+    atomic_store(&num_rings, 0);
+    pthread_mutex_unlock(&rings_lock);
+}
@@ -0,0 +1,74 @@
+#ifndef ASYNC_LOGGER_H
+#define ASYNC_LOGGER_H
+
+#include <stdatomic.h>   /* C11 atomic types and operations           */
+
+/* log levels - a message is logged if its level is at most the current one */
+#define LOG_LEVEL_OFF   -1
+#define LOG_LEVEL_ERROR  0
+#define LOG_LEVEL_WARN   1
+#define LOG_LEVEL_INFO   2
+#define LOG_LEVEL_DEBUG  3
+
+/*
+ * messages above this level are compiled out entirely - e.g. build with
+ * -DLOG_COMPILE_LEVEL=LOG_LEVEL_INFO to drop the per-request lines.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+/* size of a single log record, message included. longer ones are truncated. */
+#define LOG_RECORD_SIZE 128
+
+/* number of records in a thread's ring */
+#define LOG_RING_RECORDS 256
+
+/* maximal number of threads with their own ring at once */
+#define MAX_LOG_RINGS 64
+
+/* maximal number of records written by a single writev() */
+#define LOG_WRITE_BATCH 64
+
+/* how long the writer thread sleeps when there is nothing to write */
+#define LOG_IDLE_SLEEP_US 1000
+
+/* current (run time) log level */
+extern atomic_int log_level;
+
+/*
+ * log a message, printf style. costs a comparison when the level is
+ * switched off at run time, and nothing at all when it's compiled out.
+ */
+#define log_message(level, ...)                                               \
+    do {                                                                      \
+        if ((level) <= LOG_COMPILE_LEVEL &&                                   \
+            (level) <= atomic_load_explicit(&log_level, memory_order_relaxed)) \
+            log_printf((level), __VA_ARGS__);                                 \
+    } while (0)
+
+/*
+ * format a message into the calling thread's ring, for the writer thread
+ * to write. never blocks: if the ring is full the message is dropped
+ * (and counted), unless it's an error. if no writer thread runs, the message is written
+ * directly with a single write().
+ */
+extern void log_printf(int level, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* set the run time log level */
+extern void set_log_level(int level);
+
+/* start the writer thread, writing all threads' messages to 'fd' */
+extern void start_logger(int fd);
+
+/* wait until all messages logged so far were written */
+extern void flush_logger(void);
+
+/*
+ * write all pending messages, and stop the writer thread. call it once
+ * all other threads that logged have exited.
+ */
+extern void stop_logger(void);
+
+#endif /* ASYNC_LOGGER_H */
@@ -0,0 +1,161 @@
+#define _GNU_SOURCE             /* sched_getaffinity(), CPU_ISSET()          */
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* malloc(), free() and strtol()             */
+#include <sched.h>       /* sched_getaffinity()                       */
+#include <assert.h>      /* assert()                                  */
+
+#include "cpu_topology.h"        /* CPU topology functions/structs       */
+
+/*
+ * parse a CPU list, as printed by the kernel ("0-3,8,10-11"), into a set.
+ * output:    0 on success, -1 if the list is malformed.
+ */
+static int parse_cpu_list(const char* list, cpu_set_t* set)
+{
+    const char* p = list;
+
+    CPU_ZERO(set);
+    while (*p && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+
+        if (end == p || first < 0) {
+            return -1;
+        }
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+            p = end;
+        }
+        for (; first <= last && first < MAX_TOPOLOGY_CPUS; first++) {
+            CPU_SET(first, set);
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * read the CPUs of a NUMA node from the sysfs.
+ * output:    0 on success, -1 if the node doesn't exist.
+ */
+static int read_node_cpus(int node, cpu_set_t* set)
+{
+    char path[64];
+    char list[4096];
+    FILE* f;
+    int rc = -1;
+
+    snprintf(path, sizeof(path), NODE_CPULIST_FORMAT, node);
+    f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    if (fgets(list, sizeof(list), f)) {
+        rc = parse_cpu_list(list, set);
+    }
+    fclose(f);
+
+    return rc;
+}
+
+/*
+ * add a node holding the usable CPUs of 'set' not seen yet, if any.
+ */
+static void add_topology_node(struct cpu_topology* topology,
+                              const cpu_set_t* set, const cpu_set_t* allowed)
+{
+    int node = topology->num_nodes;
+    int cpu;
+
+    topology->node_first[node] = topology->num_cpus;
+    topology->node_cpus[node] = 0;
+    for (cpu = 0; cpu < MAX_TOPOLOGY_CPUS; cpu++) {
+        if (CPU_ISSET(cpu, set) && CPU_ISSET(cpu, allowed) &&
+            topology->cpu_node[cpu] < 0) {
+            topology->cpus[topology->num_cpus++] = cpu;
+            topology->cpu_node[cpu] = node;
+            topology->node_cpus[node]++;
+        }
+    }
+    if (topology->node_cpus[node] > 0) {
+        topology->num_nodes++;
+    }
+}
+
+/*
+ * discover the CPU topology.
+ * algorithm: takes the CPUs of the process's affinity mask, and groups
+ *            them by the NUMA nodes listed in the sysfs. nodes without
+ *            usable CPUs are skipped. usable CPUs of no listed node (or
+ *            all of them, without NUMA information) form a node of
+ *            their own, last.
+ * output:    pointer to the topology.
+ * memory:    the topology need to be freed with delete_cpu_topology().
+ */
+struct cpu_topology* init_cpu_topology(void)
+{
+    struct cpu_topology* topology;
+    cpu_set_t allowed;
+    cpu_set_t set;
+    int i;
+
+    topology = (struct cpu_topology*)malloc(sizeof(struct cpu_topology));
+    if (!topology) {
+        fprintf(stderr, "init_cpu_topology: out of memory. exiting\n");
+        exit(1);
+    }
+    topology->num_cpus = 0;
+    topology->num_nodes = 0;
+    for (i = 0; i < MAX_TOPOLOGY_CPUS; i++) {
+        topology->cpu_node[i] = -1;
+    }
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+
+    for (i = 0; i < MAX_TOPOLOGY_NODES - 1; i++) {
+        if (read_node_cpus(i, &set) == 0) {
+            add_topology_node(topology, &set, &allowed);
+        }
+    }
+
+    /* CPUs the sysfs didn't place on any node */
+    add_topology_node(topology, &allowed, &allowed);
+
+    return topology;
+}
+
+/*
+ * get the node of a CPU number.
+ */
+int topology_cpu_node(const struct cpu_topology* topology, int cpu)
+{
+    assert(topology);
+
+    if (cpu < 0 || cpu >= MAX_TOPOLOGY_CPUS) {
+        return -1;
+    }
+
+    return topology->cpu_node[cpu];
+}
+
+/*
+ * free a topology.
+ */
+void delete_cpu_topology(struct cpu_topology* topology)
+{
+    assert(topology);
+
+    free(topology);
+}
@@ -0,0 +1,34 @@
+#ifndef CPU_TOPOLOGY_H
+#define CPU_TOPOLOGY_H
+
+/* maximal CPU number, and number of NUMA nodes, we keep track of */
+#define MAX_TOPOLOGY_CPUS 1024
+#define MAX_TOPOLOGY_NODES 64
+
+/* where the sysfs lists the CPUs of each NUMA node */
+#define NODE_CPULIST_FORMAT "/sys/devices/system/node/node%d/cpulist"
+
+/*
+ * the CPUs the process may run on, grouped by NUMA node.
+ * nodes are numbered densely from 0, in the order of the system's node
+ * numbers. a machine without NUMA information has a single node.
+ */
+struct cpu_topology {
+    int num_cpus;                        /* number of usable CPUs.          */
+    int cpus[MAX_TOPOLOGY_CPUS];         /* their CPU numbers, by node.     */
+    int cpu_node[MAX_TOPOLOGY_CPUS];     /* node of each CPU number, or -1. */
+    int num_nodes;                       /* number of nodes with usable CPUs. */
+    int node_first[MAX_TOPOLOGY_NODES];  /* index in 'cpus' of a node's first CPU. */
+    int node_cpus[MAX_TOPOLOGY_NODES];   /* number of usable CPUs of a node. */
+};
+
+/* discover the CPUs the calling process may run on, and their nodes */
+extern struct cpu_topology* init_cpu_topology(void);
+
+/* get the node of a CPU number, or -1 if it's not usable (or unknown) */
+extern int topology_cpu_node(const struct cpu_topology* topology, int cpu);
+
+/* free a topology */
+extern void delete_cpu_topology(struct cpu_topology* topology);
+
+#endif /* CPU_TOPOLOGY_H */
@@ -1,51 +1,216 @@
+#define _GNU_SOURCE             /* sched_getcpu()                            */
 #include <stdio.h>       /* standard I/O routines                     */
+#include <sched.h>       /* sched_getcpu()                            */
 #include <pthread.h>     /* pthread functions and data structures     */
 #include <stdlib.h>      /* malloc() and free()                       */
 #include <assert.h>      /* assert()                                  */
 
 #include "requests_queue.h"   /* requests queue routines/structs      */
+#include "work_stealing.h"    /* work stealing scheduler              */
 #include "handler_thread.h"   /* handler thread functions/structs     */
+#include "monotonic_clock.h"  /* monotonic_ns()                       */
+#include "pool_metrics.h"     /* per thread latency histograms        */
+#include "async_logger.h"     /* log_message()                        */
 
-extern int done_creating_requests;   /* are we done creating new requests? */
+/*
+ * release the request the thread is handling, once it's done with it or
+ * if it's cancelled in the middle.
+ */
+static void cleanup_release_request(void* thread_params)
+{
+    struct handler_thread_params* data = (struct handler_thread_params*)thread_params;
+
+    release_request(data->requests, data->current_request);
+    data->current_request = NULL;
+}
+
+/*
+ * when the thread exits or is cancelled - release its work stealing slot,
+ * give the requests cached by this thread back to the queue's pool, and
+ * tell the pool we exited, so it can join us.
+ */
+static void cleanup_thread_exit(void* thread_params)
+{
+    struct handler_thread_params* data = (struct handler_thread_params*)thread_params;
+
+    if (data->scheduler) {
+        ws_detach_worker(data->scheduler, data->ws_index);
+    }
+    flush_request_cache(data->requests);
+
+    pthread_mutex_lock(data->exit_mutex);
+    data->exited = 1;
+    pthread_cond_broadcast(data->thread_exited);
+    pthread_mutex_unlock(data->exit_mutex);
+}
+
+/*
+ * take the next request to handle - from the work stealing scheduler if
+ * the thread's pool has one, or else from the requests queue.
+ */
+static struct request* take_request(struct handler_thread_params* data)
+{
+    if (data->scheduler) {
+        return ws_get_request(data->scheduler, data->ws_index);
+    }
+
+    return get_request(data->requests);
+}
 
 /*
- * free the mutex, if it's locked.
+ * add 'delta' to one of the thread's load counters. only the thread
+ * itself writes them, so no read-modify-write atomic is needed.
  */
-static void cleanup_free_mutex(void* a_mutex)
+static void add_to_counter(atomic_llong* counter, long long delta)
 {
-    pthread_mutex_t* p_mutex = (pthread_mutex_t*)a_mutex;
+    atomic_store_explicit(counter,
+                          atomic_load_explicit(counter, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
 
-    if (p_mutex) {
-        pthread_mutex_unlock(p_mutex);
-	}
+/*
+ * tell the CPU we are busy waiting - saves power, and frees the core's
+ * resources for its sibling hyper-thread.
+ */
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#else
+    atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+/*
+ * spin for a while, polling for a request, before parking.
+ * algorithm: the spin budget follows the thread's average idle gap - the
+ *            time from running out of requests till the next one came.
+ *            if requests come faster than the pool's spin limit, spin
+ *            for about twice that gap; if they come slower, don't spin at
+ *            all - parking right away costs no CPU while idle.
+ * input:     thread's parameters, when it ran out of requests.
+ * output:    a request, or NULL if none came (or we should stop).
+ */
+static struct request* spin_for_request(struct handler_thread_params* data, long long idle_ns)
+{
+    long long max_spin_ns = atomic_load_explicit(data->max_spin_ns, memory_order_relaxed);
+    long long budget = 2 * data->idle_gap_ns;
+    struct request* a_request;
+    int i;
+
+    if (max_spin_ns <= 0 || data->idle_gap_ns > max_spin_ns) {
+        return NULL;
+    }
+    if (budget < MIN_SPIN_NS) {
+        budget = MIN_SPIN_NS;
+    }
+    if (budget > max_spin_ns) {
+        budget = max_spin_ns;
+    }
+
+    while (monotonic_ns() - idle_ns < budget) {
+        for (i = 0; i < SPIN_PAUSES; i++) {
+            cpu_relax();
+        }
+        if ((a_request = take_request(data)) != NULL) {
+            add_to_counter(&data->metrics->spin_hits, 1);
+            return a_request;
+        }
+        if (atomic_load(data->shutdown) || atomic_load(&data->retire)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * count a migration, if the thread runs on another CPU than it did when
+ * it handled its previous request - and a node migration, if that CPU is
+ * on another NUMA node.
+ */
+static void track_migration(struct handler_thread_params* data)
+{
+    int cpu = sched_getcpu();
+
+    if (cpu < 0 || cpu == data->last_cpu) {
+        return;
+    }
+    if (data->last_cpu >= 0) {
+        add_to_counter(&data->metrics->migrations, 1);
+        if (topology_cpu_node(data->topology, cpu) !=
+            topology_cpu_node(data->topology, data->last_cpu)) {
+            add_to_counter(&data->metrics->node_migrations, 1);
+        }
+    }
+    data->last_cpu = cpu;
 }
 
 /*
  * handle/perform a single given request.
- * algorithm: prints a message stating that the given thread handled the given request.
+ * algorithm: runs the request's task, if it has one. otherwise logs a
+ *            message stating that the given thread handled the given request.
  * input:     request pointer, id of calling thread.
  */
-static void handle_request(struct request* a_request, int thread_id)
+static void handle_request(struct handler_thread_params* data, struct request* a_request,
+                           int thread_id)
 {
-    if (a_request)
+    if (a_request && a_request->function) {
+        run_task_request(data->requests, a_request);
+    }
+    else if (a_request)
 	{
-		printf("Thread '%d' handled request '%d'\n", thread_id, a_request->number);
-		fflush(stdout);
+		log_message(LOG_LEVEL_DEBUG, "Thread '%d' handled request '%d'\n",
+		            thread_id, a_request->number);
+		/* delay some time, for some part of request execution */
+		for (int i = 0; i<300000; i++)
+			;
+    }
+}
+
+/*
+ * handle a request in its producer's thread, and release it.
+ */
+void handle_request_in_caller(struct requests_queue* queue, struct request* a_request)
+{
+    assert(queue);
+    assert(a_request);
+
+    if (a_request->function) {
+        run_task_request(queue, a_request);
+    }
+    else {
+		log_message(LOG_LEVEL_DEBUG, "Caller handled request '%d'\n", a_request->number);
 		/* delay some time, for some part of request execution */
 		for (int i = 0; i<300000; i++)
 			;
     }
+    release_request(queue, a_request);
 }
 
 /*
  * infinite loop of requests handling
- * ::forever, if there are requests to handle, take the first and handle it.
- * Then wait on the given condition variable, and when it is signaled, re-do the loop.
- * increases number of pending requests by one.
+ * ::forever, lock the queue only long enough to take the first pending request,
+ * then unlock it and handle the request, so other handler threads can dequeue
+ * and handle requests in parallel. if no request is pending, spin for a
+ * while if the pool allows it and requests have been coming in quickly,
+ * then park on the queue until a producer wakes this very thread, and
+ * re-do the loop.
+ * cancellation is deferred: a cleanup handler releases the request if we are
+ * cancelled while handling it.
+ * if the pool uses work stealing, the thread owns a local deque while it
+ * runs, and takes requests from it before stealing from its peers.
+ * if the pool asks the thread to retire, or it takes a retire token off
+ * the queue, it exits after the current request.
+ * a request taken past its deadline is dropped, not handled.
+ * when the pool shuts down, the thread exits once there are no more
+ * requests to take - or right after the current request, unless the
+ * pool drains its queue.
  */
 void* handle_requests_loop(void* thread_params)
 {
-    int rc;								/* return code of pthreads functions.  */
     struct request* a_request;			/* pointer to a request.               */
     struct handler_thread_params *data; /* hadler thread's parameters */
 
@@ -53,65 +218,130 @@ void* handle_requests_loop(void* thread_params)
     data = (struct handler_thread_params*)thread_params;
     assert(data);
 
-    printf("#KA# Starting thread '%d'\n", data->thread_id);
-    fflush(stdout);
+    log_message(LOG_LEVEL_INFO, "#KA# Starting thread '%d' of pool '%s'\n",
+                data->thread_id, data->pool_name);
 
     /* set my cancel state to 'enabled', and cancel type to 'defered'. */
     pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
     pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
 
-    /* set thread cleanup handler, register  */
-    pthread_cleanup_push(cleanup_free_mutex, (void*)data->request_mutex);
+    /* claim a local deque, if the pool uses work stealing. */
+    data->ws_index = data->scheduler ? ws_attach_worker(data->scheduler, data->home_node) : -1;
+    pthread_cleanup_push(cleanup_thread_exit, (void*)data);
 
-    /* lock the mutex, to access the requests list exclusively. */
-    rc = pthread_mutex_lock(data->request_mutex);
-
-#if 0
-#ifdef DEBUG
-    printf("thread '%d' after pthread_mutex_lock\n", data->thread_id);
-    fflush(stdout);
-#endif /* DEBUG */
-#endif
+    atomic_store(&data->last_active_ns, monotonic_ns());
+    data->last_cpu = sched_getcpu();
 
     /* do forever.... */
     while (1) {
+        long long start_ns;             /* when handling the request started. */
 
-        int num_requests = get_requests_number(data->requests);
+        /* were we asked to retire, or to stop taking requests? */
+        if (atomic_load(&data->retire) ||
+            atomic_load(data->shutdown) >= POOL_SHUTDOWN_FINISH) {
+            break;
+        }
 
-#if 0
-#ifdef DEBUG
-    	printf("thread '%d', num_requests =  %d\n",
-	       data->thread_id, num_requests);
-    	fflush(stdout);
-#endif /* DEBUG */
-#endif
+        /* when the pool aborts, it cancels us - even while idle. */
+        pthread_testcancel();
+
+        /* take the first request without locking the mutex ourselves - */
+        /* the queue or scheduler guards it, and with a ring backend or   */
+        /* work stealing this doesn't touch the mutex at all.             */
+        a_request = take_request(data);
+
+        if (!a_request) {
+            long long idle_ns = monotonic_ns();  /* when we ran out of requests. */
+
+            /* a request may be just about to come - spin, it's cheaper */
+            /* than a sleep and a wakeup.                               */
+            a_request = spin_for_request(data, idle_ns);
+
+            /* park on the queue, then take the first request one last time - */
+            /* a request added after we parked wakes us, so none is missed.   */
+            /* if the pool is shutting down, or we are asked to retire, stop. */
+            /* a wakeup that finds nothing to do is counted as spurious.      */
+            if (!a_request) {
+                int woken = 0;
+
+                while (1) {
+                    prepare_request_wait(data->requests, &data->waiter);
+                    a_request = take_request(data);
+                    if (a_request || atomic_load(data->shutdown) ||
+                        atomic_load(&data->retire)) {
+                        cancel_request_wait(data->requests, &data->waiter);
+                        break;
+                    }
+                    if (woken) {
+                        add_to_counter(&data->metrics->spurious_wakeups, 1);
+                    }
+                    add_to_counter(&data->metrics->parks, 1);
+                    wait_for_requests(data->requests, &data->waiter);
+                    woken = 1;
+                }
+            }
+
+            /* learn how long requests take to come, to tune the spinning */
+            if (a_request) {
+                data->idle_gap_ns += (monotonic_ns() - idle_ns - data->idle_gap_ns) /
+                                     IDLE_GAP_WEIGHT;
+            }
+        }
 
-		if (num_requests > 0) { /* a request is pending */
-			a_request = get_request(data->requests);
-			if (a_request) { /* got a request - handle the request and free it */
-				handle_request(a_request, data->thread_id);
-				free(a_request);
-			}
-		}
-		else {
-			/* the thread checks the flag before waiting            */
-			/* on the condition variable.                           */
-			/* if no new requests are going to be generated, exit.  */
-			if (done_creating_requests) {
-				pthread_mutex_unlock(data->request_mutex);
-				printf("thread '%d' exiting\n", data->thread_id);
-				fflush(stdout);
-				pthread_exit(NULL);
-			}
-			/* wait for a request to arrive. note the mutex will be unlocked here, */
-			/* thus allowing other threads access to requests list.                */
-			rc = pthread_cond_wait(data->got_request, data->request_mutex);
-			/* and after we return from pthread_cond_wait, the mutex  */
-			/* is locked again, so we don't need to lock it ourselves */
-		}
+        if (!a_request) {
+            /* the pool is shutting down and the queue is drained, or we */
+            /* are asked to retire - exit.                               */
+            break;
+        }
+
+        if (a_request->retire_token) {
+            /* we took a poison pill - retire. */
+            release_request(data->requests, a_request);
+            atomic_store(&data->retire, 1);
+            break;
+        }
+
+        start_ns = monotonic_ns();
+
+        /* nobody waits for it anymore - don't waste time on it. */
+        if (request_expired(a_request, start_ns)) {
+            expire_request(data->requests, a_request);
+            continue;
+        }
+
+        add_to_counter(&data->wait_ns, start_ns - a_request->enqueue_ns);
+        histogram_record(&data->metrics->wait_time, start_ns - a_request->enqueue_ns);
+        atomic_store_explicit(&data->busy, 1, memory_order_relaxed);
+
+        /* handle the request with the mutex unlocked. release the request */
+        /* even if we are cancelled in the middle of handling it.          */
+        data->current_request = a_request;
+        pthread_cleanup_push(cleanup_release_request, (void*)data);
+        handle_request(data, a_request, data->thread_id);
+        pthread_cleanup_pop(1);
+
+        /* account for the request in the thread's load counters */
+        {
+            long long end_ns = monotonic_ns();
+
+            add_to_counter(&data->busy_ns, end_ns - start_ns);
+            histogram_record(&data->metrics->service_time, end_ns - start_ns);
+            atomic_store_explicit(&data->num_handled,
+                                  atomic_load_explicit(&data->num_handled,
+                                                       memory_order_relaxed) + 1,
+                                  memory_order_relaxed);
+            atomic_store_explicit(&data->last_active_ns, end_ns, memory_order_relaxed);
+            atomic_store_explicit(&data->busy, 0, memory_order_relaxed);
+        }
+        track_migration(data);
     }
 
-    /* remove thread cleanup handler. never reached, but we must use */
-    /* it here, according to pthread_cleanup_push's manual page.     */
-    pthread_cleanup_pop(0);
+    /* pop the cleanup handler, while executing it, to release our deque */
+    /* and cached requests.                                              */
+    pthread_cleanup_pop(1);
+
+    log_message(LOG_LEVEL_INFO, "thread '%d' of pool '%s' exiting\n",
+                data->thread_id, data->pool_name);
+
+    return NULL;
 }
@@ -3,18 +3,66 @@
 
 #include <stdio.h>       /* standard I/O routines                     */
 #include <pthread.h>     /* pthread functions and data structures     */
+#include <stdatomic.h>   /* C11 atomic types and operations           */
+
+#include "requests_queue.h"   /* requests queue routines/structs      */
+#include "cpu_topology.h"     /* NUMA nodes of the CPUs               */
+
+/* number of pause instructions between two polls for a request, */
+/* while spinning before parking.                                */
+#define SPIN_PAUSES 64
+
+/* shortest spin before parking, when the pool allows spinning */
+#define MIN_SPIN_NS 1000
+
+/* weight of the history in the average gap between requests (1/n new) */
+#define IDLE_GAP_WEIGHT 8
+
+/* shutdown modes of a pool - see shutdown_handler_threads_pool() */
+#define POOL_SHUTDOWN_NONE   0  /* running.                                 */
+#define POOL_SHUTDOWN_DRAIN  1  /* handle all queued requests, then exit.   */
+#define POOL_SHUTDOWN_FINISH 2  /* finish the requests in hand, then exit - */
+                                /* queued requests are cancelled.           */
+#define POOL_SHUTDOWN_ABORT  3  /* cancel the threads, even mid-request.    */
 
 /* handler thread parameters structure.                      */
 /* this is used to pass a thread several parameters,         */
 /* even thought a thread's function gets only one parameter. */
 struct handler_thread_params {
     int thread_id;                  /* 'id' of thread                  */
-    pthread_mutex_t* request_mutex; /* mutex to access requests queue. */
-    pthread_cond_t*  got_request;   /* condition variable of queue.    */
+    const char* pool_name;          /* name of the thread's pool.      */
     struct requests_queue* requests;/* queue of pending requests.      */
+    struct request_waiter waiter;   /* parking slot on the queue.      */
+    struct ws_scheduler* scheduler; /* work stealing scheduler, or NULL. */
+    int ws_index;                   /* thread's slot in the scheduler.  */
+    struct request* current_request;/* request being handled, if any.  */
+    atomic_int retire;              /* exit after the current request? */
+    atomic_int busy;                /* handling a request right now?   */
+    int exited;                     /* has the thread exited its loop? */
+    pthread_mutex_t* exit_mutex;    /* guards 'exited'.                */
+    pthread_cond_t*  thread_exited; /* signaled when it exits.         */
+    /* load counters - written by the thread itself only, read by the pool. */
+    atomic_llong last_active_ns;    /* when it last became idle.       */
+    atomic_long num_handled;        /* number of requests handled.     */
+    atomic_llong wait_ns;           /* total time those waited queued. */
+    atomic_llong busy_ns;           /* total time spent handling them. */
+    struct worker_metrics* metrics; /* latency histograms and counters. */
+    atomic_llong* max_spin_ns;      /* pool's spin limit, 0 to not spin. */
+    atomic_int* shutdown;           /* pool's POOL_SHUTDOWN_* mode.     */
+    long long idle_gap_ns;          /* average wait for the next request. */
+    const struct cpu_topology* topology; /* CPUs' nodes.              */
+    int home_cpu;                   /* CPU it's pinned to, or -1.       */
+    int home_node;                  /* node it's bound to, or -1.       */
+    int last_cpu;                   /* CPU it last handled a request on. */
 };
 
 /* a handler thread's main loop function */
 extern void* handle_requests_loop(void* thread_params);
 
+/*
+ * handle a request in the calling thread, instead of a handler thread -
+ * e.g. when the queue is full, and its producer runs it - and release it.
+ */
+extern void handle_request_in_caller(struct requests_queue* queue, struct request* a_request);
+
 #endif /* HANDLER_THREAD_H */
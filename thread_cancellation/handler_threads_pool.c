@@ -1,17 +1,21 @@
+#define _GNU_SOURCE                   /* pthread_attr_setaffinity_np()            */
 #include <stdio.h>              /* standard I/O routines                    */
 #include <pthread.h>            /* pthread functions and data structures    */
+#include <sched.h>              /* cpu_set_t, CPU_SET(), sched_yield()      */
 #include <stdlib.h>             /* malloc() and free()                      */
+#include <string.h>             /* strncpy()                                */
+#include <errno.h>              /* ESHUTDOWN, ETIMEDOUT                     */
+#include <time.h>               /* clock_gettime()                          */
 #include <assert.h>      /* assert()                                  */
 
 #include "handler_threads_pool.h" /* handler threads pool functions/structs */
+#include "pool_supervisor.h"      /* pool autoscaling supervisor            */
+#include "monotonic_clock.h"      /* monotonic_ns()                         */
 
 /*
- * create a handler threads pool. associate it with the given mutex
- * and condition variables.
+ * create a handler threads pool, handling the requests of the given queue.
  */
-struct handler_threads_pool* init_handler_threads_pool(pthread_mutex_t* p_mutex,
-			  pthread_cond_t*  p_cond_var,
-			  struct requests_queue* requests)
+struct handler_threads_pool* init_handler_threads_pool(struct requests_queue* requests)
 {
     struct handler_threads_pool* pool =
       (struct handler_threads_pool*)malloc(sizeof(struct handler_threads_pool));
@@ -21,50 +25,384 @@ struct handler_threads_pool* init_handler_threads_pool(pthread_mutex_t* p_mutex,
         exit(1);
     }
     /* initialize queue */
+    set_handler_threads_pool_name(pool, "pool");
     pool->threads = NULL;
     pool->last_thread = NULL;
     pool->num_threads = 0;
     pool->max_thr_id = 0;
-    pool->p_mutex = p_mutex;
-    pool->p_cond_var = p_cond_var;
     pool->requests = requests;
+    pool->scheduler = NULL;
+    pool->thread_objects = init_object_pool(sizeof(struct handler_thread));
+    pthread_mutex_init(&pool->threads_lock, NULL);
+    pthread_cond_init(&pool->thread_exited, NULL);
+    pool->retired_handled = 0;
+    pool->retired_wait_ns = 0;
+    pool->retired_busy_ns = 0;
+    pool->threads_added = 0;
+    pool->threads_removed = 0;
+    init_histogram_snapshot(&pool->retired_wait_time);
+    init_histogram_snapshot(&pool->retired_service_time);
+    pool->retired_spurious_wakeups = 0;
+    pool->retired_spin_hits = 0;
+    pool->retired_parks = 0;
+    pool->retired_migrations = 0;
+    pool->retired_node_migrations = 0;
+    atomic_init(&pool->max_spin_ns, DEFAULT_MAX_SPIN_US * 1000LL);
+    atomic_init(&pool->shutdown, POOL_SHUTDOWN_NONE);
+    atomic_init(&pool->closed, 0);
+    atomic_init(&pool->num_submitters, 0);
+    pool->placement = THREAD_PLACEMENT_NONE;
+    pool->topology = init_cpu_topology();
+    pool->supervisor = NULL;
+    pool->metrics_dumper = NULL;
 
     return pool;
 }
 
+/*
+ * create a handler threads pool using work stealing, on top of the shared
+ * requests queue.
+ */
+struct handler_threads_pool* init_work_stealing_pool(struct requests_queue* requests)
+{
+    struct handler_threads_pool* pool = init_handler_threads_pool(requests);
+
+    pool->scheduler = init_ws_scheduler(requests);
+    pool->scheduler->topology = pool->topology;
+
+    return pool;
+}
+
+/*
+ * queue a created request - through the work stealing scheduler if the
+ * pool has one, or else to its requests queue. if the full queue refuses
+ * it, the caller handles it if the queue's policy says so, or else it's
+ * released (a task is cancelled).
+ * algorithm: the caller counts itself as a submitter before checking that
+ *            the pool is open, and shutdown_handler_threads_pool() closes
+ *            the pool before waiting for the submitters to leave (both
+ *            sequentially consistent) - so either we see the pool closed,
+ *            or the shutdown waits till our request is queued, before the
+ *            threads are told to exit. a queued request is never missed
+ *            by a draining pool.
+ * output:    0 if the request was queued or handled, ESHUTDOWN if the pool
+ *            is shutting down, or the error of adding it to the queue.
+ */
+static int enqueue_pool_request(struct handler_threads_pool* pool,
+                                struct request* a_request)
+{
+    int rc;
+
+    atomic_fetch_add(&pool->num_submitters, 1);
+
+    /* a pool that is shutting down takes no new requests */
+    if (atomic_load(&pool->closed)) {
+        atomic_fetch_sub(&pool->num_submitters, 1);
+        reject_request(pool->requests, a_request);
+        return ESHUTDOWN;
+    }
+
+    if (pool->scheduler) {
+        rc = ws_enqueue_request(pool->scheduler, a_request);
+    }
+    else {
+        rc = try_enqueue_request(pool->requests, a_request);
+    }
+    atomic_fetch_sub(&pool->num_submitters, 1);
+    if (rc == 0) {
+        return 0;
+    }
+
+    if (pool->requests->overflow_policy == REQUESTS_OVERFLOW_CALLER_RUNS) {
+        count_caller_run_request(pool->requests);
+        handle_request_in_caller(pool->requests, a_request);
+        return 0;
+    }
+    reject_request(pool->requests, a_request);
+
+    return rc;
+}
+
+/* name the pool. */
+void set_handler_threads_pool_name(struct handler_threads_pool* pool, const char* name)
+{
+    /* sanity check */
+    assert(pool);
+    assert(name);
+
+    strncpy(pool->name, name, POOL_NAME_SIZE - 1);
+    pool->name[POOL_NAME_SIZE - 1] = '\0';
+}
+
+/* add a request to be handled by the pool's threads. */
+void add_pool_request(struct handler_threads_pool* pool, int request_num)
+{
+    try_add_pool_request(pool, request_num);
+}
+
+/* add a request to be handled by the pool's threads, if there's room. */
+int try_add_pool_request(struct handler_threads_pool* pool, int request_num)
+{
+    /* sanity check */
+    assert(pool);
+
+    return enqueue_pool_request(pool, new_request(pool->requests, request_num));
+}
+
+/* add a batch of requests to be handled by the pool's threads. */
+void add_pool_requests(struct handler_threads_pool* pool, const int* request_nums, int count)
+{
+    int i;
+
+    /* sanity check */
+    assert(pool);
+
+    /* the callers run requests the queue has no room for - one by one. */
+    if (pool->scheduler ||
+        pool->requests->overflow_policy == REQUESTS_OVERFLOW_CALLER_RUNS) {
+        for (i = 0; i < count; i++) {
+            try_add_pool_request(pool, request_nums[i]);
+        }
+    }
+    else {
+        /* admitted like a single request - see enqueue_pool_request() */
+        atomic_fetch_add(&pool->num_submitters, 1);
+        if (!atomic_load(&pool->closed)) {
+            add_requests(pool->requests, request_nums, count);
+        }
+        atomic_fetch_sub(&pool->num_submitters, 1);
+    }
+}
+
+/* submit a task to the pool's threads, and get its completion handle. */
+struct task_completion* submit_task(struct handler_threads_pool* pool,
+                                    task_function function,
+                                    const void* payload, size_t size)
+{
+    return submit_task_prio(pool, function, payload, size, REQUEST_PRIORITY_DEFAULT);
+}
+
+/* submit a task of the given priority class to the pool's threads. */
+struct task_completion* submit_task_prio(struct handler_threads_pool* pool,
+                                         task_function function,
+                                         const void* payload, size_t size,
+                                         int priority)
+{
+    struct task_completion* completion;
+    struct request* a_request;
+
+    /* sanity check */
+    assert(pool);
+    assert(priority >= REQUEST_PRIORITY_HIGHEST && priority <= REQUEST_PRIORITY_LOWEST);
+
+    a_request = new_task_request(pool->requests, function, payload, size, &completion);
+    a_request->priority = priority;
+    enqueue_pool_request(pool, a_request);
+
+    return completion;
+}
+
+/* submit a task with a deadline to the pool's threads. */
+struct task_completion* submit_task_deadline(struct handler_threads_pool* pool,
+                                             task_function function,
+                                             const void* payload, size_t size,
+                                             int timeout_ms)
+{
+    struct task_completion* completion;
+    struct request* a_request;
+
+    /* sanity check */
+    assert(pool);
+
+    a_request = new_task_request(pool->requests, function, payload, size, &completion);
+    set_request_deadline(a_request, timeout_ms);
+    enqueue_pool_request(pool, a_request);
+
+    return completion;
+}
+
+/* submit a task without a completion handle. */
+void post_task(struct handler_threads_pool* pool, task_function function,
+               const void* payload, size_t size)
+{
+    /* sanity check */
+    assert(pool);
+
+    enqueue_pool_request(pool, new_task_request(pool->requests, function,
+                                                payload, size, NULL));
+}
+
+/* release a task's completion handle. */
+void release_task(struct handler_threads_pool* pool, struct task_completion* completion)
+{
+    /* sanity check */
+    assert(pool);
+
+    release_task_completion(pool->requests, completion);
+}
+
+/* set the spin limit of the pool's idle threads. */
+void set_handler_threads_spin(struct handler_threads_pool* pool, int max_spin_us)
+{
+    /* sanity check */
+    assert(pool);
+    assert(max_spin_us >= 0);
+
+    atomic_store(&pool->max_spin_ns, max_spin_us * 1000LL);
+}
+
+/* set the placement of the pool's new threads. */
+void set_handler_threads_placement(struct handler_threads_pool* pool, int placement)
+{
+    /* sanity check */
+    assert(pool);
+    assert(placement >= THREAD_PLACEMENT_NONE && placement <= THREAD_PLACEMENT_NODE);
+
+    pthread_mutex_lock(&pool->threads_lock);
+    pool->placement = placement;
+    pthread_mutex_unlock(&pool->threads_lock);
+}
+
+/*
+ * choose the CPU or node a new thread is placed on, by the pool's placement.
+ * algorithm: counts the pool's threads on each CPU (or node), and takes
+ *            the first one with the fewest - CPUs are ordered by node, so
+ *            a small pool pinned to cores stays on one node, sharing its
+ *            caches. called with the pool's threads_lock locked.
+ */
+static void place_handler_thread(struct handler_threads_pool* pool,
+                                 struct handler_thread_params* params)
+{
+    const struct cpu_topology* topology = pool->topology;
+    int counts[MAX_TOPOLOGY_CPUS];        /* threads per CPU number, or node. */
+    struct handler_thread* a_thread;
+    int best = -1;
+    int i;
+
+    params->home_cpu = -1;
+    params->home_node = -1;
+    if (pool->placement == THREAD_PLACEMENT_NONE || topology->num_cpus == 0) {
+        return;
+    }
+
+    for (i = 0; i < MAX_TOPOLOGY_CPUS; i++) {
+        counts[i] = 0;
+    }
+    for (a_thread = pool->threads; a_thread; a_thread = a_thread->next) {
+        if (pool->placement == THREAD_PLACEMENT_CORE && a_thread->params.home_cpu >= 0) {
+            counts[a_thread->params.home_cpu]++;
+        }
+        else if (pool->placement == THREAD_PLACEMENT_NODE && a_thread->params.home_node >= 0) {
+            counts[a_thread->params.home_node]++;
+        }
+    }
+
+    if (pool->placement == THREAD_PLACEMENT_CORE) {
+        for (i = 0; i < topology->num_cpus; i++) {
+            if (best < 0 || counts[topology->cpus[i]] < counts[best]) {
+                best = topology->cpus[i];
+            }
+        }
+        params->home_cpu = best;
+        params->home_node = topology_cpu_node(topology, best);
+    }
+    else {
+        for (i = 0; i < topology->num_nodes; i++) {
+            if (best < 0 || counts[i] < counts[best]) {
+                best = i;
+            }
+        }
+        params->home_node = best;
+    }
+}
+
+/*
+ * fill the attributes a placed thread is created with - its affinity to
+ * its CPU, or to all the CPUs of its node.
+ */
+static void init_placement_attr(struct handler_threads_pool* pool,
+                                const struct handler_thread_params* params,
+                                pthread_attr_t* attr)
+{
+    const struct cpu_topology* topology = pool->topology;
+    cpu_set_t cpus;
+    int i;
+
+    CPU_ZERO(&cpus);
+    if (params->home_cpu >= 0) {
+        CPU_SET(params->home_cpu, &cpus);
+    }
+    else {
+        for (i = 0; i < topology->node_cpus[params->home_node]; i++) {
+            CPU_SET(topology->cpus[topology->node_first[params->home_node] + i], &cpus);
+        }
+    }
+
+    pthread_attr_init(attr);
+    pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+}
+
 /* spawn a new handler thread and add it to the threads pool. */
 void add_handler_thread(struct handler_threads_pool* pool)
 {
     struct handler_thread* a_thread;      /* thread's data       */
     struct handler_thread_params* params; /* thread's parameters */
+    pthread_attr_t attr;                  /* placement of thread */
 
     /* sanity check */
     assert(pool);
 
-    /* create the new thread's structure and initialize it */
-    a_thread = (struct handler_thread*)malloc(sizeof(struct handler_thread));
-    if (!a_thread) {
-	    fprintf(stderr, "add_handler_thread: out of memory. exiting\n");
-	    exit(1);
-    }
+    /* create the new thread's structure and initialize it. it comes */
+    /* from the pool's object pool, and holds the thread's parameters. */
+    a_thread = (struct handler_thread*)alloc_object(pool->thread_objects);
+    pthread_mutex_lock(&pool->threads_lock);
     a_thread->thr_id = pool->max_thr_id++;
+    place_handler_thread(pool, &a_thread->params);
+    pthread_mutex_unlock(&pool->threads_lock);
     a_thread->next = NULL;
 
-    /* create the thread's parameters structure */
-    params = (struct handler_thread_params*)malloc(sizeof(struct handler_thread_params));
-    if (!params) {
-        fprintf(stderr, "add_handler_thread: out of memory. exiting\n");
-        exit(1);
-    }
+    /* initialize the thread's parameters structure */
+    params = &a_thread->params;
     params->thread_id = a_thread->thr_id;
-    params->request_mutex = pool->p_mutex;
-    params->got_request = pool->p_cond_var;
     params->requests = pool->requests;
+    atomic_init(&params->waiter.futex, 0);
+    params->waiter.parked = 0;
+    params->waiter.next = NULL;
+    params->scheduler = pool->scheduler;
+    params->ws_index = -1;
+    params->current_request = NULL;
+    atomic_init(&params->retire, 0);
+    atomic_init(&params->busy, 0);
+    params->exited = 0;
+    params->exit_mutex = &pool->threads_lock;
+    params->thread_exited = &pool->thread_exited;
+    atomic_init(&params->last_active_ns, monotonic_ns());
+    atomic_init(&params->num_handled, 0);
+    atomic_init(&params->wait_ns, 0);
+    atomic_init(&params->busy_ns, 0);
+    /* the histograms are several KB - allocated apart, off the slabs. */
+    params->metrics = new_worker_metrics();
+    params->max_spin_ns = &pool->max_spin_ns;
+    params->shutdown = &pool->shutdown;
+    params->pool_name = pool->name;
+    params->idle_gap_ns = 0;
+    params->topology = pool->topology;
+    params->last_cpu = -1;
 
-    /* spawn the thread, and place its ID in the thread's structure */
-    pthread_create(&a_thread->thread, NULL, handle_requests_loop, (void*)params);
+    /* spawn the thread, and place its ID in the thread's structure. */
+    /* a placed thread is created right on its CPUs, so its stack and */
+    /* the memory it touches first are allocated on its node.         */
+    if (params->home_node >= 0) {
+        init_placement_attr(pool, params, &attr);
+        pthread_create(&a_thread->thread, &attr, handle_requests_loop, (void*)params);
+        pthread_attr_destroy(&attr);
+    }
+    else {
+        pthread_create(&a_thread->thread, NULL, handle_requests_loop, (void*)params);
+    }
 
     /* add the thread's structure to the end of the pool's list. */
+    pthread_mutex_lock(&pool->threads_lock);
     if (pool->num_threads == 0) { /* special case - list is empty */
         pool->threads = a_thread;
         pool->last_thread = a_thread;
@@ -76,6 +414,8 @@ void add_handler_thread(struct handler_threads_pool* pool)
 
     /* increase total number of threads by one. */
     pool->num_threads++;
+    pool->threads_added++;
+    pthread_mutex_unlock(&pool->threads_lock);
 }
 
 /* remove the first thread from the threads pool (do NOT cancel the thread) */
@@ -86,42 +426,346 @@ static struct handler_thread* remove_first_handler_thread(struct handler_threads
     /* sanity check */
     assert(pool);
 
+    pthread_mutex_lock(&pool->threads_lock);
     if (pool->num_threads > 0 && pool->threads) {
         a_thread = pool->threads;
         pool->threads = a_thread->next;
         a_thread->next = NULL;
         pool->num_threads--;
     }
+    pthread_mutex_unlock(&pool->threads_lock);
 
     return a_thread;
 }
 
-/* delete the first thread from the threads pool (and cancel the thread) */
+/*
+ * unlink the given thread, that follows 'prev' (NULL if it's the first),
+ * from the pool's list. called with the pool's threads_lock locked.
+ */
+static void unlink_handler_thread(struct handler_threads_pool* pool,
+                                  struct handler_thread* a_thread,
+                                  struct handler_thread* prev)
+{
+    if (prev) {
+        prev->next = a_thread->next;
+    }
+    else {
+        pool->threads = a_thread->next;
+    }
+    if (pool->last_thread == a_thread) {
+        pool->last_thread = prev;
+    }
+    a_thread->next = NULL;
+    pool->num_threads--;
+}
+
+/*
+ * remove the most idle thread from the threads pool (do NOT stop it).
+ * algorithm: prefers threads that are not handling a request, and among
+ *            them the one that has been idle the longest.
+ */
+static struct handler_thread* remove_idle_handler_thread(struct handler_threads_pool* pool)
+{
+    struct handler_thread* a_thread;         /* thread being checked      */
+    struct handler_thread* prev = NULL;      /* thread before it          */
+    struct handler_thread* idlest = NULL;    /* idlest thread so far      */
+    struct handler_thread* idlest_prev = NULL; /* thread before the idlest */
+    int idlest_busy = 1;
+    long long idlest_since = 0;
+
+    pthread_mutex_lock(&pool->threads_lock);
+
+    for (a_thread = pool->threads; a_thread; prev = a_thread, a_thread = a_thread->next) {
+        int busy = atomic_load_explicit(&a_thread->params.busy, memory_order_relaxed);
+        long long since = atomic_load_explicit(&a_thread->params.last_active_ns,
+                                               memory_order_relaxed);
+
+        if (!idlest || busy < idlest_busy ||
+            (busy == idlest_busy && since < idlest_since)) {
+            idlest = a_thread;
+            idlest_prev = prev;
+            idlest_busy = busy;
+            idlest_since = since;
+        }
+    }
+
+    if (idlest) {
+        unlink_handler_thread(pool, idlest, idlest_prev);
+    }
+
+    pthread_mutex_unlock(&pool->threads_lock);
+
+    return idlest;
+}
+
+/*
+ * wait until a thread of the pool has exited its loop, and remove it
+ * from the pool - waiting no later than 'deadline' (on the realtime
+ * clock), unless it's NULL. returns NULL if the pool has no threads, or
+ * none exited in time.
+ */
+static struct handler_thread* remove_exited_handler_thread(struct handler_threads_pool* pool,
+                                                           const struct timespec* deadline)
+{
+    struct handler_thread* a_thread = NULL;  /* thread being checked */
+    struct handler_thread* prev;             /* thread before it     */
+
+    pthread_mutex_lock(&pool->threads_lock);
+
+    while (pool->num_threads > 0) {
+        for (prev = NULL, a_thread = pool->threads; a_thread;
+             prev = a_thread, a_thread = a_thread->next) {
+            if (a_thread->params.exited) {
+                break;
+            }
+        }
+        if (a_thread) {
+            unlink_handler_thread(pool, a_thread, prev);
+            break;
+        }
+        if (!deadline) {
+            pthread_cond_wait(&pool->thread_exited, &pool->threads_lock);
+        }
+        else if (pthread_cond_timedwait(&pool->thread_exited, &pool->threads_lock,
+                                        deadline) == ETIMEDOUT) {
+            a_thread = NULL;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->threads_lock);
+
+    return a_thread;
+}
+
+/*
+ * add the load counters and metrics of a thread that left the pool to the
+ * pool's totals, and free its structure. the thread must have been joined.
+ */
+static void free_handler_thread(struct handler_threads_pool* pool,
+                                struct handler_thread* a_thread)
+{
+    struct worker_metrics* metrics = a_thread->params.metrics;
+
+    pthread_mutex_lock(&pool->threads_lock);
+    pool->retired_handled += atomic_load(&a_thread->params.num_handled);
+    pool->retired_wait_ns += atomic_load(&a_thread->params.wait_ns);
+    pool->retired_busy_ns += atomic_load(&a_thread->params.busy_ns);
+    histogram_merge(&pool->retired_wait_time, &metrics->wait_time);
+    histogram_merge(&pool->retired_service_time, &metrics->service_time);
+    pool->retired_spurious_wakeups += atomic_load(&metrics->spurious_wakeups);
+    pool->retired_spin_hits += atomic_load(&metrics->spin_hits);
+    pool->retired_parks += atomic_load(&metrics->parks);
+    pool->retired_migrations += atomic_load(&metrics->migrations);
+    pool->retired_node_migrations += atomic_load(&metrics->node_migrations);
+    pool->threads_removed++;
+    pthread_mutex_unlock(&pool->threads_lock);
+
+    free(metrics);
+    free_object(pool->thread_objects, a_thread);
+}
+
+/*
+ * retire the most idle thread of the threads pool.
+ * algorithm: asks the thread to exit, wakes it up in case it's waiting
+ *            for requests, and joins it - it finishes the request it's
+ *            handling (if any) first, and nothing is cancelled.
+ */
+void retire_idle_handler_thread(struct handler_threads_pool* pool)
+{
+    struct handler_thread* a_thread; /* the thread to retire */
+
+    /* sanity check */
+    assert(pool);
+
+    a_thread = remove_idle_handler_thread(pool);
+    if (a_thread) {
+        atomic_store(&a_thread->params.retire, 1);
+
+        /* wake it up if it's parked, so it notices - and only it */
+        wake_this_request_waiter(pool->requests, &a_thread->params.waiter);
+
+        pthread_join(a_thread->thread, NULL);
+        free_handler_thread(pool, a_thread);
+    }
+}
+
+/*
+ * get the load of the pool - number of threads, pending requests, and the
+ * totals of requests handled, their queue wait and handling time, since
+ * the pool was created (including threads that left it).
+ */
+void get_handler_threads_load(struct handler_threads_pool* pool,
+                              struct handler_threads_load* load)
+{
+    struct handler_thread* a_thread;  /* one thread's structure */
+
+    /* sanity check */
+    assert(pool);
+    assert(load);
+
+    pthread_mutex_lock(&pool->threads_lock);
+    load->num_threads = pool->num_threads;
+    load->num_handled = pool->retired_handled;
+    load->wait_ns = pool->retired_wait_ns;
+    load->busy_ns = pool->retired_busy_ns;
+    for (a_thread = pool->threads; a_thread; a_thread = a_thread->next) {
+        load->num_handled += atomic_load_explicit(&a_thread->params.num_handled,
+                                                  memory_order_relaxed);
+        load->wait_ns += atomic_load_explicit(&a_thread->params.wait_ns,
+                                              memory_order_relaxed);
+        load->busy_ns += atomic_load_explicit(&a_thread->params.busy_ns,
+                                              memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&pool->threads_lock);
+
+    load->num_pending = get_requests_number(pool->requests);
+    if (pool->scheduler) {
+        load->num_pending += atomic_load(&pool->scheduler->num_pending);
+    }
+}
+
+/*
+ * delete a thread from the threads pool, without cancelling it.
+ * algorithm: puts a retire token at the head of the requests queue - the
+ *            next thread to be free (a waiting one is woken up) takes it,
+ *            and exits. we wait for it to exit, join it, and free it.
+ *            nothing is cancelled, so no request is lost half-handled.
+ */
 void delete_handler_thread(struct handler_threads_pool* pool)
 {
-    struct handler_thread* a_thread; /* the thread to cancel */
+    struct handler_thread* a_thread; /* the thread that retired */
 
     /* sanity check */
     assert(pool);
 
-    a_thread = remove_first_handler_thread(pool);
+    if (get_handler_threads_number(pool) == 0) {
+        return;
+    }
+
+    add_retire_token(pool->requests);
+
+    a_thread = remove_exited_handler_thread(pool, NULL);
     if (a_thread) {
-	    pthread_cancel(a_thread->thread);
-        free(a_thread);
+	    pthread_join(a_thread->thread, NULL);
+        free_handler_thread(pool, a_thread);
     }
 }
 
+/* get the allocation counters of the pool's thread structures */
+void get_handler_threads_allocation_stats(struct handler_threads_pool* pool,
+                                          struct object_pool_stats* stats)
+{
+    /* sanity check */
+    assert(pool);
+
+    get_object_pool_stats(pool->thread_objects, stats);
+}
+
 /* get the number of handler threads currently in the threads pool */
 int get_handler_threads_number(struct handler_threads_pool* pool)
 {
+    int num_threads;
+
+    /* sanity check */
+    assert(pool);
+
+    pthread_mutex_lock(&pool->threads_lock);
+    num_threads = pool->num_threads;
+    pthread_mutex_unlock(&pool->threads_lock);
+
+    return num_threads;
+}
+
+/*
+ * cancel the requests still queued - in the work stealing scheduler's
+ * deques and inboxes, and in the requests queue.
+ */
+static void cancel_pool_requests(struct handler_threads_pool* pool)
+{
+    struct request* a_request;
+
+    if (pool->scheduler) {
+        while ((a_request = ws_get_request(pool->scheduler, -1)) != NULL) {
+            release_request(pool->requests, a_request);
+        }
+    }
+    while ((a_request = get_request(pool->requests)) != NULL) {
+        release_request(pool->requests, a_request);
+    }
+}
+
+/*
+ * shut the threads pool down.
+ * algorithm: stops the supervisor, so no threads are added meanwhile,
+ *            closes the pool to new requests, and waits for the requests
+ *            being added to be queued (see enqueue_pool_request()). then
+ *            sets the shutdown mode (only ever to a harsher one) and
+ *            wakes up all parked threads to notice it. an abort also
+ *            cancels every thread - deferred, so each is cancelled at its
+ *            next cancellation point, and its cleanup handlers release
+ *            its request. then joins the threads as they exit, till the
+ *            timeout. queued requests are cancelled, unless draining.
+ * input:     pool, shutdown mode, timeout in milliseconds (-1 for none).
+ * output:    number of threads that are still running.
+ */
+int shutdown_handler_threads_pool(struct handler_threads_pool* pool, int mode, int timeout_ms)
+{
+    struct handler_thread* a_thread;  /* one thread's structure */
+    struct timespec deadline;         /* when to stop waiting   */
+    int old_mode;
+
     /* sanity check */
     assert(pool);
+    assert(mode >= POOL_SHUTDOWN_DRAIN && mode <= POOL_SHUTDOWN_ABORT);
+
+    if (pool->supervisor) {
+        stop_pool_supervisor(pool->supervisor);
+        pool->supervisor = NULL;
+    }
+
+    /* the threads keep handling requests meanwhile, so a submitter */
+    /* waiting for room in a full queue gets it.                    */
+    atomic_store(&pool->closed, 1);
+    while (atomic_load(&pool->num_submitters) > 0) {
+        sched_yield();
+    }
+
+    old_mode = atomic_load(&pool->shutdown);
+    while (old_mode < mode && !atomic_compare_exchange_weak(&pool->shutdown, &old_mode, mode))
+        ;
+    wake_all_request_waiters(pool->requests);
+
+    if (mode == POOL_SHUTDOWN_ABORT) {
+        pthread_mutex_lock(&pool->threads_lock);
+        for (a_thread = pool->threads; a_thread; a_thread = a_thread->next) {
+            pthread_cancel(a_thread->thread);
+        }
+        pthread_mutex_unlock(&pool->threads_lock);
+    }
+
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+    }
+    while ((a_thread = remove_exited_handler_thread(pool, timeout_ms >= 0 ? &deadline : NULL))
+           != NULL) {
+        pthread_join(a_thread->thread, NULL);
+        free_handler_thread(pool, a_thread);
+    }
 
-    return pool->num_threads;
+    if (mode >= POOL_SHUTDOWN_FINISH) {
+        cancel_pool_requests(pool);
+    }
+
+    return get_handler_threads_number(pool);
 }
 
 /*
- * free the resources taken by the given requests queue, and cancel all its threads.
+ * free the resources taken by the given threads pool, once all its threads exit.
  */
 void delete_handler_threads_pool(struct handler_threads_pool* pool)
 {
@@ -131,12 +775,35 @@ void delete_handler_threads_pool(struct handler_threads_pool* pool)
     /* sanity check */
     assert(pool);
 
+    /* stop resizing the pool while we delete it, and let its threads */
+    /* drain the queue and exit, if it wasn't shut down yet.          */
+    if (atomic_load(&pool->shutdown) == POOL_SHUTDOWN_NONE) {
+        shutdown_handler_threads_pool(pool, POOL_SHUTDOWN_DRAIN, TASK_WAIT_FOREVER);
+    }
+
     /* use pthread_join() to wait for all threads to terminate. */
-    while (pool->num_threads > 0) {
-	    a_thread = remove_first_handler_thread(pool);
-	    assert(a_thread);	/* sanity check */
+    while ((a_thread = remove_first_handler_thread(pool)) != NULL) {
 	    pthread_join(a_thread->thread, &thr_retval);
-        free(a_thread);
+        free_handler_thread(pool, a_thread);
+    }
+
+    /* all threads are gone - the dumper prints the final metrics. */
+    if (pool->metrics_dumper) {
+        stop_metrics_dumper(pool->metrics_dumper);
     }
+
+    /* no thread uses the scheduler anymore - free it. */
+    if (pool->scheduler) {
+        delete_ws_scheduler(pool->scheduler);
+        pool->scheduler = NULL;
+    }
+
+    delete_cpu_topology(pool->topology);
+    delete_object_pool(pool->thread_objects);
+    pthread_mutex_destroy(&pool->threads_lock);
+    pthread_cond_destroy(&pool->thread_exited);
+
+    /* finally, free the pool's struct itself */
+    free(pool);
 }
 
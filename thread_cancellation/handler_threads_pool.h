@@ -6,49 +6,227 @@
 
 #include "requests_queue.h"     /* requests queue routines/structs       */
 #include "handler_thread.h"     /* handler thread functions/structs      */
+#include "work_stealing.h"      /* work stealing scheduler               */
+#include "object_pool.h"        /* pool allocator for thread structures  */
+#include "pool_metrics.h"       /* latency histograms and counters       */
+#include "cpu_topology.h"       /* NUMA nodes of the CPUs                */
+
+/* number of initial threads used to service requests, and max number */
+/* of handler threads to create during "high pressure" times.         */
+#define NUM_HANDLER_THREADS 3
+#define MAX_NUM_HANDLER_THREADS 14
+
+/* default limit of spinning before parking, in microseconds (0 - park at once) */
+#define DEFAULT_MAX_SPIN_US 0
+
+/* longest name of a pool, with its terminating NUL */
+#define POOL_NAME_SIZE 16
+
+/* placement of new handler threads on the CPUs */
+#define THREAD_PLACEMENT_NONE 0 /* let the kernel move them freely.      */
+#define THREAD_PLACEMENT_CORE 1 /* pin each to a CPU of its own.         */
+#define THREAD_PLACEMENT_NODE 2 /* bind each to the CPUs of a NUMA node. */
 
 /* format of a single thread structure.(single linked list) */
 struct handler_thread {
     pthread_t thread;           /* thread's handle.                      */
     int       thr_id;           /* 'id' of thread.                       */
+    struct handler_thread_params params; /* parameters passed to thread. */
     struct handler_thread* next;/* pointer to next thread, NULL if none. */
 };
 
 /* structure for a handler threads pool */
 struct handler_threads_pool {
+    char name[POOL_NAME_SIZE];          /* name, for logs and metrics.      */
     struct handler_thread* threads;     /* head of linked list of threads.  */
     struct handler_thread* last_thread; /* pointer to last thread.          */
     int num_threads;		        /* number of threads in pool.       */
     int max_thr_id;			/* maximal thread 'id' used so far. */
-    pthread_mutex_t* p_mutex;	        /* pool's mutex.                    */
-    pthread_cond_t*  p_cond_var;        /* pool's condition variable.       */
     struct requests_queue* requests;    /* requests queue                   */
+    struct ws_scheduler* scheduler;     /* work stealing scheduler, or NULL. */
+    struct object_pool* thread_objects; /* allocator of thread structures.  */
+    pthread_mutex_t threads_lock;       /* guards the list of threads.      */
+    pthread_cond_t  thread_exited;      /* signaled when a thread exits.    */
+    long retired_handled;               /* load counters of threads that    */
+    long long retired_wait_ns;          /* left the pool (guarded by        */
+    long long retired_busy_ns;          /* threads_lock).                   */
+    long threads_added;                 /* threads ever added, and removed  */
+    long threads_removed;               /* (guarded by threads_lock).       */
+    struct histogram_snapshot retired_wait_time;    /* latency histograms   */
+    struct histogram_snapshot retired_service_time; /* and counters of      */
+    long retired_spurious_wakeups;      /* threads that left the pool.      */
+    long retired_spin_hits;             /*                                  */
+    long retired_parks;                 /*                                  */
+    long retired_migrations;            /*                                  */
+    long retired_node_migrations;       /*                                  */
+    atomic_llong max_spin_ns;           /* idle threads spin up to this.    */
+    atomic_int shutdown;                /* POOL_SHUTDOWN_* mode.            */
+    atomic_int closed;                  /* refuses new requests?            */
+    atomic_int num_submitters;          /* threads adding a request now.    */
+    int placement;                      /* THREAD_PLACEMENT_* of new threads. */
+    struct cpu_topology* topology;      /* CPUs the pool may use, by node.  */
+    struct pool_supervisor* supervisor; /* autoscaling supervisor, or NULL. */
+    struct metrics_dumper* metrics_dumper; /* periodic metrics dump, or NULL. */
+};
+
+/* load of a handler threads pool, as sampled by its supervisor */
+struct handler_threads_load {
+    int num_threads;            /* number of threads in pool.            */
+    int num_pending;            /* number of requests waiting.           */
+    long num_handled;           /* requests handled since pool creation. */
+    long long wait_ns;          /* total time those waited queued.       */
+    long long busy_ns;          /* total time threads spent handling.    */
 };
 
 /*
- * create a handler threads pool. associate it with the given mutex
- * and condition variables.
+ * create a handler threads pool, handling the requests of the given queue.
+ * a pool owns all its state - a process may run several pools, each with
+ * its own queue, threads, sizing and metrics.
  */
 extern struct handler_threads_pool*
-init_handler_threads_pool(pthread_mutex_t* p_mutex,
-			  pthread_cond_t*  p_cond_var,
-			  struct requests_queue* requests);
+init_handler_threads_pool(struct requests_queue* requests);
+
+/*
+ * create a handler threads pool using work stealing: each handler thread
+ * owns a local deque, and idle threads steal from their peers. the given
+ * requests queue is still used for overflow, and to wait for requests.
+ */
+extern struct handler_threads_pool*
+init_work_stealing_pool(struct requests_queue* requests);
+
+/* name the pool, in its logs and metrics (truncated to fit) */
+extern void
+set_handler_threads_pool_name(struct handler_threads_pool* pool, const char* name);
+
+/*
+ * add a request to be handled by the pool's threads - through the work
+ * stealing scheduler if the pool has one, or else to its requests queue.
+ * if the requests queue is full, its overflow policy applies - with
+ * REQUESTS_OVERFLOW_CALLER_RUNS, the calling thread handles the request.
+ */
+extern void
+add_pool_request(struct handler_threads_pool* pool, int request_num);
+
+/*
+ * add a request like add_pool_request(), and tell whether it was added.
+ * returns 0 if it was added (or run by the caller), EAGAIN if the full
+ * queue refused it, or ETIMEDOUT if no room was made in time.
+ */
+extern int
+try_add_pool_request(struct handler_threads_pool* pool, int request_num);
+
+/*
+ * add a batch of 'count' requests to be handled by the pool's threads -
+ * in a single lock of its requests queue, unless it uses work stealing.
+ * a pool that is shutting down drops the batch.
+ */
+extern void
+add_pool_requests(struct handler_threads_pool* pool, const int* request_nums, int count);
+
+/*
+ * let idle threads of the pool spin for up to 'max_spin_us' microseconds,
+ * polling for requests, before they park. they spin only while requests
+ * keep coming within that time. 0 makes them park at once.
+ */
+extern void
+set_handler_threads_spin(struct handler_threads_pool* pool, int max_spin_us);
+
+/*
+ * place the threads added to the pool from now on - THREAD_PLACEMENT_CORE
+ * pins each to the usable CPU with the fewest of the pool's threads,
+ * THREAD_PLACEMENT_NODE binds each to the NUMA node with the fewest.
+ * with work stealing, threads bound to a node steal within it first.
+ */
+extern void
+set_handler_threads_placement(struct handler_threads_pool* pool, int placement);
+
+/*
+ * submit a task to the pool's threads - 'function' runs on one of them,
+ * with a copy of the payload's 'size' bytes (no allocation for payloads
+ * of up to TASK_INLINE_PAYLOAD bytes). returns the task's completion
+ * handle, which the caller releases with release_task(). a task the
+ * full requests queue refuses is cancelled - or, with
+ * REQUESTS_OVERFLOW_CALLER_RUNS, runs right away in the caller.
+ */
+extern struct task_completion*
+submit_task(struct handler_threads_pool* pool, task_function function,
+            const void* payload, size_t size);
+
+/* submit a task of the given priority class - see add_request_prio() */
+extern struct task_completion*
+submit_task_prio(struct handler_threads_pool* pool, task_function function,
+                 const void* payload, size_t size, int priority);
+
+/*
+ * submit a task that is only worth running within 'timeout_ms'
+ * milliseconds from now - if no handler thread starts it by then, its
+ * handle gets TASK_EXPIRED instead.
+ */
+extern struct task_completion*
+submit_task_deadline(struct handler_threads_pool* pool, task_function function,
+                     const void* payload, size_t size, int timeout_ms);
+
+/* submit a task whose completion nobody waits for - no handle at all */
+extern void
+post_task(struct handler_threads_pool* pool, task_function function,
+          const void* payload, size_t size);
+
+/* release a task's completion handle */
+extern void
+release_task(struct handler_threads_pool* pool, struct task_completion* completion);
 
 /* spawn a new handler thread and add it to the threads pool. */
 extern void
 add_handler_thread(struct handler_threads_pool* pool);
 
-/* delete the first thread from the threads pool (and cancel the thread) */
+/*
+ * delete a thread from the threads pool - the next thread to be free
+ * takes a retire token off the requests queue, exits, and is joined.
+ */
 extern void
 delete_handler_thread(struct handler_threads_pool* pool);
 
+/*
+ * retire the most idle thread from the threads pool - it finishes the
+ * request it's handling, exits and is joined. nothing is cancelled.
+ */
+extern void
+retire_idle_handler_thread(struct handler_threads_pool* pool);
+
+/* get the current load of the threads pool */
+extern void
+get_handler_threads_load(struct handler_threads_pool* pool,
+                         struct handler_threads_load* load);
+
+/* get the allocation counters of the pool's thread structures */
+extern void
+get_handler_threads_allocation_stats(struct handler_threads_pool* pool,
+                                     struct object_pool_stats* stats);
+
 /* get the number of handler threads currently in the threads pool */
 extern int
 get_handler_threads_number(struct handler_threads_pool* pool);
 
 /*
- * free the resources taken by the given requests queue,
- * and cancel all its threads.
+ * shut the pool down - it refuses new requests (with ESHUTDOWN) and its
+ * threads exit, as the mode says:
+ *     POOL_SHUTDOWN_DRAIN  - once they handled all queued requests.
+ *     POOL_SHUTDOWN_FINISH - once they finished the requests in hand.
+ *                            queued requests are cancelled.
+ *     POOL_SHUTDOWN_ABORT  - right away - they are cancelled, even in the
+ *                            middle of a request. queued requests are
+ *                            cancelled.
+ * waits up to 'timeout_ms' milliseconds (TASK_WAIT_FOREVER for no limit)
+ * for the threads to exit, and joins them. returns the number of threads
+ * that didn't exit in time - the pool may then be shut down again, with
+ * a harsher mode.
+ */
+extern int
+shutdown_handler_threads_pool(struct handler_threads_pool* pool, int mode, int timeout_ms);
+
+/*
+ * free the resources taken by the given threads pool, once all its
+ * threads exit. a pool that wasn't shut down is drained first.
  */
 extern void
 delete_handler_threads_pool(struct handler_threads_pool* pool);
@@ -0,0 +1,181 @@
+#include <string.h>      /* memset()                                  */
+#include <assert.h>      /* assert()                                  */
+
+#include "latency_histogram.h"   /* latency histogram functions/structs */
+
+/*
+ * find the bucket of a value.
+ * algorithm: small values index the buckets directly. for larger ones,
+ *            'shift' is how many low bits are dropped so that the value
+ *            keeps HISTOGRAM_SUB_BUCKET_BITS significant bits - the
+ *            magnitude selects a group of buckets, and the remaining top
+ *            bits a bucket in the group.
+ */
+static int bucket_index(long long value)
+{
+    int msb;
+    int shift;
+    int index;
+
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value < 0 ? 0 : (int)value;
+    }
+
+    msb = 63 - __builtin_clzll((unsigned long long)value);
+    shift = msb - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+    index = shift * HISTOGRAM_HALF_BUCKETS + (int)(value >> shift);
+
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+/*
+ * get the largest value that falls in the given bucket.
+ */
+static long long bucket_upper_value(int index)
+{
+    int shift;
+    long long sub_bucket;
+
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+
+    shift = index / HISTOGRAM_HALF_BUCKETS - 1;
+    sub_bucket = index - shift * HISTOGRAM_HALF_BUCKETS;
+
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+/*
+ * add 'delta' to a histogram counter. only the owner thread writes, so a
+ * relaxed load and store are enough - no locked instruction on the hot path.
+ */
+static void add_to_counter(atomic_llong* counter, long long delta)
+{
+    atomic_store_explicit(counter,
+                          atomic_load_explicit(counter, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+void init_latency_histogram(struct latency_histogram* histogram)
+{
+    int i;
+
+    assert(histogram);
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        atomic_init(&histogram->counts[i], 0);
+    }
+    atomic_init(&histogram->count, 0);
+    atomic_init(&histogram->sum, 0);
+    atomic_init(&histogram->max, 0);
+}
+
+/*
+ * record a value in a histogram.
+ * input:     pointer to histogram, value in nanoseconds.
+ */
+void histogram_record(struct latency_histogram* histogram, long long value)
+{
+    if (value < 0) {
+        value = 0;
+    }
+
+    add_to_counter(&histogram->counts[bucket_index(value)], 1);
+    add_to_counter(&histogram->count, 1);
+    add_to_counter(&histogram->sum, value);
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+void init_histogram_snapshot(struct histogram_snapshot* snapshot)
+{
+    assert(snapshot);
+
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+/*
+ * add a histogram to a snapshot. the owner may be recording meanwhile,
+ * so the snapshot may be off by the values being recorded right now.
+ */
+void histogram_merge(struct histogram_snapshot* snapshot, struct latency_histogram* histogram)
+{
+    long long max;
+    int i;
+
+    assert(snapshot);
+    assert(histogram);
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        snapshot->counts[i] += atomic_load_explicit(&histogram->counts[i],
+                                                    memory_order_relaxed);
+    }
+    snapshot->count += atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    snapshot->sum += atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+    max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    if (max > snapshot->max) {
+        snapshot->max = max;
+    }
+}
+
+void histogram_snapshot_merge(struct histogram_snapshot* snapshot,
+                              const struct histogram_snapshot* other)
+{
+    int i;
+
+    assert(snapshot);
+    assert(other);
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        snapshot->counts[i] += other->counts[i];
+    }
+    snapshot->count += other->count;
+    snapshot->sum += other->sum;
+    if (other->max > snapshot->max) {
+        snapshot->max = other->max;
+    }
+}
+
+/*
+ * get a percentile of a snapshot.
+ * algorithm: walks the buckets until their cumulative count reaches the
+ *            percentile's rank, and returns that bucket's upper value
+ *            (capped by the largest value recorded).
+ */
+long long histogram_percentile(const struct histogram_snapshot* snapshot, double percentile)
+{
+    long long rank;
+    long long seen = 0;
+    int i;
+
+    assert(snapshot);
+
+    if (snapshot->count == 0) {
+        return 0;
+    }
+
+    rank = (long long)(percentile / 100.0 * snapshot->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += snapshot->counts[i];
+        if (seen >= rank) {
+            long long value = bucket_upper_value(i);
+
+            return value < snapshot->max ? value : snapshot->max;
+        }
+    }
+
+    return snapshot->max;
+}
+
+double histogram_mean(const struct histogram_snapshot* snapshot)
+{
+    assert(snapshot);
+
+    return snapshot->count ? (double)snapshot->sum / snapshot->count : 0.0;
+}
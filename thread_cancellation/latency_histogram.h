@@ -0,0 +1,70 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdatomic.h>   /* C11 atomic types and operations           */
+
+/*
+ * log-linear (HDR style) buckets: values below 2^SUB_BUCKET_BITS get a
+ * bucket each, and every power of 2 above is split into 2^(bits - 1)
+ * equal sub-buckets - a relative error of about 3%, at any magnitude.
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_HALF_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+
+/* values (nanoseconds) of 2^HISTOGRAM_MAX_BITS and up share the last bucket */
+#define HISTOGRAM_MAX_BITS 40
+
+/* number of buckets of a histogram */
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_HALF_BUCKETS + \
+     HISTOGRAM_HALF_BUCKETS)
+
+/*
+ * histogram of latencies, in nanoseconds.
+ * written by a single thread (its owner) without read-modify-write
+ * atomics, read by any thread without locking.
+ */
+struct latency_histogram {
+    atomic_llong counts[HISTOGRAM_BUCKETS]; /* number of values per bucket. */
+    atomic_llong count;                     /* number of values recorded.   */
+    atomic_llong sum;                       /* sum of the values recorded.  */
+    atomic_llong max;                       /* largest value recorded.      */
+};
+
+/* a point in time copy of one or more (merged) histograms */
+struct histogram_snapshot {
+    long long counts[HISTOGRAM_BUCKETS];
+    long long count;
+    long long sum;
+    long long max;
+};
+
+/* zero a histogram */
+extern void init_latency_histogram(struct latency_histogram* histogram);
+
+/* record a value. must only be called by the histogram's owner thread. */
+extern void histogram_record(struct latency_histogram* histogram, long long value);
+
+/* zero a snapshot */
+extern void init_histogram_snapshot(struct histogram_snapshot* snapshot);
+
+/* add the current contents of a histogram to a snapshot */
+extern void histogram_merge(struct histogram_snapshot* snapshot,
+                            struct latency_histogram* histogram);
+
+/* add a snapshot to another one */
+extern void histogram_snapshot_merge(struct histogram_snapshot* snapshot,
+                                     const struct histogram_snapshot* other);
+
+/*
+ * get the value at the given percentile (0..100) of a snapshot - the
+ * upper end of the bucket holding it. 0 if the snapshot is empty.
+ */
+extern long long histogram_percentile(const struct histogram_snapshot* snapshot,
+                                      double percentile);
+
+/* get the mean value of a snapshot. 0 if it's empty. */
+extern double histogram_mean(const struct histogram_snapshot* snapshot);
+
+#endif /* LATENCY_HISTOGRAM_H */
@@ -0,0 +1,407 @@
+#include <stdio.h>             /* standard I/O routines                      */
+#include <pthread.h>           /* pthread functions and data structures      */
+#include <stdlib.h>            /* atoi(), strtol(), malloc() and rand_r()    */
+#include <string.h>            /* strcmp()                                   */
+#include <unistd.h>            /* dup()                                      */
+#include <time.h>              /* clock_nanosleep()                          */
+#include <math.h>              /* log()                                      */
+#include <stdatomic.h>         /* C11 atomic types and operations            */
+#include <assert.h>            /* assert()                                   */
+
+#include "requests_queue.h"         /* requests queue routines/structs       */
+#include "handler_threads_pool.h"   /* handler thread list functions/structs */
+#include "pool_metrics.h"           /* pool latency/counters metrics         */
+#include "latency_histogram.h"      /* latency histograms                    */
+#include "monotonic_clock.h"        /* monotonic_ns()                        */
+#include "async_logger.h"           /* asynchronous logger                   */
+
+/* default number of requests of each round */
+#define NUM_LOAD_REQUESTS 2000
+
+/* most thread counts one run may sweep */
+#define MAX_THREAD_COUNTS 32
+
+/* seed of the arrivals and service times - the same load every run */
+#define LOAD_SEED 1
+
+/* with the bimodal distribution, this share (in percent) of the requests */
+/* take this many times the given service time, and the rest take it.    */
+#define BIMODAL_SLOW_PERCENT 10
+#define BIMODAL_SLOW_FACTOR 10
+
+/* how the load is offered */
+#define LOAD_OPEN   0   /* arrivals at a given rate, not waiting for replies. */
+#define LOAD_CLOSED 1   /* clients each waiting for their previous reply.    */
+
+/* distributions of the service time */
+#define SERVICE_FIXED   0
+#define SERVICE_EXP     1
+#define SERVICE_BIMODAL 2
+
+/* payload of a benchmark task */
+struct load_task {
+    long long service_ns;  /* how long to keep the CPU busy.   */
+};
+
+/* a round of the benchmark */
+struct load_round {
+    int mode;                          /* LOAD_OPEN or LOAD_CLOSED.          */
+    double load;                       /* arrivals/sec, or number of clients. */
+    int service;                       /* SERVICE_* distribution.            */
+    long long service_ns;              /* its mean (or base) service time.   */
+    int num_requests;                  /* requests to make.                  */
+    struct handler_threads_pool* pool; /* pool handling them.                */
+    atomic_int num_sent;               /* requests made so far (closed loop). */
+    long long start_ns;                /* when the first request was made.   */
+};
+
+/* a client of a closed loop round */
+struct load_client {
+    struct load_round* round;          /* the round it takes part in.        */
+    unsigned int seed;                 /* its random numbers' state.         */
+    struct latency_histogram latency;  /* end-to-end latency of its requests. */
+    long long last_finish_ns;          /* when its last reply was ready.     */
+    pthread_t thread;                  /* client thread's handle.            */
+};
+
+/*
+ * task - keep the CPU busy for the payload's service time.
+ * output:    the time the task finished, for end-to-end latency.
+ */
+static long load_task(void* payload)
+{
+    struct load_task* task = (struct load_task*)payload;
+    long long end_ns = monotonic_ns() + task->service_ns;
+    long long now_ns;
+
+    do {
+        now_ns = monotonic_ns();
+    } while (now_ns < end_ns);
+
+    return (long)now_ns;
+}
+
+/* a random number in [0, 1) */
+static double uniform_random(unsigned int* seed)
+{
+    return rand_r(seed) / (RAND_MAX + 1.0);
+}
+
+/* an exponentially distributed random number with the given mean */
+static double exponential_random(unsigned int* seed, double mean)
+{
+    return -mean * log(1.0 - uniform_random(seed));
+}
+
+/* draw the service time of a request */
+static long long draw_service_ns(const struct load_round* round, unsigned int* seed)
+{
+    switch (round->service) {
+        case SERVICE_EXP:
+            return (long long)exponential_random(seed, round->service_ns);
+        case SERVICE_BIMODAL:
+            if (rand_r(seed) % 100 < BIMODAL_SLOW_PERCENT) {
+                return round->service_ns * BIMODAL_SLOW_FACTOR;
+            }
+            return round->service_ns;
+        default:
+            return round->service_ns;
+    }
+}
+
+/* sleep until the given time of the monotonic clock */
+static void sleep_until_ns(long long when_ns)
+{
+    struct timespec when;
+
+    when.tv_sec = when_ns / 1000000000LL;
+    when.tv_nsec = when_ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) != 0) {
+        /* interrupted - sleep the rest of the time */
+    }
+}
+
+/*
+ * offer an open loop load.
+ * algorithm: submits the requests at Poisson arrival times of the round's
+ *            rate, never waiting for replies - a late submission doesn't
+ *            delay the next ones. each request's latency runs from its
+ *            scheduled arrival, so a stalled submitter is charged too.
+ * output:    the end-to-end latencies, in 'latency', and the time the
+ *            last reply was ready.
+ */
+static long long run_open_loop(struct load_round* round, struct latency_histogram* latency)
+{
+    struct task_completion** tasks;
+    long long* arrivals_ns;
+    unsigned int seed = LOAD_SEED;
+    double mean_gap_ns = 1e9 / round->load;
+    long long arrival_ns;
+    long long last_finish_ns = round->start_ns;
+    int i;
+
+    tasks = (struct task_completion**)malloc(round->num_requests * sizeof(*tasks));
+    arrivals_ns = (long long*)malloc(round->num_requests * sizeof(*arrivals_ns));
+    if (!tasks || !arrivals_ns) {
+        fprintf(stderr, "run_open_loop: out of memory. exiting\n");
+        exit(1);
+    }
+
+    arrival_ns = round->start_ns;
+    for (i = 0; i < round->num_requests; i++) {
+        struct load_task task;
+
+        arrival_ns += (long long)exponential_random(&seed, mean_gap_ns);
+        task.service_ns = draw_service_ns(round, &seed);
+        sleep_until_ns(arrival_ns);
+        arrivals_ns[i] = arrival_ns;
+        tasks[i] = submit_task(round->pool, load_task, &task, sizeof(task));
+    }
+
+    wait_all_tasks(tasks, round->num_requests, TASK_WAIT_FOREVER);
+    for (i = 0; i < round->num_requests; i++) {
+        if (wait_task(tasks[i]) == TASK_DONE) {
+            long long finish_ns = get_task_result(tasks[i]);
+
+            histogram_record(latency, finish_ns - arrivals_ns[i]);
+            if (finish_ns > last_finish_ns) {
+                last_finish_ns = finish_ns;
+            }
+        }
+        release_task(round->pool, tasks[i]);
+    }
+
+    free(arrivals_ns);
+    free(tasks);
+
+    return last_finish_ns;
+}
+
+/*
+ * a client of a closed loop load - makes a request, waits for its reply,
+ * and makes the next one right away, till the round made all of them.
+ */
+static void* load_client_thread(void* data)
+{
+    struct load_client* client = (struct load_client*)data;
+    struct load_round* round = client->round;
+
+    while (atomic_fetch_add(&round->num_sent, 1) < round->num_requests) {
+        struct load_task task;
+        struct task_completion* completion;
+        long long submit_ns;
+
+        task.service_ns = draw_service_ns(round, &client->seed);
+        submit_ns = monotonic_ns();
+        completion = submit_task(round->pool, load_task, &task, sizeof(task));
+        if (wait_task(completion) == TASK_DONE) {
+            long long finish_ns = get_task_result(completion);
+
+            histogram_record(&client->latency, finish_ns - submit_ns);
+            client->last_finish_ns = finish_ns;
+        }
+        release_task(round->pool, completion);
+    }
+
+    return NULL;
+}
+
+/*
+ * offer a closed loop load, of the round's number of clients.
+ * output:    the end-to-end latencies, merged into 'latency', and the
+ *            time the last reply was ready.
+ */
+static long long run_closed_loop(struct load_round* round, struct histogram_snapshot* latency)
+{
+    int num_clients = (int)round->load;
+    struct load_client* clients;
+    long long last_finish_ns = round->start_ns;
+    int i;
+
+    clients = (struct load_client*)malloc(num_clients * sizeof(*clients));
+    if (!clients) {
+        fprintf(stderr, "run_closed_loop: out of memory. exiting\n");
+        exit(1);
+    }
+
+    atomic_init(&round->num_sent, 0);
+    for (i = 0; i < num_clients; i++) {
+        clients[i].round = round;
+        clients[i].seed = LOAD_SEED + i;
+        init_latency_histogram(&clients[i].latency);
+        clients[i].last_finish_ns = round->start_ns;
+        pthread_create(&clients[i].thread, NULL, load_client_thread, &clients[i]);
+    }
+    for (i = 0; i < num_clients; i++) {
+        pthread_join(clients[i].thread, NULL);
+        histogram_merge(latency, &clients[i].latency);
+        if (clients[i].last_finish_ns > last_finish_ns) {
+            last_finish_ns = clients[i].last_finish_ns;
+        }
+    }
+
+    free(clients);
+
+    return last_finish_ns;
+}
+
+/*
+ * run one round of the benchmark, with 'num_threads' handler threads,
+ * and print its CSV line to 'report'.
+ */
+static void run_round(FILE* report, struct load_round* round, int num_threads,
+                      const char* service_name)
+{
+    struct requests_queue* requests = NULL;              /* pointer to requests queue */
+    struct handler_threads_pool* handler_threads = NULL; /* list of handler threads */
+    struct histogram_snapshot latency;                   /* end-to-end latencies  */
+    struct pool_metrics metrics;                         /* queue wait times      */
+    long long last_finish_ns;
+    double elapsed;
+    int i;
+
+    requests = init_requests_queue();
+    assert(requests);
+    handler_threads = init_handler_threads_pool(requests);
+    assert(handler_threads);
+    set_handler_threads_pool_name(handler_threads, "load");
+    for (i = 0; i < num_threads; i++) {
+        add_handler_thread(handler_threads);
+    }
+    round->pool = handler_threads;
+
+    init_histogram_snapshot(&latency);
+    round->start_ns = monotonic_ns();
+    if (round->mode == LOAD_OPEN) {
+        struct latency_histogram* open_latency;
+
+        /* too big for the stack */
+        open_latency = (struct latency_histogram*)malloc(sizeof(*open_latency));
+        if (!open_latency) {
+            fprintf(stderr, "run_round: out of memory. exiting\n");
+            exit(1);
+        }
+        init_latency_histogram(open_latency);
+        last_finish_ns = run_open_loop(round, open_latency);
+        histogram_merge(&latency, open_latency);
+        free(open_latency);
+    }
+    else {
+        last_finish_ns = run_closed_loop(round, &latency);
+    }
+    elapsed = (last_finish_ns - round->start_ns) / 1e9;
+
+    shutdown_handler_threads_pool(handler_threads, POOL_SHUTDOWN_DRAIN, TASK_WAIT_FOREVER);
+    get_pool_metrics(handler_threads, &metrics);
+    delete_handler_threads_pool(handler_threads);
+    delete_requests_queue(requests);
+
+    fprintf(report, "%s,%g,%s,%lld,%d,%lld,%.4f,%.0f,"
+            "%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+            round->mode == LOAD_OPEN ? "open" : "closed", round->load, service_name,
+            round->service_ns / 1000, num_threads, latency.count, elapsed,
+            elapsed > 0 ? latency.count / elapsed : 0.0,
+            histogram_percentile(&metrics.wait_time, 50) / 1e3,
+            histogram_percentile(&metrics.wait_time, 99) / 1e3,
+            histogram_percentile(&metrics.wait_time, 99.9) / 1e3,
+            histogram_percentile(&latency, 50) / 1e3,
+            histogram_percentile(&latency, 99) / 1e3,
+            histogram_percentile(&latency, 99.9) / 1e3,
+            latency.max / 1e3);
+    fflush(report);
+}
+
+/*
+ * parse a comma separated list of thread counts ("1,2,4").
+ * output:    number of counts, 0 if the list is malformed.
+ */
+static int parse_thread_counts(const char* list, int* counts)
+{
+    const char* p = list;
+    int num_counts = 0;
+
+    while (*p) {
+        char* end;
+        long count = strtol(p, &end, 10);
+
+        if (end == p || count < 1 || count > MAX_NUM_HANDLER_THREADS ||
+            num_counts == MAX_THREAD_COUNTS) {
+            return 0;
+        }
+        counts[num_counts++] = (int)count;
+        p = end;
+        if (*p == ',') {
+            p++;
+        }
+        else if (*p) {
+            return 0;
+        }
+    }
+
+    return num_counts;
+}
+
+/*
+ * measure throughput, queue wait and end-to-end latency percentiles under
+ * an open loop (Poisson arrivals at 'load' requests/sec) or closed loop
+ * ('load' clients) load, for each of the given handler thread counts.
+ * usage:
+ *     load-bench open|closed load fixed|exp|bimodal service_us threads[,threads...]
+ *                [num_requests]
+ */
+int main(int argc, char* argv[])
+{
+    const char* service_names[] = { "fixed", "exp", "bimodal" };
+    int thread_counts[MAX_THREAD_COUNTS];
+    int num_thread_counts = 0;
+    struct load_round round;
+    FILE* report;
+    int i;
+
+    round.num_requests = NUM_LOAD_REQUESTS;
+    round.mode = LOAD_OPEN;
+    round.service = SERVICE_FIXED;
+    if (argc == 6 || argc == 7) {
+        round.mode = strcmp(argv[1], "closed") == 0 ? LOAD_CLOSED : LOAD_OPEN;
+        round.load = atof(argv[2]);
+        for (round.service = SERVICE_BIMODAL; round.service > SERVICE_FIXED; round.service--) {
+            if (strcmp(argv[3], service_names[round.service]) == 0) {
+                break;
+            }
+        }
+        round.service_ns = atoi(argv[4]) * 1000LL;
+        num_thread_counts = parse_thread_counts(argv[5], thread_counts);
+        if (argc == 7) {
+            round.num_requests = atoi(argv[6]);
+        }
+    }
+    if (num_thread_counts == 0 || round.num_requests <= 0 || round.service_ns < 0 ||
+        round.load < 1 || (strcmp(argv[1], "open") != 0 && strcmp(argv[1], "closed") != 0) ||
+        strcmp(argv[3], service_names[round.service]) != 0) {
+        fprintf(stderr, "usage: %s open|closed load fixed|exp|bimodal service_us "
+                "threads[,threads...] [num_requests]\n"
+                "    load - arrivals/sec (open loop) or number of clients (closed loop)\n",
+                argv[0]);
+        exit(1);
+    }
+
+    /* the handler threads log a line per request - keep that */
+    /* out of the report by sending stdout to /dev/null.      */
+    report = fdopen(dup(fileno(stdout)), "w");
+    if (!report || !freopen("/dev/null", "w", stdout)) {
+        perror("load-bench");
+        exit(1);
+    }
+    start_logger(fileno(stdout));
+
+    fprintf(report, "mode,load,service,service_us,threads,requests,seconds,requests_per_sec,"
+            "wait_p50_us,wait_p99_us,wait_p999_us,e2e_p50_us,e2e_p99_us,e2e_p999_us,e2e_max_us\n");
+    for (i = 0; i < num_thread_counts; i++) {
+        run_round(report, &round, thread_counts[i], service_names[round.service]);
+    }
+
+    stop_logger();
+    fclose(report);
+
+    return 0;
+}
@@ -1,5 +1,4 @@
 #include <stdio.h>             /* standard I/O routines                      */
-#define __USE_GNU
 #include <pthread.h>           /* pthread functions and data structures      */
 #include <stdlib.h>            /* rand() and srand() functions               */
 #include <unistd.h>            /* sleep()                                    */
@@ -8,26 +7,72 @@
 #include "requests_queue.h"         /* requests queue routines/structs       */
 #include "handler_thread.h"         /* handler thread functions/structs      */
 #include "handler_threads_pool.h"   /* handler thread list functions/structs */
+#include "pool_supervisor.h"        /* pool autoscaling supervisor           */
+#include "pool_metrics.h"           /* pool latency/counters metrics         */
+#include "async_logger.h"           /* asynchronous logger                   */
 
-/* number of initial threads used to service requests, and max number */
-/* of handler threads to create during "high pressure" times.         */
-#define NUM_HANDLER_THREADS 3
-#define MAX_NUM_HANDLER_THREADS 14
-
-/* number of requests on the queue warranting creation of new threads */
+/* number of requests on the queue warranting creation of new threads, */
+/* and below which the supervisor may retire threads.                  */
 #define HIGH_REQUESTS_WATERMARK 15
 #define LOW_REQUESTS_WATERMARK 3
 
-/* global mutex for our program. assignment initializes it. */
-/* note that we use a RECURSIVE mutex, since a handler      */
-/* thread might try to lock it twice consecutively.         */
-pthread_mutex_t request_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+/* how long idle handler threads may spin for a request before they */
+/* park, in microseconds.                                            */
+#define HANDLER_SPIN_US 50
+
+/* keep each handler thread on the CPUs of one NUMA node - its requests' */
+/* memory stays local, and the metrics show any cross-node migrations.   */
+#define HANDLER_THREADS_PLACEMENT THREAD_PLACEMENT_NODE
+
+/* how often to print the pool's metrics, in milliseconds */
+#define METRICS_DUMP_INTERVAL_MS 100
+
+/* most requests the queue holds - producers then block for room, up to */
+/* this many milliseconds, instead of growing it without limit.          */
+#define MAX_PENDING_REQUESTS 64
+#define ROOM_WAIT_TIMEOUT_MS 1000
+
+/* the last request of each burst is interactive - it's served earliest */
+/* deadline first, and dropped if not handled within this time.          */
+#define INTERACTIVE_TIMEOUT_MS 50
+
+/* how long to wait for the handler threads to drain the queue and exit, */
+/* before aborting them, in milliseconds.                                */
+#define SHUTDOWN_TIMEOUT_MS 5000
 
-/* global condition variable for our program. assignment initializes it. */
-pthread_cond_t  got_request   = PTHREAD_COND_INITIALIZER;
+/* total number of requests to generate, and how many are generated */
+/* (and queued) at once.                                            */
+#define NUM_REQUESTS 21
+#define REQUESTS_BURST_SIZE 3
 
-/* are we done creating new requests? */
-int done_creating_requests = 0;
+/* tasks summing a range of numbers are submitted too - this many of */
+/* them, each summing this many numbers.                             */
+#define NUM_SUM_TASKS 4
+#define SUM_TASK_RANGE 250
+
+/* the sum tasks run on a pool of their own, sized for CPU-bound work, */
+/* isolated from the requests' pool - its queue, threads and metrics.  */
+#define NUM_CPU_THREADS 2
+
+/* payload of a task summing a range of numbers */
+struct sum_range {
+    long first;            /* first number to sum.   */
+    long count;            /* how many numbers.      */
+};
+
+/* task - sum the numbers in the given range */
+static long sum_range_task(void* payload)
+{
+    struct sum_range* range = (struct sum_range*)payload;
+    long sum = 0;
+    long n;
+
+    for (n = range->first; n < range->first + range->count; n++) {
+        sum += n;
+    }
+
+    return sum;
+}
 
 /* Test the code */
 int main(int argc, char* argv[])
@@ -36,67 +81,143 @@ int main(int argc, char* argv[])
     struct timespec delay;			                     /* used for wasting time */
     struct requests_queue* requests = NULL;              /* pointer to requests queue */
     struct handler_threads_pool* handler_threads = NULL; /* list of handler threads */
+    struct requests_queue* cpu_requests = NULL;          /* queue of the sum tasks */
+    struct handler_threads_pool* cpu_threads = NULL;     /* pool of the sum tasks */
+    struct pool_supervisor_config supervisor_config;     /* how to resize the pool */
+    struct task_completion* sums[NUM_SUM_TASKS];         /* handles of sum tasks  */
+
+    /* log through a writer thread, off the handler threads' path */
+    start_logger(STDOUT_FILENO);
 
     /* create the requests queue */
-    requests = init_requests_queue(&request_mutex, &got_request);
+    requests = init_requests_queue();
     assert(requests);
+    set_requests_queue_limit(requests, MAX_PENDING_REQUESTS,
+                             REQUESTS_OVERFLOW_BLOCK, ROOM_WAIT_TIMEOUT_MS);
+    set_requests_queue_dispatch(requests, REQUESTS_DISPATCH_EDF);
 
     /* create the handler threads list */
-    handler_threads = init_handler_threads_pool(&request_mutex, &got_request, requests);
+    handler_threads = init_handler_threads_pool(requests);
     assert(handler_threads);
+    set_handler_threads_pool_name(handler_threads, "requests");
+
+    /* let idle threads spin a little, while requests come in bursts */
+    set_handler_threads_spin(handler_threads, HANDLER_SPIN_US);
+    set_handler_threads_placement(handler_threads, HANDLER_THREADS_PLACEMENT);
 
     /* create the request-handling threads */
     for (i = 0; i < NUM_HANDLER_THREADS; i++) {
 	    add_handler_thread(handler_threads);
     }
 
-    /* run a loop that generates requests */
-    for (i = 0; i < 21; i++) {
-	    int num_requests; // number of requests waiting to be handled.
-	    int num_threads;  // number of active handler threads.
-
-	    add_request(requests, i);
-
-	    num_requests = get_requests_number(requests);
-	    num_threads = get_handler_threads_number(handler_threads);
+    /* let a supervisor grow and shrink the pool, based on its load */
+    init_pool_supervisor_config(&supervisor_config,
+                                NUM_HANDLER_THREADS, MAX_NUM_HANDLER_THREADS);
+    supervisor_config.high_depth = HIGH_REQUESTS_WATERMARK;
+    supervisor_config.low_depth = LOW_REQUESTS_WATERMARK;
+    start_pool_supervisor(handler_threads, &supervisor_config);
+
+    /* print the pool's latency percentiles and counters periodically */
+    start_metrics_dumper(handler_threads, stdout, METRICS_DUMP_INTERVAL_MS);
+
+    /* create the pool of the sum tasks - a fixed size, no supervisor */
+    cpu_requests = init_requests_queue();
+    assert(cpu_requests);
+    cpu_threads = init_handler_threads_pool(cpu_requests);
+    assert(cpu_threads);
+    set_handler_threads_pool_name(cpu_threads, "cpu");
+    for (i = 0; i < NUM_CPU_THREADS; i++) {
+        add_handler_thread(cpu_threads);
+    }
+    start_metrics_dumper(cpu_threads, stdout, METRICS_DUMP_INTERVAL_MS);
+
+    /* run a loop that generates requests, in bursts */
+    for (i = 0; i < NUM_REQUESTS; i += REQUESTS_BURST_SIZE) {
+	    int burst[REQUESTS_BURST_SIZE]; // numbers of the requests in this burst.
+	    int j;
+
+	    for (j = 0; j < REQUESTS_BURST_SIZE && i + j < NUM_REQUESTS; j++) {
+	        burst[j] = i + j;
+	    }
+	    /* queue the whole burst with one lock of the queue, and one wakeup.  */
+	    /* its last request is interactive - its deadline puts it ahead of    */
+	    /* bulk work.                                                          */
+	    add_requests(requests, burst, j - 1);
+	    add_request_deadline(requests, burst[j - 1], REQUEST_PRIORITY_HIGHEST,
+	                         INTERACTIVE_TIMEOUT_MS);
 
-        /* if there are too many requests on the queue, spawn new threads */
-        /* if there are few requests and too many handler threads, cancel a handler thread.*/
-        if ((num_requests > HIGH_REQUESTS_WATERMARK) &&
-            (num_threads < MAX_NUM_HANDLER_THREADS))
+        /* pause execution for a little bit, to allow      */
+        /* other threads to run and handle some requests.  */
         {
-            printf("main: adding thread:'%d' requests, '%d' threads\n", num_requests, num_threads);
-            add_handler_thread(handler_threads);
-        }
+            int r = rand();
 
-        if ((num_requests < LOW_REQUESTS_WATERMARK) &&
-            (num_threads > NUM_HANDLER_THREADS))
-        {
-            printf("main: deleting thread: '%d' requests, '%d' threads\n", num_requests, num_threads);
-            delete_handler_thread(handler_threads);
+            log_message(LOG_LEVEL_DEBUG, "In main: rand() = %d, RAND_MAX = %x\n", r, RAND_MAX);
         }
-
-        /* pause execution for a little bit, to allow      */
-        /* other threads to run and handle some requests.  */
-        printf("In main: rand() = %d, RAND_MAX = %x\n", rand(), RAND_MAX);
         if (rand() > 3*(RAND_MAX/4)) { /* this is done about 25% of the time */
             delay.tv_sec = 0;
             delay.tv_nsec = 1;
             nanosleep(&delay, NULL);
         }
     }
-    /* modify the flag to tell the handler threads no new requests will be generated.                  */
+    /* submit the sum tasks - their small payloads are copied into the requests */
+    for (i = 0; i < NUM_SUM_TASKS; i++) {
+        struct sum_range range;
+
+        range.first = i * SUM_TASK_RANGE;
+        range.count = SUM_TASK_RANGE;
+        sums[i] = submit_task(cpu_threads, sum_range_task, &range, sizeof(range));
+    }
+
+    /* collect the sums as the tasks finish, in whatever order they do - */
+    /* while the requests' handler threads are still serving requests.   */
     {
-        int rc;
+        struct task_completion* pending[NUM_SUM_TASKS];
+        int num_pending = NUM_SUM_TASKS;
+        long total = 0;
+
+        for (i = 0; i < NUM_SUM_TASKS; i++) {
+            pending[i] = sums[i];
+        }
+        while (num_pending > 0) {
+            int done = wait_any_task(pending, num_pending, TASK_WAIT_FOREVER);
 
-        rc = pthread_mutex_lock(&request_mutex);
-        done_creating_requests = 1;
-        rc = pthread_cond_broadcast(&got_request);
-        rc = pthread_mutex_unlock(&request_mutex);
+            total += get_task_result(pending[done]);
+            pending[done] = pending[--num_pending];
+        }
+        printf("main: sum of 0..%d computed by '%d' tasks = '%ld'\n",
+               NUM_SUM_TASKS * SUM_TASK_RANGE - 1, NUM_SUM_TASKS, total);
+        for (i = 0; i < NUM_SUM_TASKS; i++) {
+            release_task(cpu_threads, sums[i]);
+        }
     }
 
-    /* cleanup */
+    /* no new requests will be generated - let the handler threads handle */
+    /* all queued requests and exit. abort any that get stuck.            */
+    if (shutdown_handler_threads_pool(handler_threads, POOL_SHUTDOWN_DRAIN,
+                                      SHUTDOWN_TIMEOUT_MS) > 0) {
+        fprintf(stderr, "main: handler threads are stuck - aborting them\n");
+        shutdown_handler_threads_pool(handler_threads, POOL_SHUTDOWN_ABORT,
+                                      SHUTDOWN_TIMEOUT_MS);
+    }
+
+    /* cleanup (this stops the metrics dumpers, which print the final */
+    /* metrics, too). each pool shuts down on its own.                */
+    delete_handler_threads_pool(cpu_threads);
     delete_handler_threads_pool(handler_threads);
+
+    /* all threads are gone - write out what they logged. */
+    stop_logger();
+
+    /* show how many requests were served by how few allocations. */
+    {
+        struct object_pool_stats stats;
+
+        get_requests_allocation_stats(requests, &stats);
+        printf("main: '%ld' requests allocated, '%ld' freed, from '%ld' slabs\n",
+               stats.num_allocs, stats.num_frees, stats.num_slabs);
+    }
+
+    delete_requests_queue(cpu_requests);
     delete_requests_queue(requests);
     
     printf("Glory,  we are done.\n");
@@ -0,0 +1,15 @@
+#ifndef MONOTONIC_CLOCK_H
+#define MONOTONIC_CLOCK_H
+
+#include <time.h>        /* clock_gettime()                           */
+
+/* current time of the monotonic clock, in nanoseconds */
+static inline long long monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#endif /* MONOTONIC_CLOCK_H */
@@ -0,0 +1,351 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* malloc() and free()                       */
+#include <stdalign.h>    /* alignof()                                 */
+#include <assert.h>      /* assert()                                  */
+
+#include "object_pool.h"         /* object pool functions and structs    */
+
+/* a free object - its first bytes link it to the next free object */
+struct free_object {
+    struct free_object* next;
+};
+
+/* a thread's cache of free objects of one pool */
+struct object_cache {
+    unsigned long pool_id;      /* id of the pool, 0 if unused.          */
+    struct free_object* objects;/* list of cached free objects.          */
+    int count;                  /* number of cached free objects.        */
+    long num_allocs;            /* allocations not yet folded into pool. */
+    long num_frees;             /* frees not yet folded into pool.       */
+};
+
+/* the calling thread's caches, indexed by the pools' cache slots */
+static __thread struct object_cache object_caches[MAX_OBJECT_CACHES];
+
+/* id of the next pool created. */
+static atomic_ulong next_pool_id = 1;
+
+/* ids of the live pools using each cache slot, 0 for a free slot. */
+static unsigned long cache_slot_owners[MAX_OBJECT_CACHES];
+static pthread_mutex_t cache_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* alignment of the objects handed out */
+#define OBJECT_ALIGN alignof(max_align_t)
+
+/* round 'size' up to a multiple of OBJECT_ALIGN */
+#define ALIGN_UP(size) (((size) + OBJECT_ALIGN - 1) & ~(OBJECT_ALIGN - 1))
+
+/*
+ * claim a free thread cache slot for a new pool, so no two live pools
+ * share a slot. returns -1 if all are taken - such a pool works without
+ * thread caches, locking on every allocation.
+ */
+static int claim_cache_slot(unsigned long pool_id)
+{
+    int slot;
+
+    pthread_mutex_lock(&cache_slots_lock);
+    for (slot = 0; slot < MAX_OBJECT_CACHES; slot++) {
+        if (cache_slot_owners[slot] == 0) {
+            cache_slot_owners[slot] = pool_id;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_slots_lock);
+
+    return (slot < MAX_OBJECT_CACHES) ? slot : -1;
+}
+
+/*
+ * create an object pool.
+ * input:     size of the objects the pool hands out.
+ * output:    pointer to the new pool. no slab is allocated yet.
+ */
+struct object_pool* init_object_pool(size_t object_size)
+{
+    struct object_pool* pool;
+
+    pool = (struct object_pool*)malloc(sizeof(struct object_pool));
+    if (!pool) {
+        fprintf(stderr, "init_object_pool: out of memory. exiting\n");
+        exit(1);
+    }
+
+    pool->object_size = ALIGN_UP(object_size < sizeof(struct free_object) ?
+                                 sizeof(struct free_object) : object_size);
+    pool->id = atomic_fetch_add(&next_pool_id, 1);
+    pool->cache_slot = claim_cache_slot(pool->id);
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->free_objects = NULL;
+    pool->slabs = NULL;
+    pool->num_slabs = 0;
+    pool->num_refills = 0;
+    pool->num_spills = 0;
+    atomic_init(&pool->num_allocs, 0);
+    atomic_init(&pool->num_frees, 0);
+
+    return pool;
+}
+
+/*
+ * get the calling thread's cache for the given pool.
+ * if the cache slot was used by another pool, that pool was deleted
+ * already - objects left in it belonged to its slabs, and were freed
+ * with them. the cache is simply taken over.
+ */
+static struct object_cache* get_object_cache(struct object_pool* pool)
+{
+    struct object_cache* cache = &object_caches[pool->cache_slot];
+
+    if (cache->pool_id != pool->id) {
+        cache->pool_id = pool->id;
+        cache->objects = NULL;
+        cache->count = 0;
+        cache->num_allocs = 0;
+        cache->num_frees = 0;
+    }
+
+    return cache;
+}
+
+/*
+ * add the cache's counters to the pool's. called with the pool locked.
+ */
+static void fold_cache_counters(struct object_pool* pool, struct object_cache* cache)
+{
+    atomic_fetch_add_explicit(&pool->num_allocs, cache->num_allocs, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->num_frees, cache->num_frees, memory_order_relaxed);
+    cache->num_allocs = 0;
+    cache->num_frees = 0;
+}
+
+/*
+ * allocate a new slab, and put all its objects on the pool's free list.
+ * called with the pool locked.
+ */
+static void add_slab(struct object_pool* pool)
+{
+    struct slab* a_slab;
+    char* objects;
+    size_t i;
+
+    a_slab = (struct slab*)malloc(ALIGN_UP(sizeof(struct slab)) +
+                                  OBJECTS_PER_SLAB * pool->object_size);
+    if (!a_slab) {
+        fprintf(stderr, "add_slab: out of memory. exiting\n");
+        exit(1);
+    }
+    a_slab->next = pool->slabs;
+    pool->slabs = a_slab;
+    pool->num_slabs++;
+
+    objects = (char*)a_slab + ALIGN_UP(sizeof(struct slab));
+    for (i = 0; i < OBJECTS_PER_SLAB; i++) {
+        struct free_object* object = (struct free_object*)(objects + i * pool->object_size);
+
+        object->next = (struct free_object*)pool->free_objects;
+        pool->free_objects = object;
+    }
+}
+
+/*
+ * move a batch of free objects from the pool to the thread's cache,
+ * allocating a new slab if the pool has none left.
+ */
+static void refill_object_cache(struct object_pool* pool, struct object_cache* cache)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (i = 0; i < OBJECT_CACHE_BATCH; i++) {
+        struct free_object* object;
+
+        if (!pool->free_objects) {
+            add_slab(pool);
+        }
+        object = (struct free_object*)pool->free_objects;
+        pool->free_objects = object->next;
+        object->next = cache->objects;
+        cache->objects = object;
+        cache->count++;
+    }
+    pool->num_refills++;
+    fold_cache_counters(pool, cache);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * move up to 'count' free objects from the thread's cache back to the pool.
+ */
+static void spill_object_cache(struct object_pool* pool, struct object_cache* cache,
+                               int count)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    while (count-- > 0 && cache->objects) {
+        struct free_object* object = cache->objects;
+
+        cache->objects = object->next;
+        cache->count--;
+        object->next = (struct free_object*)pool->free_objects;
+        pool->free_objects = object;
+    }
+    pool->num_spills++;
+    fold_cache_counters(pool, cache);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * allocate an object.
+ * algorithm: takes it from the thread's cache, which is refilled with a
+ *            batch from the pool when empty - so the pool's lock (and
+ *            malloc, when a slab is needed) is only hit once per batch.
+ * input:     pointer to pool.
+ * output:    pointer to the object. its contents are undefined.
+ */
+void* alloc_object(struct object_pool* pool)
+{
+    struct object_cache* cache;
+    struct free_object* object;
+
+    assert(pool);
+
+    if (pool->cache_slot < 0) { /* no thread caches - take it from the pool */
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->free_objects) {
+            add_slab(pool);
+        }
+        object = (struct free_object*)pool->free_objects;
+        pool->free_objects = object->next;
+        atomic_fetch_add_explicit(&pool->num_allocs, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&pool->lock);
+        return object;
+    }
+
+    cache = get_object_cache(pool);
+    if (!cache->objects) {
+        refill_object_cache(pool, cache);
+    }
+
+    object = cache->objects;
+    cache->objects = object->next;
+    cache->count--;
+    cache->num_allocs++;
+
+    return object;
+}
+
+/*
+ * free an object.
+ * algorithm: puts it in the thread's cache, and returns a batch to the
+ *            pool when the cache grows too big - objects allocated by a
+ *            producer and freed by a handler thread flow back this way.
+ * input:     pointer to pool, object allocated from it.
+ */
+void free_object(struct object_pool* pool, void* object)
+{
+    struct object_cache* cache;
+    struct free_object* a_free_object = (struct free_object*)object;
+
+    assert(pool);
+
+    if (!object) {
+        return;
+    }
+
+    if (pool->cache_slot < 0) { /* no thread caches - give it to the pool */
+        pthread_mutex_lock(&pool->lock);
+        a_free_object->next = (struct free_object*)pool->free_objects;
+        pool->free_objects = a_free_object;
+        atomic_fetch_add_explicit(&pool->num_frees, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+
+    cache = get_object_cache(pool);
+    a_free_object->next = cache->objects;
+    cache->objects = a_free_object;
+    cache->count++;
+    cache->num_frees++;
+
+    if (cache->count > OBJECT_CACHE_MAX) {
+        spill_object_cache(pool, cache, OBJECT_CACHE_BATCH);
+    }
+}
+
+/*
+ * return all the calling thread's cached objects of the pool to it.
+ */
+void flush_object_cache(struct object_pool* pool)
+{
+    struct object_cache* cache;
+
+    assert(pool);
+
+    if (pool->cache_slot < 0) {
+        return;
+    }
+
+    cache = get_object_cache(pool);
+    spill_object_cache(pool, cache, cache->count);
+}
+
+/*
+ * get the pool's allocation counters, including the calling thread's
+ * cache counters.
+ */
+void get_object_pool_stats(struct object_pool* pool, struct object_pool_stats* stats)
+{
+    struct object_cache* cache;
+
+    assert(pool);
+    assert(stats);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->cache_slot >= 0) {
+        cache = get_object_cache(pool);
+        fold_cache_counters(pool, cache);
+    }
+    stats->num_slabs = pool->num_slabs;
+    stats->num_objects = pool->num_slabs * OBJECTS_PER_SLAB;
+    stats->num_allocs = atomic_load(&pool->num_allocs);
+    stats->num_frees = atomic_load(&pool->num_frees);
+    stats->num_refills = pool->num_refills;
+    stats->num_spills = pool->num_spills;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * delete an object pool, freeing all its slabs.
+ */
+void delete_object_pool(struct object_pool* pool)
+{
+    struct object_cache* cache;
+
+    assert(pool);
+
+    /* the calling thread's cache points into the slabs - forget it, */
+    /* and let a new pool have the cache slot.                        */
+    if (pool->cache_slot >= 0) {
+        cache = get_object_cache(pool);
+        cache->pool_id = 0;
+        cache->objects = NULL;
+        cache->count = 0;
+
+        pthread_mutex_lock(&cache_slots_lock);
+        cache_slot_owners[pool->cache_slot] = 0;
+        pthread_mutex_unlock(&cache_slots_lock);
+    }
+
+    while (pool->slabs) {
+        struct slab* a_slab = pool->slabs;
+
+        pool->slabs = a_slab->next;
+        free(a_slab);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
@@ -0,0 +1,78 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <stddef.h>      /* size_t                                    */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <stdatomic.h>   /* C11 atomic types and operations           */
+
+/* number of objects carved out of each slab */
+#define OBJECTS_PER_SLAB 256
+
+/* number of objects moved between a thread's cache and the pool at once */
+#define OBJECT_CACHE_BATCH 32
+
+/* maximal number of objects kept in a thread's cache */
+#define OBJECT_CACHE_MAX (2 * OBJECT_CACHE_BATCH)
+
+/* number of live pools that can use thread caches at once */
+#define MAX_OBJECT_CACHES 16
+
+/* a slab - one malloc'ed block holding many objects */
+struct slab {
+    struct slab* next;          /* next slab of the pool, NULL if none.  */
+};
+
+/*
+ * pool of fixed size objects.
+ * objects are carved out of slabs, and are never returned to malloc
+ * until the pool is deleted. each thread keeps a small cache of free
+ * objects, and only locks the pool to move a batch of them in or out.
+ */
+struct object_pool {
+    size_t object_size;         /* size of each object, rounded up.      */
+    unsigned long id;           /* unique id, to validate thread caches. */
+    int cache_slot;             /* index of the pool's thread caches, -1 if none. */
+    pthread_mutex_t lock;       /* guards the fields below.              */
+    void* free_objects;         /* list of free objects not in caches.   */
+    struct slab* slabs;         /* list of slabs.                        */
+    long num_slabs;             /* number of slabs allocated.            */
+    long num_refills;           /* batches moved into thread caches.     */
+    long num_spills;            /* batches moved back from thread caches.*/
+    atomic_long num_allocs;     /* objects allocated (folded from caches). */
+    atomic_long num_frees;      /* objects freed (folded from caches).   */
+};
+
+/* allocation counters of an object pool */
+struct object_pool_stats {
+    long num_slabs;             /* number of slabs (mallocs) so far.     */
+    long num_objects;           /* number of objects in those slabs.     */
+    long num_allocs;            /* objects allocated so far.             */
+    long num_frees;             /* objects freed so far.                 */
+    long num_refills;           /* batches moved into thread caches.     */
+    long num_spills;            /* batches moved back from thread caches.*/
+};
+
+/* create a pool of objects of the given size */
+extern struct object_pool* init_object_pool(size_t object_size);
+
+/* allocate an object from the pool. never returns NULL. */
+extern void* alloc_object(struct object_pool* pool);
+
+/* return an object to the pool */
+extern void free_object(struct object_pool* pool, void* object);
+
+/* return the calling thread's cached objects to the pool (e.g. at exit) */
+extern void flush_object_cache(struct object_pool* pool);
+
+/*
+ * get the pool's allocation counters. allocations served from other
+ * threads' caches are only counted once those caches refill, spill
+ * or are flushed.
+ */
+extern void get_object_pool_stats(struct object_pool* pool,
+                                  struct object_pool_stats* stats);
+
+/* free the pool and all its slabs - all objects must be out of use */
+extern void delete_object_pool(struct object_pool* pool);
+
+#endif /* OBJECT_POOL_H */
@@ -0,0 +1,223 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* malloc() and free()                       */
+#include <errno.h>       /* ETIMEDOUT                                 */
+#include <time.h>        /* clock_gettime()                           */
+#include <assert.h>      /* assert()                                  */
+
+#include "pool_metrics.h"           /* pool metrics functions/structs    */
+#include "handler_threads_pool.h"   /* handler threads pool functions    */
+
+/*
+ * allocate a handler thread's metrics, and zero them.
+ */
+struct worker_metrics* new_worker_metrics(void)
+{
+    struct worker_metrics* metrics;
+
+    metrics = (struct worker_metrics*)malloc(sizeof(struct worker_metrics));
+    if (!metrics) {
+        fprintf(stderr, "new_worker_metrics: out of memory. exiting\n");
+        exit(1);
+    }
+    init_latency_histogram(&metrics->wait_time);
+    init_latency_histogram(&metrics->service_time);
+    atomic_init(&metrics->spurious_wakeups, 0);
+    atomic_init(&metrics->spin_hits, 0);
+    atomic_init(&metrics->parks, 0);
+    atomic_init(&metrics->migrations, 0);
+    atomic_init(&metrics->node_migrations, 0);
+
+    return metrics;
+}
+
+/*
+ * get a snapshot of a pool's metrics.
+ * algorithm: starts from the totals of threads that already left the
+ *            pool, and merges the histograms and counters of the live
+ *            threads - reading them while they keep recording.
+ */
+void get_pool_metrics(struct handler_threads_pool* pool, struct pool_metrics* metrics)
+{
+    struct handler_thread* a_thread;  /* one thread's structure */
+
+    assert(pool);
+    assert(metrics);
+
+    pthread_mutex_lock(&pool->threads_lock);
+
+    metrics->name = pool->name;
+    metrics->num_threads = pool->num_threads;
+    metrics->threads_added = pool->threads_added;
+    metrics->threads_removed = pool->threads_removed;
+    metrics->spurious_wakeups = pool->retired_spurious_wakeups;
+    metrics->spin_hits = pool->retired_spin_hits;
+    metrics->parks = pool->retired_parks;
+    metrics->migrations = pool->retired_migrations;
+    metrics->node_migrations = pool->retired_node_migrations;
+    metrics->wait_time = pool->retired_wait_time;
+    metrics->service_time = pool->retired_service_time;
+
+    for (a_thread = pool->threads; a_thread; a_thread = a_thread->next) {
+        struct worker_metrics* worker = a_thread->params.metrics;
+
+        histogram_merge(&metrics->wait_time, &worker->wait_time);
+        histogram_merge(&metrics->service_time, &worker->service_time);
+        metrics->spurious_wakeups += atomic_load_explicit(&worker->spurious_wakeups,
+                                                          memory_order_relaxed);
+        metrics->spin_hits += atomic_load_explicit(&worker->spin_hits, memory_order_relaxed);
+        metrics->parks += atomic_load_explicit(&worker->parks, memory_order_relaxed);
+        metrics->migrations += atomic_load_explicit(&worker->migrations, memory_order_relaxed);
+        metrics->node_migrations += atomic_load_explicit(&worker->node_migrations,
+                                                         memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&pool->threads_lock);
+
+    get_requests_queue_counters(pool->requests, &metrics->enqueued, &metrics->dequeued);
+    get_requests_overflow_counters(pool->requests, &metrics->rejected, &metrics->dropped,
+                                   &metrics->caller_runs);
+    metrics->expired = get_requests_expired(pool->requests);
+    if (pool->scheduler) {
+        metrics->enqueued += atomic_load(&pool->scheduler->num_added);
+        metrics->dequeued += atomic_load(&pool->scheduler->num_taken);
+    }
+}
+
+/*
+ * print a metrics snapshot. latencies are printed in microseconds.
+ */
+void print_pool_metrics(FILE* out, const struct pool_metrics* metrics)
+{
+    const struct histogram_snapshot* wait = &metrics->wait_time;
+    const struct histogram_snapshot* service = &metrics->service_time;
+
+    assert(out);
+    assert(metrics);
+
+    fprintf(out,
+            "metrics[%s]: threads %d (+%ld/-%ld), enqueued %ld, dequeued %ld, "
+            "handled %lld, spurious wakeups %ld, spin hits %ld, parks %ld, "
+            "migrations %ld (%ld across nodes)\n"
+            "metrics[%s]: shed: rejected %ld, dropped %ld, caller runs %ld, expired %ld\n"
+            "metrics[%s]: wait    us: p50 %.1f p99 %.1f p999 %.1f max %.1f\n"
+            "metrics[%s]: service us: p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+            metrics->name, metrics->num_threads, metrics->threads_added, metrics->threads_removed,
+            metrics->enqueued, metrics->dequeued, service->count,
+            metrics->spurious_wakeups, metrics->spin_hits, metrics->parks,
+            metrics->migrations, metrics->node_migrations,
+            metrics->name, metrics->rejected, metrics->dropped, metrics->caller_runs, metrics->expired,
+            metrics->name, histogram_percentile(wait, 50) / 1e3, histogram_percentile(wait, 99) / 1e3,
+            histogram_percentile(wait, 99.9) / 1e3, wait->max / 1e3,
+            metrics->name, histogram_percentile(service, 50) / 1e3, histogram_percentile(service, 99) / 1e3,
+            histogram_percentile(service, 99.9) / 1e3, service->max / 1e3);
+    fflush(out);
+}
+
+/*
+ * the metrics dumper thread's loop - print a snapshot every interval,
+ * until asked to stop.
+ */
+static void* dump_metrics(void* data)
+{
+    struct metrics_dumper* dumper = (struct metrics_dumper*)data;
+    struct pool_metrics* metrics;
+
+    /* a snapshot is a few KB - keep it off the thread's stack */
+    metrics = (struct pool_metrics*)malloc(sizeof(struct pool_metrics));
+    if (!metrics) {
+        fprintf(stderr, "dump_metrics: out of memory. exiting\n");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&dumper->lock);
+    while (!dumper->stop) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)dumper->interval_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        if (pthread_cond_timedwait(&dumper->wakeup, &dumper->lock, &deadline) == ETIMEDOUT &&
+            !dumper->stop) {
+            pthread_mutex_unlock(&dumper->lock);
+            get_pool_metrics(dumper->pool, metrics);
+            print_pool_metrics(dumper->out, metrics);
+            pthread_mutex_lock(&dumper->lock);
+        }
+    }
+    pthread_mutex_unlock(&dumper->lock);
+
+    free(metrics);
+
+    return NULL;
+}
+
+/*
+ * start a metrics dumper thread for a pool.
+ * input:     pool to report, stream to print to, interval between dumps.
+ * output:    pointer to the dumper. the pool keeps a pointer to it, and
+ *            stops it when the pool is deleted.
+ */
+struct metrics_dumper* start_metrics_dumper(struct handler_threads_pool* pool, FILE* out,
+                                            int interval_ms)
+{
+    struct metrics_dumper* dumper;
+
+    assert(pool);
+    assert(out);
+    assert(interval_ms > 0);
+    assert(!pool->metrics_dumper);
+
+    dumper = (struct metrics_dumper*)malloc(sizeof(struct metrics_dumper));
+    if (!dumper) {
+        fprintf(stderr, "start_metrics_dumper: out of memory. exiting\n");
+        exit(1);
+    }
+    dumper->pool = pool;
+    dumper->out = out;
+    dumper->interval_ms = interval_ms;
+    pthread_mutex_init(&dumper->lock, NULL);
+    pthread_cond_init(&dumper->wakeup, NULL);
+    dumper->stop = 0;
+
+    pool->metrics_dumper = dumper;
+    pthread_create(&dumper->thread, NULL, dump_metrics, (void*)dumper);
+
+    return dumper;
+}
+
+/*
+ * stop a metrics dumper - wake its thread, wait for it to exit, print
+ * one last snapshot (the pool deletes its threads before stopping the
+ * dumper, so this one has the final totals), and free it.
+ */
+void stop_metrics_dumper(struct metrics_dumper* dumper)
+{
+    assert(dumper);
+
+    pthread_mutex_lock(&dumper->lock);
+    dumper->stop = 1;
+    pthread_cond_signal(&dumper->wakeup);
+    pthread_mutex_unlock(&dumper->lock);
+
+    pthread_join(dumper->thread, NULL);
+
+    {
+        struct pool_metrics* metrics;
+
+        metrics = (struct pool_metrics*)malloc(sizeof(struct pool_metrics));
+        if (!metrics) {
+            fprintf(stderr, "stop_metrics_dumper: out of memory. exiting\n");
+            exit(1);
+        }
+        get_pool_metrics(dumper->pool, metrics);
+        print_pool_metrics(dumper->out, metrics);
+        free(metrics);
+    }
+
+    dumper->pool->metrics_dumper = NULL;
+    pthread_mutex_destroy(&dumper->lock);
+    pthread_cond_destroy(&dumper->wakeup);
+    free(dumper);
+}
@@ -0,0 +1,72 @@
+#ifndef POOL_METRICS_H
+#define POOL_METRICS_H
+
+#include <stdio.h>       /* standard I/O routines                     */
+#include <pthread.h>     /* pthread functions and data structures     */
+#include <stdatomic.h>   /* C11 atomic types and operations           */
+
+#include "latency_histogram.h"   /* latency histograms                   */
+
+struct handler_threads_pool;
+
+/* metrics of a single handler thread - written by that thread only */
+struct worker_metrics {
+    struct latency_histogram wait_time;    /* enqueue till dequeue.        */
+    struct latency_histogram service_time; /* dequeue till handled.        */
+    atomic_llong spurious_wakeups;         /* woke up, found no request.   */
+    atomic_llong spin_hits;                /* got a request while spinning. */
+    atomic_llong parks;                    /* went to sleep for a request. */
+    atomic_llong migrations;               /* moved to another CPU.        */
+    atomic_llong node_migrations;          /* moved to another NUMA node.  */
+};
+
+/* a snapshot of the metrics of a whole handler threads pool */
+struct pool_metrics {
+    const char* name;           /* the pool's name.                      */
+    int num_threads;            /* threads in the pool right now.        */
+    long threads_added;         /* threads added since pool creation.    */
+    long threads_removed;       /* threads removed since pool creation.  */
+    long enqueued;              /* requests (and retire tokens) queued.  */
+    long dequeued;              /* requests (and retire tokens) taken.   */
+    long rejected;              /* requests the full queue refused,      */
+    long dropped;               /* dropped to make room in it,           */
+    long caller_runs;           /* and left for their producers to run.  */
+    long expired;               /* requests dropped past their deadline. */
+    long spurious_wakeups;      /* wakeups that found no request.        */
+    long spin_hits;             /* requests found while spinning.        */
+    long parks;                 /* times a thread slept for a request.   */
+    long migrations;            /* times a thread moved to another CPU,  */
+    long node_migrations;       /* and to another NUMA node.             */
+    struct histogram_snapshot wait_time;    /* queue wait of requests.   */
+    struct histogram_snapshot service_time; /* handling time of requests. */
+};
+
+/* periodic dumper of a pool's metrics */
+struct metrics_dumper {
+    struct handler_threads_pool* pool;  /* pool being reported.           */
+    FILE* out;                          /* where to print the metrics.    */
+    int interval_ms;                    /* time between two dumps.        */
+    pthread_t thread;                   /* dumper thread's handle.        */
+    pthread_mutex_t lock;               /* guards 'stop'.                 */
+    pthread_cond_t  wakeup;             /* signaled to stop the thread.   */
+    int stop;                           /* should the thread exit?        */
+};
+
+/* allocate a handler thread's (zeroed) metrics */
+extern struct worker_metrics* new_worker_metrics(void);
+
+/* get a snapshot of the metrics of the pool and its requests queue */
+extern void get_pool_metrics(struct handler_threads_pool* pool,
+                             struct pool_metrics* metrics);
+
+/* print a metrics snapshot as a single line, with p50/p99/p999 latencies */
+extern void print_pool_metrics(FILE* out, const struct pool_metrics* metrics);
+
+/* start printing the pool's metrics to 'out' every 'interval_ms' */
+extern struct metrics_dumper*
+start_metrics_dumper(struct handler_threads_pool* pool, FILE* out, int interval_ms);
+
+/* stop the metrics dumper thread, print a last snapshot, free the dumper */
+extern void stop_metrics_dumper(struct metrics_dumper* dumper);
+
+#endif /* POOL_METRICS_H */
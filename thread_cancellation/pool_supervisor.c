@@ -0,0 +1,220 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* malloc() and free()                       */
+#include <errno.h>       /* ETIMEDOUT                                 */
+#include <time.h>        /* clock_gettime()                           */
+#include <assert.h>      /* assert()                                  */
+
+#include "pool_supervisor.h"        /* pool supervisor functions/structs */
+#include "handler_threads_pool.h"   /* handler threads pool functions    */
+#include "monotonic_clock.h"        /* monotonic_ns()                    */
+#include "async_logger.h"           /* log_message()                     */
+
+/* default configuration values */
+#define DEFAULT_SAMPLE_INTERVAL_MS 10
+#define DEFAULT_HIGH_DEPTH 15
+#define DEFAULT_LOW_DEPTH 3
+#define DEFAULT_HIGH_WAIT_MS 5.0
+#define DEFAULT_LOW_WAIT_MS 1.0
+#define DEFAULT_HIGH_UTILIZATION 0.75
+#define DEFAULT_LOW_UTILIZATION 0.25
+#define DEFAULT_HYSTERESIS_SAMPLES 2
+#define DEFAULT_COOLDOWN_MS 50
+
+/*
+ * fill a supervisor configuration with the default values.
+ */
+void init_pool_supervisor_config(struct pool_supervisor_config* config,
+                                 int min_threads, int max_threads)
+{
+    assert(config);
+    assert(min_threads <= max_threads);
+
+    config->min_threads = min_threads;
+    config->max_threads = max_threads;
+    config->sample_interval_ms = DEFAULT_SAMPLE_INTERVAL_MS;
+    config->high_depth = DEFAULT_HIGH_DEPTH;
+    config->low_depth = DEFAULT_LOW_DEPTH;
+    config->high_wait_ms = DEFAULT_HIGH_WAIT_MS;
+    config->low_wait_ms = DEFAULT_LOW_WAIT_MS;
+    config->high_utilization = DEFAULT_HIGH_UTILIZATION;
+    config->low_utilization = DEFAULT_LOW_UTILIZATION;
+    config->hysteresis_samples = DEFAULT_HYSTERESIS_SAMPLES;
+    config->cooldown_ms = DEFAULT_COOLDOWN_MS;
+}
+
+/*
+ * sleep for one sample interval, or until asked to stop.
+ * output:    1 if the supervisor should stop, 0 otherwise.
+ */
+static int wait_sample_interval(struct pool_supervisor* supervisor)
+{
+    struct timespec deadline;
+    int stop;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)supervisor->config.sample_interval_ms * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&supervisor->lock);
+    while (!supervisor->stop &&
+           pthread_cond_timedwait(&supervisor->wakeup, &supervisor->lock,
+                                  &deadline) != ETIMEDOUT)
+        ;
+    stop = supervisor->stop;
+    pthread_mutex_unlock(&supervisor->lock);
+
+    return stop;
+}
+
+/*
+ * the supervisor thread's loop.
+ * ::every sample interval, compute from the pool's load counters the
+ * average queue wait and the threads' utilization over the last interval.
+ * a sample 'votes' for growing when the backlog is deep, or when requests
+ * wait long while the threads are busy, and for shrinking when the
+ * backlog is shallow, waits are short and threads mostly idle.
+ * the pool is only resized after 'hysteresis_samples' consecutive votes
+ * the same way, and not within 'cooldown_ms' of the previous resize.
+ */
+static void* supervise_pool(void* data)
+{
+    struct pool_supervisor* supervisor = (struct pool_supervisor*)data;
+    struct pool_supervisor_config* config = &supervisor->config;
+    struct handler_threads_load last;   /* load at the previous sample.   */
+    long long last_ns;                  /* time of the previous sample.   */
+    long long last_resize_ns = 0;       /* time of the previous resize.   */
+    int grow_votes = 0;                 /* consecutive votes to grow.     */
+    int shrink_votes = 0;               /* consecutive votes to shrink.   */
+
+    get_handler_threads_load(supervisor->pool, &last);
+    last_ns = monotonic_ns();
+
+    while (!wait_sample_interval(supervisor)) {
+        struct handler_threads_load load;
+        long long now_ns = monotonic_ns();
+        long handled;
+        double avg_wait_ms = 0.0;
+        double utilization = 0.0;
+
+        get_handler_threads_load(supervisor->pool, &load);
+
+        handled = load.num_handled - last.num_handled;
+        if (handled > 0) {
+            avg_wait_ms = (load.wait_ns - last.wait_ns) / 1e6 / handled;
+        }
+        if (load.num_threads > 0 && now_ns > last_ns) {
+            utilization = (double)(load.busy_ns - last.busy_ns) /
+                          ((double)(now_ns - last_ns) * load.num_threads);
+        }
+        last = load;
+        last_ns = now_ns;
+
+        if (load.num_pending > config->high_depth ||
+            (avg_wait_ms > config->high_wait_ms &&
+             utilization > config->high_utilization)) {
+            grow_votes++;
+            shrink_votes = 0;
+        }
+        else if (load.num_pending < config->low_depth &&
+                 avg_wait_ms < config->low_wait_ms &&
+                 utilization < config->low_utilization) {
+            shrink_votes++;
+            grow_votes = 0;
+        }
+        else {
+            grow_votes = 0;
+            shrink_votes = 0;
+        }
+
+        /* below the minimum (e.g. at startup) - grow right away */
+        if (load.num_threads < config->min_threads) {
+            add_handler_thread(supervisor->pool);
+            supervisor->num_added++;
+            continue;
+        }
+
+        if (now_ns - last_resize_ns < (long long)config->cooldown_ms * 1000000LL) {
+            continue;
+        }
+
+        if (grow_votes >= config->hysteresis_samples &&
+            load.num_threads < config->max_threads) {
+            log_message(LOG_LEVEL_INFO,
+                        "supervisor: adding thread: '%d' requests, '%d' threads, "
+                        "wait %.2fms, utilization %.0f%%\n",
+                        load.num_pending, load.num_threads, avg_wait_ms, utilization * 100);
+            add_handler_thread(supervisor->pool);
+            supervisor->num_added++;
+            last_resize_ns = now_ns;
+            grow_votes = 0;
+        }
+        else if (shrink_votes >= config->hysteresis_samples &&
+                 load.num_threads > config->min_threads) {
+            log_message(LOG_LEVEL_INFO,
+                        "supervisor: retiring thread: '%d' requests, '%d' threads, "
+                        "wait %.2fms, utilization %.0f%%\n",
+                        load.num_pending, load.num_threads, avg_wait_ms, utilization * 100);
+            retire_idle_handler_thread(supervisor->pool);
+            supervisor->num_retired++;
+            last_resize_ns = now_ns;
+            shrink_votes = 0;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * start supervising a pool.
+ * input:     pool to supervise, configuration (copied).
+ * output:    pointer to the supervisor. the pool keeps a pointer to it,
+ *            and stops it when the pool is deleted.
+ */
+struct pool_supervisor* start_pool_supervisor(struct handler_threads_pool* pool,
+                                              const struct pool_supervisor_config* config)
+{
+    struct pool_supervisor* supervisor;
+
+    assert(pool);
+    assert(config);
+    assert(!pool->supervisor);
+
+    supervisor = (struct pool_supervisor*)malloc(sizeof(struct pool_supervisor));
+    if (!supervisor) {
+        fprintf(stderr, "start_pool_supervisor: out of memory. exiting\n");
+        exit(1);
+    }
+    supervisor->pool = pool;
+    supervisor->config = *config;
+    pthread_mutex_init(&supervisor->lock, NULL);
+    pthread_cond_init(&supervisor->wakeup, NULL);
+    supervisor->stop = 0;
+    supervisor->num_added = 0;
+    supervisor->num_retired = 0;
+
+    pool->supervisor = supervisor;
+    pthread_create(&supervisor->thread, NULL, supervise_pool, (void*)supervisor);
+
+    return supervisor;
+}
+
+/*
+ * stop a supervisor - wake its thread, wait for it to exit, and free it.
+ */
+void stop_pool_supervisor(struct pool_supervisor* supervisor)
+{
+    assert(supervisor);
+
+    pthread_mutex_lock(&supervisor->lock);
+    supervisor->stop = 1;
+    pthread_cond_signal(&supervisor->wakeup);
+    pthread_mutex_unlock(&supervisor->lock);
+
+    pthread_join(supervisor->thread, NULL);
+
+    supervisor->pool->supervisor = NULL;
+    pthread_mutex_destroy(&supervisor->lock);
+    pthread_cond_destroy(&supervisor->wakeup);
+    free(supervisor);
+}
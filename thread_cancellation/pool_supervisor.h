@@ -0,0 +1,51 @@
+#ifndef POOL_SUPERVISOR_H
+#define POOL_SUPERVISOR_H
+
+#include <pthread.h>     /* pthread functions and data structures     */
+
+struct handler_threads_pool;
+
+/* configuration of a pool supervisor */
+struct pool_supervisor_config {
+    int min_threads;            /* never retire below this many threads.   */
+    int max_threads;            /* never add above this many threads.      */
+    int sample_interval_ms;     /* time between two samples of the load.   */
+    int high_depth;             /* pending requests warranting a new thread. */
+    int low_depth;              /* pending requests allowing a retirement. */
+    double high_wait_ms;        /* average queue wait warranting a thread. */
+    double low_wait_ms;         /* average queue wait allowing retirement. */
+    double high_utilization;    /* busy fraction of threads (0..1) that,   */
+                                /* with a high wait, warrants a thread.    */
+    double low_utilization;     /* busy fraction allowing a retirement.    */
+    int hysteresis_samples;     /* consecutive samples needed to act.      */
+    int cooldown_ms;            /* minimal time between two resizes.       */
+};
+
+/* structure of a pool supervisor */
+struct pool_supervisor {
+    struct handler_threads_pool* pool;   /* pool being supervised.         */
+    struct pool_supervisor_config config;/* supervisor's configuration.    */
+    pthread_t thread;                    /* supervisor thread's handle.    */
+    pthread_mutex_t lock;                /* guards 'stop'.                 */
+    pthread_cond_t  wakeup;              /* signaled to stop the thread.   */
+    int stop;                            /* should the thread exit?        */
+    int num_added;                       /* threads added so far.          */
+    int num_retired;                     /* threads retired so far.        */
+};
+
+/* fill a configuration with the defaults, between 'min' and 'max' threads */
+extern void init_pool_supervisor_config(struct pool_supervisor_config* config,
+                                        int min_threads, int max_threads);
+
+/*
+ * start a supervisor thread that samples the pool's load every interval,
+ * and grows or shrinks it between the configured sizes.
+ */
+extern struct pool_supervisor*
+start_pool_supervisor(struct handler_threads_pool* pool,
+                      const struct pool_supervisor_config* config);
+
+/* stop the supervisor thread, and free the supervisor */
+extern void stop_pool_supervisor(struct pool_supervisor* supervisor);
+
+#endif /* POOL_SUPERVISOR_H */
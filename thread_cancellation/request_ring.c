@@ -0,0 +1,155 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* malloc() and free()                       */
+#include <assert.h>      /* assert()                                  */
+
+#include "request_ring.h"        /* request ring functions and structs   */
+
+/*
+ * create a request ring.
+ * algorithm: rounds the capacity up to a power of 2, so positions can be
+ *            mapped to slots with a mask, and numbers each slot with its
+ *            own index - meaning "free for the producer at this position".
+ * input:     minimal number of requests the ring should hold.
+ * output:    pointer to the new ring.
+ */
+struct request_ring* init_request_ring(size_t capacity)
+{
+    struct request_ring* ring;
+    size_t size = 2;
+    size_t i;
+
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    ring = (struct request_ring*)malloc(sizeof(struct request_ring));
+    if (!ring) {
+        fprintf(stderr, "init_request_ring: out of memory. exiting\n");
+        exit(1);
+    }
+    ring->cells = (struct ring_cell*)malloc(size * sizeof(struct ring_cell));
+    if (!ring->cells) {
+        fprintf(stderr, "init_request_ring: out of memory. exiting\n");
+        exit(1);
+    }
+
+    for (i = 0; i < size; i++) {
+        atomic_init(&ring->cells[i].seq, i);
+        ring->cells[i].request = NULL;
+    }
+    ring->mask = size - 1;
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+
+    return ring;
+}
+
+/*
+ * add a request to the ring.
+ * algorithm: claims the slot at the enqueue position with a CAS, once its
+ *            sequence number says it's free, stores the request and then
+ *            publishes it by advancing the slot's sequence number.
+ * input:     pointer to ring, request to add.
+ * output:    0 on success, -1 if the ring is full.
+ */
+int request_ring_push(struct request_ring* ring, struct request* a_request)
+{
+    struct ring_cell* cell;
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+
+    while (1) {
+        size_t seq;
+        long diff;
+
+        cell = &ring->cells[pos & ring->mask];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        diff = (long)seq - (long)pos;
+
+        if (diff == 0) { /* slot is free - try to claim it */
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+            /* lost the race - 'pos' now holds the current position */
+        }
+        else if (diff < 0) { /* slot still holds a request from the last lap */
+            return -1;
+        }
+        else { /* another producer claimed it - reload the position */
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->request = a_request;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    return 0;
+}
+
+/*
+ * take the oldest request off the ring.
+ * algorithm: claims the slot at the dequeue position with a CAS, once its
+ *            sequence number says it's filled, takes the request and then
+ *            frees the slot for the producer of the next lap.
+ * input:     pointer to ring.
+ * output:    pointer to the removed request, or NULL if the ring is empty.
+ */
+struct request* request_ring_pop(struct request_ring* ring)
+{
+    struct ring_cell* cell;
+    struct request* a_request;
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+
+    while (1) {
+        size_t seq;
+        long diff;
+
+        cell = &ring->cells[pos & ring->mask];
+        seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        diff = (long)seq - (long)(pos + 1);
+
+        if (diff == 0) { /* slot is filled - try to claim it */
+            if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) { /* nothing was published here yet */
+            return NULL;
+        }
+        else { /* another consumer claimed it - reload the position */
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    a_request = cell->request;
+    atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+
+    return a_request;
+}
+
+/*
+ * get the number of requests in the ring. only a snapshot - producers
+ * and consumers may move the positions while we read them.
+ */
+size_t request_ring_size(struct request_ring* ring)
+{
+    size_t deq = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    size_t enq = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+
+    return (enq > deq) ? enq - deq : 0;
+}
+
+/*
+ * delete a request ring, freeing its slots array. any requests still
+ * stored in it are the caller's business.
+ */
+void delete_request_ring(struct request_ring* ring)
+{
+    assert(ring);
+
+    free(ring->cells);
+    free(ring);
+}
@@ -0,0 +1,56 @@
+#ifndef REQUEST_RING_H
+#define REQUEST_RING_H
+
+#include <stddef.h>      /* size_t                                    */
+#include <stdatomic.h>   /* C11 atomic types and operations           */
+
+/* size of a cache line, used to keep producers' and consumers' */
+/* positions from sharing (and bouncing) the same line.         */
+#define CACHE_LINE_SIZE 64
+
+struct request;
+
+/*
+ * format of a single slot in the ring.
+ * 'seq' tells who may use the slot next: a producer when it equals the
+ * enqueue position, a consumer when it equals the enqueue position + 1.
+ */
+struct ring_cell {
+    atomic_size_t   seq;         /* sequence number of the slot.           */
+    struct request* request;     /* request stored in the slot.            */
+};
+
+/*
+ * bounded multi-producer/multi-consumer ring of request pointers.
+ * lock free - producers and consumers only contend on their own
+ * position counter, each kept on its own cache line.
+ */
+struct request_ring {
+    struct ring_cell* cells;     /* array of 'capacity' slots.             */
+    size_t mask;                 /* capacity - 1 (capacity is a power of 2). */
+    char pad0[CACHE_LINE_SIZE];
+    atomic_size_t enqueue_pos;   /* next position to add a request at.     */
+    char pad1[CACHE_LINE_SIZE - sizeof(atomic_size_t)];
+    atomic_size_t dequeue_pos;   /* next position to take a request from.  */
+    char pad2[CACHE_LINE_SIZE - sizeof(atomic_size_t)];
+};
+
+/*
+ * create a ring able to hold at least 'capacity' requests.
+ * the capacity is rounded up to a power of 2.
+ */
+extern struct request_ring* init_request_ring(size_t capacity);
+
+/* add a request to the ring. returns 0 on success, -1 if the ring is full. */
+extern int request_ring_push(struct request_ring* ring, struct request* a_request);
+
+/* take the oldest request off the ring. returns NULL if the ring is empty. */
+extern struct request* request_ring_pop(struct request_ring* ring);
+
+/* get the (approximate) number of requests in the ring */
+extern size_t request_ring_size(struct request_ring* ring);
+
+/* free the resources taken by the ring (not the requests in it) */
+extern void delete_request_ring(struct request_ring* ring);
+
+#endif /* REQUEST_RING_H */
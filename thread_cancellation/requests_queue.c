@@ -1,72 +1,1348 @@
 #include <stdlib.h>      /* malloc() and free()                       */
+#include <string.h>      /* memcpy()                                  */
 #include <assert.h>      /* assert()                                  */
+#include <sched.h>       /* sched_yield()                             */
+#include <unistd.h>      /* syscall()                                 */
+#include <limits.h>      /* INT_MAX                                   */
+#include <errno.h>       /* EAGAIN, ETIMEDOUT                         */
+#include <sys/syscall.h> /* SYS_futex                                 */
+#include <linux/futex.h> /* FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE    */
 
 #include "requests_queue.h"      /* requests queue functions and structs */
+#include "monotonic_clock.h"     /* monotonic_ns()                       */
 
 
 /* Create a requests queue.
  * Creates a request queue structure, initialize with given parameters.
  */
-struct requests_queue* init_requests_queue(pthread_mutex_t* p_mutex,
-                                           pthread_cond_t*  p_cond_var)
+struct requests_queue* init_requests_queue(void)
 {
+    return init_requests_queue_backend(REQUESTS_QUEUE_LIST, 0);
+}
+
+/* Create a requests queue using the given backend.
+ * Creates a request queue structure, initialize with given parameters,
+ * and for a ring backend, allocates a ring of 'capacity' slots.
+ */
+struct requests_queue* init_requests_queue_backend(enum requests_queue_backend backend,
+                                                   size_t capacity)
+{
+    struct requests_queue* queue;
+    int i;
+    printf("Size of struct requests_queue = %zu\n", sizeof(struct requests_queue));
+	queue = (struct requests_queue*) malloc(sizeof(struct requests_queue));
+    if (!queue) {
+	    fprintf(stderr, "out of memory. exiting\n");
+	    exit(1);
+    }
+
+    /* initialize queue */
+    for (i = 0; i < REQUEST_PRIORITIES; i++) {
+        queue->requests[i] = NULL;
+        queue->last_request[i] = NULL;
+    }
+    queue->pending_classes = 0;
+    queue->aging_ns = DEFAULT_REQUEST_AGING_MS * 1000000LL;
+    queue->num_requests = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    queue->ring = NULL;
+    atomic_init(&queue->ring_requests, 0);
+    queue->skipped_tokens = NULL;
+    atomic_init(&queue->num_skipped_tokens, 0);
+    pthread_mutex_init(&queue->park_lock, NULL);
+    queue->parked = NULL;
+    atomic_init(&queue->num_parked, 0);
+    queue->num_enqueued = 0;
+    queue->num_dequeued = 0;
+    queue->request_pool = init_object_pool(sizeof(struct request));
+    queue->completion_pool = init_object_pool(sizeof(struct task_completion));
+    atomic_init(&queue->completions, 0);
+    atomic_init(&queue->num_any_waiters, 0);
+    queue->capacity = 0;
+    queue->overflow_policy = REQUESTS_OVERFLOW_BLOCK;
+    queue->overflow_timeout_ms = TASK_WAIT_FOREVER;
+    atomic_init(&queue->dequeues, 0);
+    atomic_init(&queue->num_room_waiters, 0);
+    atomic_init(&queue->num_rejected, 0);
+    atomic_init(&queue->num_dropped, 0);
+    atomic_init(&queue->num_caller_runs, 0);
+    queue->dispatch = REQUESTS_DISPATCH_PRIORITY;
+    queue->deadline_heap = NULL;
+    queue->heap_size = 0;
+    queue->heap_capacity = 0;
+    atomic_init(&queue->num_expired, 0);
+
+    if (backend == REQUESTS_QUEUE_RING) {
+        queue->ring = init_request_ring(capacity > 0 ? capacity : DEFAULT_RING_CAPACITY);
+    }
+
+    return queue;
+}
+
+/*
+ * sleep while the futex word still holds 'value'. may return early.
+ */
+static void futex_wait(atomic_uint* futex, unsigned int value)
+{
+    syscall(SYS_futex, (unsigned int*)futex, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+/*
+ * sleep while the futex word still holds 'value', for up to 'timeout_ns'
+ * nanoseconds (forever if negative). may return early.
+ */
+static void futex_wait_timeout(atomic_uint* futex, unsigned int value, long long timeout_ns)
+{
+    struct timespec timeout;
+
+    if (timeout_ns < 0) {
+        futex_wait(futex, value);
+        return;
+    }
+    timeout.tv_sec = timeout_ns / 1000000000LL;
+    timeout.tv_nsec = timeout_ns % 1000000000LL;
+    syscall(SYS_futex, (unsigned int*)futex, FUTEX_WAIT_PRIVATE, value, &timeout, NULL, 0);
+}
+
+/*
+ * wake a thread sleeping on the futex word.
+ */
+static void futex_wake(atomic_uint* futex)
+{
+    syscall(SYS_futex, (unsigned int*)futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/*
+ * wake all threads sleeping on the futex word.
+ */
+static void futex_wake_all(atomic_uint* futex)
+{
+    syscall(SYS_futex, (unsigned int*)futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* most parked waiters popped per park lock hold, when waking several */
+#define WAKE_BATCH_SIZE 16
+
+/*
+ * wake a waiter, that was popped off the parked stack.
+ * a waiter may return (and reuse its slot) as soon as it sees its futex
+ * word set - so the waiter may not be touched after that, besides the
+ * futex_wake(), which may then hit a slot that is already gone or parked
+ * again. the kernel only looks the address up, and a parked waiter
+ * re-checks its word, so that is harmless.
+ */
+static void wake_popped_waiter(struct request_waiter* waiter)
+{
+    atomic_store_explicit(&waiter->futex, 1, memory_order_release);
+    futex_wake(&waiter->futex);
+}
+
+/*
+ * wake up to 'count' parked waiters, after 'count' requests were added.
+ * algorithm: a waiter parks itself before re-checking for requests, and
+ *            we check the number of parked waiters after the requests
+ *            were published: at least one of us sees the other. so we
+ *            only pay for the park lock, and a futex wake system call,
+ *            when somebody is actually parked. the waiters that parked
+ *            last are woken first.
+ *            the waiters are popped into a local array, in batches of
+ *            WAKE_BATCH_SIZE, while the park lock is held - a popped
+ *            waiter's 'next' link is its own again as soon as we unlock
+ *            (it may park again), so it's not followed after that.
+ */
+static void wake_request_waiters(struct requests_queue* queue, int count)
+{
+    struct request_waiter* woken[WAKE_BATCH_SIZE]; /* waiters popped to wake. */
+    int num_woken;
+    int i;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->num_parked, memory_order_relaxed) == 0) {
+        return;
+    }
+
+    do {
+        num_woken = 0;
+        pthread_mutex_lock(&queue->park_lock);
+        while (count > 0 && num_woken < WAKE_BATCH_SIZE && queue->parked) {
+            struct request_waiter* waiter = queue->parked;
+
+            queue->parked = waiter->next;
+            waiter->parked = 0;
+            waiter->next = NULL;
+            woken[num_woken++] = waiter;
+            atomic_fetch_sub(&queue->num_parked, 1);
+            count--;
+        }
+        pthread_mutex_unlock(&queue->park_lock);
+
+        for (i = 0; i < num_woken; i++) {
+            wake_popped_waiter(woken[i]);
+        }
+    } while (count > 0 && num_woken == WAKE_BATCH_SIZE);
+}
+
+/*
+ * wake up the last parked waiter, after a request was added.
+ */
+void wake_request_waiter(struct requests_queue* queue)
+{
+    assert(queue);
+
+    wake_request_waiters(queue, 1);
+}
+
+/*
+ * wake up all parked waiters.
+ */
+void wake_all_request_waiters(struct requests_queue* queue)
+{
+    assert(queue);
+
+    wake_request_waiters(queue, INT_MAX);
+}
+
+/*
+ * unlink a waiter from the parked stack, if it's there. called with the
+ * park lock locked. returns 1 if it was parked, 0 if a waker took it.
+ */
+static int unpark_waiter_locked(struct requests_queue* queue,
+                                struct request_waiter* waiter)
+{
+    struct request_waiter** link;
+
+    if (!waiter->parked) {
+        return 0;
+    }
+    for (link = &queue->parked; *link != waiter; link = &(*link)->next)
+        ;
+    *link = waiter->next;
+    waiter->parked = 0;
+    waiter->next = NULL;
+    atomic_fetch_sub(&queue->num_parked, 1);
+
+    return 1;
+}
+
+/*
+ * wake up the given waiter, if it's parked.
+ */
+void wake_this_request_waiter(struct requests_queue* queue,
+                              struct request_waiter* waiter)
+{
+    int was_parked;
+
+    assert(queue);
+    assert(waiter);
+
+    pthread_mutex_lock(&queue->park_lock);
+    was_parked = unpark_waiter_locked(queue, waiter);
+    pthread_mutex_unlock(&queue->park_lock);
+
+    if (was_parked) {
+        wake_popped_waiter(waiter);
+    }
+}
+
+/*
+ * park a waiter on the queue, before it checks for requests one last
+ * time. see wake_request_waiters() for why no wakeup is lost.
+ */
+void prepare_request_wait(struct requests_queue* queue,
+                          struct request_waiter* waiter)
+{
+    assert(queue);
+    assert(waiter);
+
+    atomic_store_explicit(&waiter->futex, 0, memory_order_relaxed);
+
+    pthread_mutex_lock(&queue->park_lock);
+    /* a waiter is prepared once per wait - never while still parked */
+    assert(!waiter->parked);
+    waiter->next = queue->parked;
+    queue->parked = waiter;
+    waiter->parked = 1;
+    atomic_fetch_add(&queue->num_parked, 1);
+    pthread_mutex_unlock(&queue->park_lock);
+
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/*
+ * unpark a waiter that found a request (or was told to stop) after it
+ * prepared to wait. if a waker picked it in the meantime, that wakeup was
+ * meant for a request somebody else may still need to handle - so it's
+ * passed on to the next parked waiter.
+ * a waiter a waker picked isn't ours until the waker set its futex word
+ * (the waker stores it right after unlocking), so we wait for that -
+ * else we could park again, and have the stale store wake us while we
+ * are still on the stack.
+ */
+void cancel_request_wait(struct requests_queue* queue,
+                         struct request_waiter* waiter)
+{
+    int was_parked;
+
+    assert(queue);
+    assert(waiter);
+
+    pthread_mutex_lock(&queue->park_lock);
+    was_parked = unpark_waiter_locked(queue, waiter);
+    pthread_mutex_unlock(&queue->park_lock);
+
+    if (!was_parked) {
+        while (atomic_load_explicit(&waiter->futex, memory_order_acquire) == 0) {
+            sched_yield();
+        }
+        wake_request_waiters(queue, 1);
+    }
+}
+
+/*
+ * Create a request structure for the given request number.
+ * The request is allocated from the queue's request pool - no malloc
+ * on this path, unless the pool needs another slab - and is stamped
+ * with the current time, to measure how long it waits in the queue.
+ * memory:    the returned request need to be released by whoever handles
+ *            it, with release_request().
+ */
+struct request* new_request(struct requests_queue* queue, int request_num)
+{
+    struct request* a_request;  /* pointer to newly created request.   */
+
+    /* sanity check - make sure queue is not NULL */
+    assert(queue);
+
+    a_request = (struct request*)alloc_object(queue->request_pool);
+    a_request->number = request_num;
+    a_request->function = NULL;
+    a_request->payload = NULL;
+    a_request->completion = NULL;
+    a_request->priority = REQUEST_PRIORITY_DEFAULT;
+    a_request->enqueue_ns = monotonic_ns();
+    a_request->deadline_ns = 0;
+    a_request->retire_token = 0;
+    a_request->next = NULL;
+
+    return a_request;
+}
+
+/*
+ * append a chain of 'count' requests, 'first' to 'last', to the list of
+ * the given priority class. called with the queue's mutex locked.
+ */
+static void append_requests_locked(struct requests_queue* queue,
+                                   struct request* first, struct request* last,
+                                   int count, int priority)
+{
+    if (queue->requests[priority] == NULL) { /* special case - class is empty */
+	    queue->requests[priority] = first;
+    }
+    else {
+	    queue->last_request[priority]->next = first;
+    }
+    queue->last_request[priority] = last;
+    queue->pending_classes |= 1u << priority;
+
+    /* increase total number of pending requests. */
+    queue->num_requests += count;
+    queue->num_enqueued += count;
+}
+
+/*
+ * put a request in slot 'i' of the heap of requests with deadlines, or
+ * above it - moving the parents due later than it down.
+ */
+static void sift_deadline_request_up_locked(struct requests_queue* queue, int i,
+                                            struct request* a_request)
+{
+    struct request** heap = queue->deadline_heap;
+
+    for (; i > 0; i = (i - 1) / 2) {
+        struct request* parent = heap[(i - 1) / 2];
+
+        if (parent->deadline_ns <= a_request->deadline_ns) {
+            break;
+        }
+        heap[i] = parent;
+    }
+    heap[i] = a_request;
+}
+
+/*
+ * add a request to the heap of requests with deadlines, growing it if
+ * it's full. called with the queue's mutex locked.
+ * algorithm: a binary min-heap, ordered by deadline - the new request
+ *            is sifted up from the end.
+ */
+static void push_deadline_request_locked(struct requests_queue* queue,
+                                         struct request* a_request)
+{
+    struct request** heap;
+
+    if (queue->heap_size == queue->heap_capacity) {
+        int capacity = queue->heap_capacity ? 2 * queue->heap_capacity : DEADLINE_HEAP_SIZE;
+
+        heap = (struct request**)realloc(queue->deadline_heap,
+                                         capacity * sizeof(struct request*));
+        if (!heap) {
+            fprintf(stderr, "push_deadline_request_locked: out of memory. exiting\n");
+            exit(1);
+        }
+        queue->deadline_heap = heap;
+        queue->heap_capacity = capacity;
+    }
+
+    sift_deadline_request_up_locked(queue, queue->heap_size++, a_request);
+}
+
+/*
+ * take the request due first off the heap of requests with deadlines.
+ * called with the queue's mutex locked, and the heap not empty.
+ * algorithm: the last request replaces the root, and is sifted down.
+ */
+static struct request* pop_deadline_request_locked(struct requests_queue* queue)
+{
+    struct request** heap = queue->deadline_heap;
+    struct request* first = heap[0];
+    struct request* last = heap[--queue->heap_size];
+    int size = queue->heap_size;
+    int i = 0;
+
+    while (2 * i + 1 < size) {
+        int child = 2 * i + 1;
+
+        if (child + 1 < size && heap[child + 1]->deadline_ns < heap[child]->deadline_ns) {
+            child++;
+        }
+        if (last->deadline_ns <= heap[child]->deadline_ns) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (size > 0) {
+        heap[i] = last;
+    }
+
+    return first;
+}
+
+/*
+ * take the request due last off the heap of requests with deadlines.
+ * called with the queue's mutex locked, and the heap not empty.
+ * algorithm: the latest deadline of a min-heap is on one of its leaves -
+ *            the second half of the array - so only those are scanned.
+ *            the last request replaces it, and is sifted up, as it may
+ *            be due before its new parent.
+ */
+static struct request* pop_latest_deadline_request_locked(struct requests_queue* queue)
+{
+    struct request** heap = queue->deadline_heap;
+    struct request* latest;
+    struct request* last;
+    int latest_i = queue->heap_size / 2;
+    int i;
+
+    for (i = latest_i + 1; i < queue->heap_size; i++) {
+        if (heap[i]->deadline_ns > heap[latest_i]->deadline_ns) {
+            latest_i = i;
+        }
+    }
+    latest = heap[latest_i];
+    last = heap[--queue->heap_size];
+    if (latest_i < queue->heap_size) {
+        sift_deadline_request_up_locked(queue, latest_i, last);
+    }
+
+    return latest;
+}
+
+/*
+ * add a single request to the list - to the heap if it has a deadline
+ * and the queue dispatches earliest deadline first, or else to the end
+ * of its class' list. called with the queue's mutex locked.
+ */
+static void insert_request_locked(struct requests_queue* queue, struct request* a_request)
+{
+    if (queue->dispatch == REQUESTS_DISPATCH_EDF && a_request->deadline_ns) {
+        push_deadline_request_locked(queue, a_request);
+        queue->num_requests++;
+        queue->num_enqueued++;
+        return;
+    }
+
+    append_requests_locked(queue, a_request, a_request, 1, a_request->priority);
+}
+
+/*
+ * choose the priority class to serve next. called with the queue's mutex
+ * locked, and at least one request pending.
+ * algorithm: the highest pending class is the lowest set bit of the
+ *            pending classes bitmap. if lower classes are pending too,
+ *            the one whose first request is the most overdue - waited
+ *            longer than the aging period - is served instead, so no
+ *            class starves. at most REQUEST_PRIORITIES heads are checked.
+ */
+static int next_request_class_locked(struct requests_queue* queue)
+{
+    unsigned int classes = queue->pending_classes;
+    int chosen = __builtin_ctz(classes);
+    long long oldest;
+
+    /* a single class pending - nobody to starve. */
+    if ((classes & (classes - 1)) == 0) {
+        return chosen;
+    }
+
+    oldest = monotonic_ns() - queue->aging_ns;
+    for (classes &= classes - 1; classes; classes &= classes - 1) {
+        int priority = __builtin_ctz(classes);
+        long long enqueue_ns = queue->requests[priority]->enqueue_ns;
+
+        if (enqueue_ns < oldest) {
+            oldest = enqueue_ns;
+            chosen = priority;
+        }
+    }
+
+    return chosen;
+}
+
+/*
+ * take the next request off the list. called with the queue's mutex
+ * locked, and at least one request pending.
+ */
+static struct request* dequeue_request_locked(struct requests_queue* queue)
+{
+    int priority;
+    struct request* a_request;
+
+    /* requests with deadlines go first, unless a retire token is pending */
+    if (queue->heap_size > 0 &&
+        !(queue->requests[REQUEST_PRIORITY_HIGHEST] &&
+          queue->requests[REQUEST_PRIORITY_HIGHEST]->retire_token)) {
+        a_request = pop_deadline_request_locked(queue);
+        queue->num_requests--;
+        queue->num_dequeued++;
+        return a_request;
+    }
+
+    priority = next_request_class_locked(queue);
+    a_request = queue->requests[priority];
+
+    queue->requests[priority] = a_request->next;
+    if (queue->requests[priority] == NULL) { /* this was the class' last request */
+	    queue->last_request[priority] = NULL;
+	    queue->pending_classes &= ~(1u << priority);
+    }
+    a_request->next = NULL;
+
+    /* decrease the total number of pending requests */
+    queue->num_requests--;
+    queue->num_dequeued++;
+
+    return a_request;
+}
+
+/*
+ * set the aging period of the queue's priority classes.
+ */
+void set_requests_queue_aging(struct requests_queue* queue, int aging_ms)
+{
+    /* sanity check - make sure queue is not NULL */
+    assert(queue);
+    assert(aging_ms >= 0);
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->aging_ns = aging_ms * 1000000LL;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * set the queue's limit of pending requests, and its overflow policy.
+ */
+void set_requests_queue_limit(struct requests_queue* queue, int capacity,
+                              int policy, int timeout_ms)
+{
+    /* sanity check - make sure queue is not NULL, and policy is valid */
+    assert(queue);
+    assert(capacity >= 0);
+    assert(policy >= REQUESTS_OVERFLOW_BLOCK && policy <= REQUESTS_OVERFLOW_CALLER_RUNS);
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->capacity = capacity;
+    queue->overflow_policy = policy;
+    queue->overflow_timeout_ms = timeout_ms;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/* is the queue bounded - can adding a request to it fail? */
+static int requests_queue_bounded(struct requests_queue* queue)
+{
+    return queue->ring || queue->capacity > 0;
+}
+
+/*
+ * let producers blocked for room know requests were taken off the queue.
+ * algorithm: a blocked producer counts itself before checking for room,
+ *            and we check the count after taking the requests, so only
+ *            when somebody blocks do we bump the dequeues futex word and
+ *            wake them all - each re-checks for room.
+ */
+static void wake_room_waiters(struct requests_queue* queue)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->num_room_waiters, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&queue->dequeues, 1);
+        futex_wake_all(&queue->dequeues);
+    }
+}
+
+/*
+ * set aside a retire token a drop took off the ring's head. a ring can't
+ * take it back at its head, so it's kept here, and taken before anything
+ * on the ring - keeping its place in front.
+ */
+static void skip_ring_token(struct requests_queue* queue, struct request* token)
+{
+    pthread_mutex_lock(&queue->mutex);
+    token->next = queue->skipped_tokens;
+    queue->skipped_tokens = token;
+    atomic_fetch_add(&queue->num_skipped_tokens, 1);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * take a retire token set aside by a drop, if there is one. costs no lock
+ * when there is none.
+ */
+static struct request* take_skipped_token(struct requests_queue* queue)
+{
+    struct request* token;
+
+    if (atomic_load(&queue->num_skipped_tokens) == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    token = queue->skipped_tokens;
+    if (token) {
+        queue->skipped_tokens = token->next;
+        token->next = NULL;
+        atomic_fetch_sub(&queue->num_skipped_tokens, 1);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    return token;
+}
+
+/*
+ * take a request off the ring - a retire token set aside by a drop
+ * first - giving up the slot it reserved. retire tokens reserve none.
+ */
+static struct request* pop_ring_request(struct requests_queue* queue)
+{
+    struct request* a_request = take_skipped_token(queue);
+
+    if (a_request) {
+        return a_request;
+    }
+    a_request = request_ring_pop(queue->ring);
+
+    if (a_request && !a_request->retire_token) {
+        atomic_fetch_sub(&queue->ring_requests, 1);
+    }
+
+    return a_request;
+}
+
+/*
+ * add a request if the queue has room for it.
+ * algorithm: a ring is shared by producers without a lock, so a producer
+ *            first reserves a slot within the limit (compare and swap of
+ *            the count of reserved slots), and only then pushes - checking
+ *            the ring's size, then pushing, would let concurrent producers
+ *            all pass the check. the reservation is undone if the ring
+ *            itself is full.
+ * output:    0 if added, EAGAIN if the queue is full.
+ */
+static int offer_request(struct requests_queue* queue, struct request* a_request)
+{
+    if (queue->ring) {
+        int limit = queue->capacity > 0 ? queue->capacity : INT_MAX;
+        int reserved = atomic_load(&queue->ring_requests);
+
+        do {
+            if (reserved >= limit) {
+                return EAGAIN;
+            }
+        } while (!atomic_compare_exchange_weak(&queue->ring_requests, &reserved,
+                                               reserved + 1));
+        if (request_ring_push(queue->ring, a_request) != 0) {
+            atomic_fetch_sub(&queue->ring_requests, 1);
+            return EAGAIN;
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->capacity > 0 && queue->num_requests >= queue->capacity) {
+        pthread_mutex_unlock(&queue->mutex);
+        return EAGAIN;
+    }
+    insert_request_locked(queue, a_request);
+    pthread_mutex_unlock(&queue->mutex);
+
+    return 0;
+}
+
+/*
+ * take the oldest request of the lowest priority class pending off the
+ * list - never a retire token. if only requests with deadlines are
+ * pending (dispatching earliest deadline first), takes the one due last.
+ * called with the queue's mutex locked.
+ */
+static struct request* drop_oldest_request_locked(struct requests_queue* queue)
+{
+    unsigned int classes;
+
+    for (classes = queue->pending_classes; classes; ) {
+        int priority = 31 - __builtin_clz(classes);
+        struct request* prev = NULL;
+        struct request* a_request = queue->requests[priority];
+
+        /* retire tokens are only ever at the head of a class */
+        while (a_request && a_request->retire_token) {
+            prev = a_request;
+            a_request = a_request->next;
+        }
+        classes &= ~(1u << priority);
+        if (!a_request) {
+            continue;
+        }
+
+        if (prev) {
+            prev->next = a_request->next;
+        }
+        else {
+            queue->requests[priority] = a_request->next;
+        }
+        if (queue->last_request[priority] == a_request) {
+            queue->last_request[priority] = prev;
+        }
+        if (queue->requests[priority] == NULL) {
+            queue->pending_classes &= ~(1u << priority);
+        }
+        a_request->next = NULL;
+        queue->num_requests--;
+        queue->num_dequeued++;
+
+        return a_request;
+    }
+
+    if (queue->heap_size > 0) {
+        queue->num_requests--;
+        queue->num_dequeued++;
+        return pop_latest_deadline_request_locked(queue);
+    }
+
+    return NULL;
+}
+
+/*
+ * drop the oldest pending request, to make room for a new one.
+ * algorithm: a ring is FIFO - its head is the oldest request. retire
+ *            tokens ahead of it are never dropped: they are set aside,
+ *            still to be taken first, and a parked thread is woken for
+ *            each, in case the one woken when it was added looked
+ *            while we held it.
+ * output:    0 if a request was dropped, -1 if there was none to drop.
+ */
+static int drop_oldest_request(struct requests_queue* queue)
+{
+    struct request* a_request;
+
+    if (queue->ring) {
+        int skipped = 0;
+
+        while ((a_request = request_ring_pop(queue->ring)) != NULL &&
+               a_request->retire_token) {
+            skip_ring_token(queue, a_request);
+            skipped++;
+        }
+        if (a_request) {
+            atomic_fetch_sub(&queue->ring_requests, 1);
+        }
+        if (skipped > 0) {
+            wake_request_waiters(queue, skipped);
+        }
+    }
+    else {
+        pthread_mutex_lock(&queue->mutex);
+        a_request = drop_oldest_request_locked(queue);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    if (!a_request) {
+        return -1;
+    }
+    atomic_fetch_add_explicit(&queue->num_dropped, 1, memory_order_relaxed);
+    release_request(queue, a_request);
+
+    return 0;
+}
+
+/*
+ * Add a request to the requests list
+ * Creates a request structure, and adds it to the list.
+ * input:     pointer to queue, request number.
+ * output:    none.
+ */
+void add_request(struct requests_queue* queue, int request_num)
+{
+    add_request_prio(queue, request_num, REQUEST_PRIORITY_DEFAULT);
+}
+
+/*
+ * Add a request with a deadline to the requests list
+ * Creates a request structure due 'timeout_ms' from now, and adds it to
+ *            the end of its class' list - or to the heap of requests
+ *            with deadlines, if the queue dispatches earliest deadline
+ *            first.
+ * input:     pointer to queue, request number, priority class, timeout.
+ * output:    none.
+ */
+void add_request_deadline(struct requests_queue* queue, int request_num,
+                          int priority, int timeout_ms)
+{
+    struct request* a_request;  /* pointer to the new request.         */
+
+    /* sanity check - make sure queue is not NULL, and priority is valid */
+    assert(queue);
+    assert(priority >= REQUEST_PRIORITY_HIGHEST && priority <= REQUEST_PRIORITY_LOWEST);
+
+    a_request = new_request(queue, request_num);
+    a_request->priority = priority;
+    set_request_deadline(a_request, timeout_ms);
+    enqueue_request(queue, a_request);
+}
+
+/*
+ * set a request's deadline, relative to now.
+ */
+void set_request_deadline(struct request* a_request, int timeout_ms)
+{
+    assert(a_request);
+    assert(timeout_ms >= 0);
+
+    a_request->deadline_ns = monotonic_ns() + timeout_ms * 1000000LL;
+}
+
+/*
+ * has a request's deadline passed?
+ */
+int request_expired(const struct request* a_request, long long now_ns)
+{
+    return a_request->deadline_ns && now_ns > a_request->deadline_ns;
+}
+
+/*
+ * choose the order the queue hands out its requests in.
+ */
+void set_requests_queue_dispatch(struct requests_queue* queue, int dispatch)
+{
+    /* sanity check - make sure queue is not NULL, and dispatch is valid */
+    assert(queue);
+    assert(dispatch == REQUESTS_DISPATCH_PRIORITY || dispatch == REQUESTS_DISPATCH_EDF);
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->dispatch = dispatch;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * Add a request of a given priority class to the requests list
+ * Creates a request structure, and adds it to the end of its class' list.
+ * input:     pointer to queue, request number, priority class.
+ * output:    none.
+ */
+void add_request_prio(struct requests_queue* queue, int request_num, int priority)
+{
+    struct request* a_request;  /* pointer to the new request.         */
+
+    /* sanity check - make sure queue is not NULL, and priority is valid */
+    assert(queue);
+    assert(priority >= REQUEST_PRIORITY_HIGHEST && priority <= REQUEST_PRIORITY_LOWEST);
+
+    a_request = new_request(queue, request_num);
+    a_request->priority = priority;
+    enqueue_request(queue, a_request);
+}
+
+/*
+ * Add a retire token to the requests list
+ * Creates a request marked as a retire token. on a list backend it is
+ *            put at the head of the highest priority class, so the next
+ *            handler thread to become free takes it (unless an aged
+ *            request goes first), and one waiting thread is signaled.
+ *            a ring backend can only add it at the tail.
+ * input:     pointer to queue.
+ * output:    none.
+ */
+void add_retire_token(struct requests_queue* queue)
+{
+    struct request* a_request;  /* pointer to the token.               */
+
+    /* sanity check - make sure queue is not NULL */
+    assert(queue);
+
+    a_request = new_request(queue, -1);
+    a_request->retire_token = 1;
+    a_request->priority = REQUEST_PRIORITY_HIGHEST;
+
+    /* never refused - wait for a free slot if the ring is full. */
+    if (queue->ring) {
+        while (request_ring_push(queue->ring, a_request) != 0) {
+            sched_yield();
+        }
+        wake_request_waiter(queue);
+        return;
+    }
+
+    /* lock the mutex, to assure exclusive access to the list */
+    pthread_mutex_lock(&queue->mutex);
+
+    a_request->next = queue->requests[REQUEST_PRIORITY_HIGHEST];
+    queue->requests[REQUEST_PRIORITY_HIGHEST] = a_request;
+    if (a_request->next == NULL) { /* special case - class was empty */
+        queue->last_request[REQUEST_PRIORITY_HIGHEST] = a_request;
+    }
+    queue->pending_classes |= 1u << REQUEST_PRIORITY_HIGHEST;
+    queue->num_requests++;
+    queue->num_enqueued++;
+
+    /* unlock mutex */
+    pthread_mutex_unlock(&queue->mutex);
+
+    /* wake one thread to take the token */
+    wake_request_waiters(queue, 1);
+}
+
+/*
+ * Create a task request.
+ * algorithm: takes a request from the queue's pool, and copies the
+ *            payload into its inline buffer - or, if it's too big for it,
+ *            into a buffer of its own. the completion handle is taken
+ *            from the queue's completion pool, with one reference for
+ *            the caller and one for the request.
+ * input:     pointer to queue, task function, payload and its size,
+ *            where to return the completion handle (NULL for none).
+ * output:    the request, numbered -1.
+ * memory:    the request is released by whoever handles it, like any
+ *            request. the caller releases the completion handle with
+ *            release_task_completion().
+ */
+struct request* new_task_request(struct requests_queue* queue,
+                                 task_function function,
+                                 const void* payload, size_t size,
+                                 struct task_completion** completion)
+{
+    struct request* a_request;  /* pointer to newly created request.   */
+
+    /* sanity check - make sure queue and function are not NULL */
+    assert(queue);
+    assert(function);
+    assert(payload || size == 0);
+
+    a_request = new_request(queue, -1);
+    a_request->function = function;
+
+    if (size <= TASK_INLINE_PAYLOAD) {
+        a_request->payload = a_request->inline_payload.bytes;
+    }
+    else {
+        a_request->payload = malloc(size);
+        if (!a_request->payload) {
+            fprintf(stderr, "new_task_request: out of memory. exiting\n");
+            exit(1);
+        }
+    }
+    if (size > 0) {
+        memcpy(a_request->payload, payload, size);
+    }
+
+    if (completion) {
+        struct task_completion* handle =
+            (struct task_completion*)alloc_object(queue->completion_pool);
+
+        atomic_init(&handle->state, TASK_PENDING);
+        atomic_init(&handle->refs, 2);
+        atomic_init(&handle->num_waiters, 0);
+        handle->result = 0;
+        handle->queue = queue;
+        a_request->completion = handle;
+        *completion = handle;
+    }
+
+    return a_request;
+}
+
+/*
+ * Finish a task's completion handle with the given state, wake up whoever
+ * waits for it, and drop the request's reference to it.
+ * algorithm: waiters count themselves before checking the state, and we
+ *            check the counts after setting it - so no system call is
+ *            made when nobody waits, and no waiter misses the wakeup.
+ */
+static void finish_task_completion(struct requests_queue* queue,
+                                   struct request* a_request, int state)
+{
+    struct task_completion* completion = a_request->completion;
+
+    if (!completion) {
+        return;
+    }
+    a_request->completion = NULL;
+
+    atomic_store_explicit(&completion->state, state, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&completion->num_waiters, memory_order_relaxed) > 0) {
+        futex_wake_all(&completion->state);
+    }
+    if (atomic_load_explicit(&queue->num_any_waiters, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&queue->completions, 1);
+        futex_wake_all(&queue->completions);
+    }
+
+    release_task_completion(queue, completion);
+}
+
+/*
+ * Run the task of a request, and publish its result.
+ */
+void run_task_request(struct requests_queue* queue, struct request* a_request)
+{
+    long result;
+
+    /* sanity check - make sure queue and request are not NULL */
+    assert(queue);
+    assert(a_request && a_request->function);
+
+    result = a_request->function(a_request->payload);
+
+    if (a_request->completion) {
+        a_request->completion->result = result;
+        finish_task_completion(queue, a_request, TASK_DONE);
+    }
+}
+
+/*
+ * Has the task finished - did it run, or was it dropped?
+ */
+int task_completed(struct task_completion* completion)
+{
+    assert(completion);
+
+    return atomic_load_explicit(&completion->state, memory_order_acquire) != TASK_PENDING;
+}
+
+/*
+ * Get the result of a task that is done. 0 for a cancelled task.
+ */
+long get_task_result(struct task_completion* completion)
+{
+    assert(completion);
+    assert(task_completed(completion));
+
+    return completion->result;
+}
+
+/*
+ * get the time left till a deadline, or -1 for no deadline.
+ */
+static long long time_left_ns(long long deadline_ns)
+{
+    long long left;
+
+    if (deadline_ns < 0) {
+        return -1;
+    }
+    left = deadline_ns - monotonic_ns();
+
+    return left > 0 ? left : 0;
+}
+
+/*
+ * get the deadline of a wait of 'timeout_ms' milliseconds, -1 for none.
+ */
+static long long wait_deadline_ns(int timeout_ms)
+{
+    return timeout_ms < 0 ? -1 : monotonic_ns() + timeout_ms * 1000000LL;
+}
+
+/*
+ * wait for a task to finish, up to a deadline (-1 for none).
+ */
+static int wait_task_until(struct task_completion* completion, long long deadline_ns)
+{
+    unsigned int state;
+
+    state = atomic_load_explicit(&completion->state, memory_order_acquire);
+    if (state != TASK_PENDING) {
+        return state;
+    }
+
+    atomic_fetch_add(&completion->num_waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while ((state = atomic_load_explicit(&completion->state, memory_order_acquire)) ==
+           TASK_PENDING) {
+        long long left = time_left_ns(deadline_ns);
+
+        if (left == 0) {
+            break;
+        }
+        futex_wait_timeout(&completion->state, TASK_PENDING, left);
+    }
+    atomic_fetch_sub(&completion->num_waiters, 1);
+
+    return state;
+}
+
+/*
+ * Wait for a task to finish.
+ * algorithm: sleeps on the handle's state word, with a futex - the
+ *            handler thread finishing the task wakes us up.
+ */
+int wait_task(struct task_completion* completion)
+{
+    assert(completion);
+
+    return wait_task_until(completion, -1);
+}
+
+/*
+ * Wait for a task to finish, or for the timeout to expire.
+ */
+int wait_task_timeout(struct task_completion* completion, int timeout_ms)
+{
+    assert(completion);
+
+    return wait_task_until(completion, wait_deadline_ns(timeout_ms));
+}
+
+/*
+ * Wait for all the given tasks to finish, or for the timeout to expire.
+ * algorithm: waits for them one after the other, all with the same
+ *            deadline.
+ */
+int wait_all_tasks(struct task_completion** completions, int count, int timeout_ms)
+{
+    long long deadline_ns = wait_deadline_ns(timeout_ms);
+    int finished = 0;
+    int i;
+
+    assert(completions || count == 0);
+
+    for (i = 0; i < count; i++) {
+        if (wait_task_until(completions[i], deadline_ns) != TASK_PENDING) {
+            finished++;
+        }
+    }
+
+    return finished;
+}
+
+/*
+ * Wait for any of the given tasks to finish, or for the timeout to expire.
+ * algorithm: a task can't tell which waiters wait for it among others, so
+ *            while somebody waits for any task, finishing tasks bump the
+ *            queue's completions counter and wake its futex. we read the
+ *            counter, scan the tasks, and sleep only if the counter
+ *            didn't move since.
+ */
+int wait_any_task(struct task_completion** completions, int count, int timeout_ms)
+{
+    long long deadline_ns = wait_deadline_ns(timeout_ms);
     struct requests_queue* queue;
-    printf("Size of struct requests_queue = %u\n", sizeof(struct requests_queue));
-	queue = (struct requests_queue*) malloc(sizeof(struct requests_queue));
-    if (!queue) {
-	    fprintf(stderr, "out of memory. exiting\n");
-	    exit(1);
+    int found = -1;
+    int i;
+
+    assert(completions && count > 0);
+
+    queue = completions[0]->queue;
+    atomic_fetch_add(&queue->num_any_waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    while (1) {
+        unsigned int seen = atomic_load(&queue->completions);
+        long long left;
+
+        for (i = 0; i < count; i++) {
+            assert(completions[i]->queue == queue);
+            if (task_completed(completions[i])) {
+                found = i;
+                break;
+            }
+        }
+        if (found >= 0 || (left = time_left_ns(deadline_ns)) == 0) {
+            break;
+        }
+        futex_wait_timeout(&queue->completions, seen, left);
     }
 
-    /* initialize queue */
-    queue->requests = NULL;
-    queue->last_request = NULL;
-    queue->num_requests = 0;
-    queue->p_mutex = p_mutex;
-    queue->p_cond_var = p_cond_var;
+    atomic_fetch_sub(&queue->num_any_waiters, 1);
 
-    return queue;
+    return found;
 }
 
 /*
- * Add a request to the requests list
- * Creates a request structure, adds to the list, and
- *            increases number of pending requests by one.
- * input:     pointer to queue, request number.
- * output:    none.
+ * Drop a reference to a completion handle, freeing it with the last one.
  */
-void add_request(struct requests_queue* queue, int request_num)
+void release_task_completion(struct requests_queue* queue,
+                             struct task_completion* completion)
 {
-    int rc;                     /* return code of pthreads functions.  */
-    struct request* a_request;  /* pointer to newly added request.     */
+    /* sanity check - make sure queue and completion are not NULL */
+    assert(queue);
+    assert(completion);
+
+    if (atomic_fetch_sub_explicit(&completion->refs, 1, memory_order_acq_rel) == 1) {
+        free_object(queue->completion_pool, completion);
+    }
+}
 
+/*
+ * Release a request taken off the queue, returning it to the queue's
+ * request pool. a task that didn't run (e.g. its handler thread was
+ * cancelled, or the queue is deleted) is marked cancelled.
+ */
+void release_request(struct requests_queue* queue, struct request* a_request)
+{
     /* sanity check - make sure queue is not NULL */
     assert(queue);
 
-    /* create structure with new request */
-    a_request = (struct request*)malloc(sizeof(struct request));
-    if (!a_request) { /* malloc failed?? */
-	    fprintf(stderr, "add_request: out of memory\n");
-	    exit(1);
+    finish_task_completion(queue, a_request, TASK_CANCELLED);
+    if (a_request->payload && a_request->payload != a_request->inline_payload.bytes) {
+        free(a_request->payload);
     }
-    a_request->number = request_num;
+
+    free_object(queue->request_pool, a_request);
+}
+
+/*
+ * Drop a request taken off the queue past its deadline, returning it to
+ * the queue's pool - a task's handle is completed as expired.
+ */
+void expire_request(struct requests_queue* queue, struct request* a_request)
+{
+    /* sanity check - make sure queue and request are not NULL */
+    assert(queue);
+    assert(a_request);
+
+    atomic_fetch_add_explicit(&queue->num_expired, 1, memory_order_relaxed);
+    finish_task_completion(queue, a_request, TASK_EXPIRED);
+    release_request(queue, a_request);
+}
+
+/*
+ * Return the calling thread's cached free requests (and completions) to
+ * the queue's pools. handler threads call this before exiting.
+ */
+void flush_request_cache(struct requests_queue* queue)
+{
+    /* sanity check - make sure queue is not NULL */
+    assert(queue);
+
+    flush_object_cache(queue->request_pool);
+    flush_object_cache(queue->completion_pool);
+}
+
+/*
+ * Get the allocation counters of the queue's request pool.
+ */
+void get_requests_allocation_stats(struct requests_queue* queue,
+                                   struct object_pool_stats* stats)
+{
+    /* sanity check - make sure queue is not NULL */
+    assert(queue);
+
+    get_object_pool_stats(queue->request_pool, stats);
+}
+
+/*
+ * Add an already created request to the requests list
+ * Adds the request to the list of its priority class, and increases
+ *            number of pending requests by one. if the queue is full,
+ *            applies its overflow policy: blocks until a handler thread
+ *            takes a request off it (or the timeout expires), refuses the
+ *            request, or drops the oldest of the least important pending
+ *            requests to make room.
+ * input:     pointer to queue, request.
+ * output:    0 if the request was added, EAGAIN if it was refused,
+ *            ETIMEDOUT if no room was made in time.
+ */
+int try_enqueue_request(struct requests_queue* queue, struct request* a_request)
+{
+    int rc;                     /* return code of pthreads functions.  */
+    int waiting = 0;            /* are we counted as blocked for room? */
+    long long deadline_ns = -1; /* when to stop waiting for room.      */
+    unsigned int seen = 0;      /* dequeues seen before the last try.  */
+
+    /* sanity check - make sure queue and request are not NULL */
+    assert(queue);
+    assert(a_request);
+
     a_request->next = NULL;
 
-    /* lock the mutex, to assure exclusive access to the list */
-    rc = pthread_mutex_lock(queue->p_mutex);
+    /* bounded queue - add the request if there's room, or overflow. */
+    if (requests_queue_bounded(queue)) {
+        while ((rc = offer_request(queue, a_request)) != 0) {
+            if (queue->overflow_policy == REQUESTS_OVERFLOW_DROP_OLDEST &&
+                drop_oldest_request(queue) == 0) {
+                continue;
+            }
+            if (queue->overflow_policy != REQUESTS_OVERFLOW_BLOCK) {
+                break;
+            }
+            if (!waiting) {
+                /* count ourselves blocked, then re-check for room - a */
+                /* dequeue from now on bumps the futex word.           */
+                waiting = 1;
+                deadline_ns = wait_deadline_ns(queue->overflow_timeout_ms);
+                atomic_fetch_add(&queue->num_room_waiters, 1);
+                atomic_thread_fence(memory_order_seq_cst);
+            }
+            else {
+                long long left = time_left_ns(deadline_ns);
 
-    /* add new request to the end of the list, updating list pointers as required */
-    if (queue->num_requests == 0) { /* special case - list is empty */
-	    queue->requests = a_request;
-	    queue->last_request = a_request;
-    }
-    else {
-	    queue->last_request->next = a_request;
-	    queue->last_request = a_request;
+                if (left == 0) {
+                    rc = ETIMEDOUT;
+                    break;
+                }
+                futex_wait_timeout(&queue->dequeues, seen, left);
+            }
+            seen = atomic_load(&queue->dequeues);
+        }
+        if (waiting) {
+            atomic_fetch_sub(&queue->num_room_waiters, 1);
+        }
+        if (rc != 0) {
+            /* a request left for its producer to run isn't rejected */
+            if (queue->overflow_policy != REQUESTS_OVERFLOW_CALLER_RUNS) {
+                atomic_fetch_add_explicit(&queue->num_rejected, 1, memory_order_relaxed);
+            }
+            return rc;
+        }
+        wake_request_waiters(queue, 1);
+        return 0;
     }
 
-    /* increase total number of pending requests by one. */
-    queue->num_requests++;
+    /* lock the mutex, to assure exclusive access to the list */
+    rc = pthread_mutex_lock(&queue->mutex);
+
+    /* add new request to the end of its class' list, updating list pointers as */
+    /* required - or to the heap of requests with deadlines.                    */
+    insert_request_locked(queue, a_request);
 
 #if 0
 #ifdef DEBUG
@@ -76,19 +1352,60 @@ void add_request(struct requests_queue* queue, int request_num)
 #endif
 
     /* unlock mutex */
-    rc = pthread_mutex_unlock(queue->p_mutex);
+    rc = pthread_mutex_unlock(&queue->mutex);
+
+    /* wake one thread - there's a new request to handle */
+    wake_request_waiters(queue, 1);
+
+    return 0;
+}
+
+/*
+ * Add an already created request to the requests list, releasing it if
+ * the full queue refuses it.
+ */
+void enqueue_request(struct requests_queue* queue, struct request* a_request)
+{
+    if (try_enqueue_request(queue, a_request) != 0) {
+        reject_request(queue, a_request);
+    }
+}
+
+/*
+ * release a request the full queue refused, that nobody runs. with the
+ * caller runs policy, it's counted as rejected only now.
+ */
+void reject_request(struct requests_queue* queue, struct request* a_request)
+{
+    /* sanity check - make sure queue and request are not NULL */
+    assert(queue);
+    assert(a_request);
+
+    if (queue->overflow_policy == REQUESTS_OVERFLOW_CALLER_RUNS) {
+        atomic_fetch_add_explicit(&queue->num_rejected, 1, memory_order_relaxed);
+    }
+    release_request(queue, a_request);
+}
+
+/*
+ * count a request its producer ran itself.
+ */
+void count_caller_run_request(struct requests_queue* queue)
+{
+    /* sanity check - make sure queue is not NULL */
+    assert(queue);
 
-    /* signal the condition variable - there's a new request to handle */
-    rc = pthread_cond_signal(queue->p_cond_var);
+    atomic_fetch_add_explicit(&queue->num_caller_runs, 1, memory_order_relaxed);
 }
 
 /*
  * gets the first pending request from the requests list removing it from the list.
- * algorithm: creates a request structure, adds to the list, and
- *            increases number of pending requests by one.
+ * algorithm: takes the first request of the highest priority class
+ *            pending (or of an aged lower class), and decreases number
+ *            of pending requests by one.
  * input:     pointer to requests queue.
  * output:    pointer to the removed request, or NULL if none.
- * memory:    the returned request need to be freed by the caller.
+ * memory:    the returned request need to be released by the caller.
  */
 struct request* get_request(struct requests_queue* queue)
 {
@@ -98,29 +1415,237 @@ struct request* get_request(struct requests_queue* queue)
     /* sanity check - make sure queue is not NULL */
     assert(queue);
 
+    if (queue->ring) {
+        a_request = pop_ring_request(queue);
+        if (a_request) {
+            wake_room_waiters(queue);
+        }
+        return a_request;
+    }
+
     /* lock the mutex, to assure exclusive access to the list */
-    rc = pthread_mutex_lock(queue->p_mutex);
+    rc = pthread_mutex_lock(&queue->mutex);
 
     if (queue->num_requests > 0) {
-	    a_request = queue->requests;
-	    queue->requests = a_request->next;
-	    if (queue->requests == NULL) { /* this was last request on the list */
-	        queue->last_request = NULL;
-	    }
-	    /* decrease the total number of pending requests */
-	    queue->num_requests--;
+	    a_request = dequeue_request_locked(queue);
     }
     else { /* requests list is empty */
 	    a_request = NULL;
     }
 
     /* unlock mutex */
-    rc = pthread_mutex_unlock(queue->p_mutex);
+    rc = pthread_mutex_unlock(&queue->mutex);
+
+    /* a producer may be blocked, waiting for room */
+    if (a_request && queue->capacity > 0) {
+        wake_room_waiters(queue);
+    }
 
     /* return the request to the caller. */
     return a_request;
 }
 
+/*
+ * Add a batch of requests to the requests list
+ * input:     pointer to queue, array of request numbers, its length.
+ * output:    none.
+ */
+void add_requests(struct requests_queue* queue, const int* request_nums, int count)
+{
+    add_requests_prio(queue, request_nums, count, REQUEST_PRIORITY_DEFAULT);
+}
+
+/*
+ * Add a batch of requests of a given priority class to the requests list
+ * Creates a request structure for each of the given numbers, and adds
+ *            them all to the list under a single lock of the mutex, then
+ *            wakes up handler threads once for the whole batch: unparks
+ *            up to one parked thread per request - never more.
+ * input:     pointer to queue, array of request numbers, its length,
+ *            priority class.
+ * output:    none.
+ */
+void add_requests_prio(struct requests_queue* queue, const int* request_nums,
+                       int count, int priority)
+{
+    struct request* first = NULL;   /* head of the batch.              */
+    struct request* last = NULL;    /* tail of the batch.              */
+    int i;
+
+    /* sanity check - make sure queue is not NULL */
+    assert(queue);
+    assert(request_nums || count == 0);
+    assert(priority >= REQUEST_PRIORITY_HIGHEST && priority <= REQUEST_PRIORITY_LOWEST);
+
+    if (count <= 0) {
+        return;
+    }
+
+    /* ring backend - no mutex, push them one by one, each of them */
+    /* subject to the overflow policy.                              */
+    if (queue->ring) {
+        for (i = 0; i < count; i++) {
+            enqueue_request(queue, new_request(queue, request_nums[i]));
+        }
+        return;
+    }
+
+    /* link the batch outside the lock */
+    for (i = 0; i < count; i++) {
+        struct request* a_request = new_request(queue, request_nums[i]);
+
+        a_request->priority = priority;
+        if (last) {
+            last->next = a_request;
+        }
+        else {
+            first = a_request;
+        }
+        last = a_request;
+    }
+
+    /* lock the mutex, to assure exclusive access to the list */
+    pthread_mutex_lock(&queue->mutex);
+
+    /* a bounded list without room for the whole batch - add the requests */
+    /* one by one, each of them subject to the overflow policy.           */
+    if (queue->capacity > 0 && queue->num_requests + count > queue->capacity) {
+        pthread_mutex_unlock(&queue->mutex);
+        while (first) {
+            struct request* next = first->next;
+
+            enqueue_request(queue, first);
+            first = next;
+        }
+        return;
+    }
+
+    /* append the whole batch to the end of its class' list */
+    append_requests_locked(queue, first, last, count, priority);
+
+    /* unlock mutex */
+    pthread_mutex_unlock(&queue->mutex);
+
+    /* wake up handler threads - a thread per request, at once */
+    wake_request_waiters(queue, count);
+}
+
+/*
+ * gets up to 'max' pending requests from the requests list, removing
+ * them from the list under a single lock of the mutex.
+ * input:     pointer to requests queue, array to store the requests in,
+ *            its size.
+ * output:    number of requests stored in the array, 0 if none.
+ * memory:    each returned request need to be released by the caller.
+ */
+int get_requests(struct requests_queue* queue, struct request** requests, int max)
+{
+    int count = 0;
+
+    /* sanity check - make sure queue is not NULL */
+    assert(queue);
+    assert(requests || max == 0);
+
+    if (queue->ring) {
+        while (count < max &&
+               (requests[count] = pop_ring_request(queue)) != NULL) {
+            count++;
+        }
+        if (count > 0) {
+            wake_room_waiters(queue);
+        }
+        return count;
+    }
+
+    /* lock the mutex, to assure exclusive access to the list */
+    pthread_mutex_lock(&queue->mutex);
+
+    while (count < max && queue->num_requests > 0) {
+        requests[count++] = dequeue_request_locked(queue);
+    }
+
+    /* unlock mutex */
+    pthread_mutex_unlock(&queue->mutex);
+
+    /* producers may be blocked, waiting for room */
+    if (count > 0 && queue->capacity > 0) {
+        wake_room_waiters(queue);
+    }
+
+    return count;
+}
+
+/*
+ * sleep until a prepared waiter is woken up.
+ * algorithm: sleeps on the waiter's own futex word, so a wakeup only
+ *            wakes this thread. the word is re-checked after every
+ *            return from the kernel, so early returns don't matter.
+ * input:     pointer to queue, waiter prepared with prepare_request_wait().
+ * output:    none. the waiter is no longer parked on return.
+ */
+void wait_for_requests(struct requests_queue* queue,
+                       struct request_waiter* waiter)
+{
+    /* sanity check - make sure queue and waiter are not NULL */
+    assert(queue);
+    assert(waiter);
+
+    while (atomic_load_explicit(&waiter->futex, memory_order_acquire) == 0) {
+        futex_wait(&waiter->futex, 0);
+    }
+}
+
+/*
+ * get the number of requests ever added to, and taken from, the queue.
+ * a ring's positions only ever grow, so they are these counters already;
+ * a list counts them under the queue's mutex.
+ */
+void get_requests_queue_counters(struct requests_queue* queue,
+                                 long* num_enqueued, long* num_dequeued)
+{
+    /* sanity check */
+    assert(queue);
+    assert(num_enqueued);
+    assert(num_dequeued);
+
+    if (queue->ring) {
+        *num_enqueued = (long)atomic_load(&queue->ring->enqueue_pos);
+        *num_dequeued = (long)atomic_load(&queue->ring->dequeue_pos);
+        return;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    *num_enqueued = queue->num_enqueued;
+    *num_dequeued = queue->num_dequeued;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * get the overflow counters of the queue.
+ */
+void get_requests_overflow_counters(struct requests_queue* queue, long* num_rejected,
+                                    long* num_dropped, long* num_caller_runs)
+{
+    /* sanity check */
+    assert(queue);
+    assert(num_rejected && num_dropped && num_caller_runs);
+
+    *num_rejected = atomic_load_explicit(&queue->num_rejected, memory_order_relaxed);
+    *num_dropped = atomic_load_explicit(&queue->num_dropped, memory_order_relaxed);
+    *num_caller_runs = atomic_load_explicit(&queue->num_caller_runs, memory_order_relaxed);
+}
+
+/*
+ * get the number of requests dropped past their deadline.
+ */
+long get_requests_expired(struct requests_queue* queue)
+{
+    /* sanity check */
+    assert(queue);
+
+    return atomic_load_explicit(&queue->num_expired, memory_order_relaxed);
+}
+
 /*
  * get the number of requests in the list.
  */
@@ -132,13 +1657,17 @@ int get_requests_number(struct requests_queue* queue)
     /* sanity check */ 
     assert(queue);
 
+    if (queue->ring) {
+        return (int)request_ring_size(queue->ring) + atomic_load(&queue->num_skipped_tokens);
+    }
+
     /* lock the mutex, to assure exclusive access to the list */
-    rc = pthread_mutex_lock(queue->p_mutex);
+    rc = pthread_mutex_lock(&queue->mutex);
 
     num_requests = queue->num_requests;
 
     /* unlock mutex */
-    rc = pthread_mutex_unlock(queue->p_mutex);
+    rc = pthread_mutex_unlock(&queue->mutex);
 
     return num_requests;
 }
@@ -157,10 +1686,18 @@ void delete_requests_queue(struct requests_queue* queue)
     assert(queue);
 
     /* first free any requests that might be on the queue */
-    while (queue->num_requests > 0) {
-	    a_request = get_request(queue);
-	    free(a_request);
+    while ((a_request = get_request(queue)) != NULL) {
+	    release_request(queue, a_request);
+    }
+
+    if (queue->ring) {
+        delete_request_ring(queue->ring);
     }
+    free(queue->deadline_heap);
+    delete_object_pool(queue->request_pool);
+    delete_object_pool(queue->completion_pool);
+    pthread_mutex_destroy(&queue->park_lock);
+    pthread_mutex_destroy(&queue->mutex);
 
     /* finally, free the queue's struct itself */
     free(queue);
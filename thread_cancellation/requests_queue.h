@@ -2,40 +2,410 @@
 #define REQUESTS_QUEUE_H
 
 #include <stdio.h>       /* standard I/O routines                     */
+#include <stddef.h>      /* size_t, max_align_t                       */
 #include <pthread.h>     /* pthread functions and data structures     */
+#include <stdatomic.h>   /* C11 atomic types and operations           */
+
+#include "request_ring.h" /* lock free ring of requests               */
+#include "object_pool.h"  /* pool allocator for requests               */
+
+/*
+ * priority classes of requests - 0 is the highest. a list backed queue
+ * always hands out a request of the highest class pending, unless a
+ * request of a lower class waited longer than the queue's aging period.
+ */
+#define REQUEST_PRIORITIES 8
+#define REQUEST_PRIORITY_HIGHEST 0
+#define REQUEST_PRIORITY_DEFAULT 4
+#define REQUEST_PRIORITY_LOWEST (REQUEST_PRIORITIES - 1)
+
+/* default aging period - requests of a lower class that waited longer */
+/* than this are served before the higher classes.                    */
+#define DEFAULT_REQUEST_AGING_MS 10
+
+/* payloads of up to this many bytes are kept inside the request itself */
+#define TASK_INLINE_PAYLOAD 48
+
+/* a task - runs on a handler thread with (a copy of) its payload */
+typedef long (*task_function)(void* payload);
+
+/* states of a task's completion */
+#define TASK_PENDING   0   /* queued, or running.                     */
+#define TASK_DONE      1   /* ran - its result is ready.              */
+#define TASK_CANCELLED 2   /* dropped without running (e.g. shutdown). */
+#define TASK_EXPIRED   3   /* dropped - its deadline passed, queued.  */
+
+/* wait forever, in the wait_*task*() functions */
+#define TASK_WAIT_FOREVER -1
+
+struct requests_queue;
+
+/*
+ * completion handle (future) of a task. shared by the submitter and the
+ * handler thread running the task - the last one to release it frees it.
+ */
+struct task_completion {
+    atomic_uint state;     /* TASK_PENDING, or how it finished -      */
+                           /* also the futex word waiters sleep on.       */
+    atomic_int refs;       /* number of holders of the handle.        */
+    atomic_int num_waiters;/* threads sleeping in wait_task*().       */
+    long result;           /* the task's return value, once done.     */
+    struct requests_queue* queue; /* queue the task was created for.  */
+};
 
 /* format of a single request (single linked list). */
 struct request {
     int number;            /* number of the request                  */
+    task_function function;/* task to run, NULL for a numbered request. */
+    void* payload;         /* task's payload - inline, or malloc'ed.  */
+    struct task_completion* completion; /* task's handle, or NULL.    */
+    int priority;          /* priority class of the request.         */
+    long long enqueue_ns;  /* when it was queued (monotonic clock).  */
+    long long deadline_ns; /* when it's no longer worth handling, 0 for never. */
+    int retire_token;      /* poison pill - the taker should retire. */
     struct request* next;  /* pointer to next request, NULL if none. */
+    union {                /* small payloads live here.              */
+        max_align_t align;
+        unsigned char bytes[TASK_INLINE_PAYLOAD];
+    } inline_payload;
+};
+
+/* how a requests queue stores its pending requests */
+enum requests_queue_backend {
+    REQUESTS_QUEUE_LIST,    /* mutex guarded linked list, unbounded.      */
+    REQUESTS_QUEUE_RING     /* lock free bounded MPMC ring buffer.        */
+};
+
+/*
+ * order in which a list backed queue hands out its requests.
+ * with earliest deadline first, requests with a deadline are served
+ * before all others - the one due first, first - and those without a
+ * deadline by priority class. retire tokens still go first.
+ */
+#define REQUESTS_DISPATCH_PRIORITY 0
+#define REQUESTS_DISPATCH_EDF      1
+
+/* initial number of slots of the heap of requests with deadlines */
+#define DEADLINE_HEAP_SIZE 64
+
+/* default capacity of a ring backed requests queue */
+#define DEFAULT_RING_CAPACITY 1024
+
+/*
+ * what adding a request to a full queue does. a list backed queue is
+ * full once it holds its limit of requests (if it has one), a ring
+ * backed queue also once its ring is.
+ */
+#define REQUESTS_OVERFLOW_BLOCK       0 /* wait for room, up to a timeout.    */
+#define REQUESTS_OVERFLOW_REJECT      1 /* fail at once, with EAGAIN.         */
+#define REQUESTS_OVERFLOW_DROP_OLDEST 2 /* drop the oldest of the least       */
+                                        /* important pending requests - or,   */
+                                        /* of requests dispatched earliest    */
+                                        /* deadline first, the one due last.  */
+#define REQUESTS_OVERFLOW_CALLER_RUNS 3 /* fail with EAGAIN - the pool then   */
+                                        /* runs the request in the caller.    */
+
+/*
+ * parking slot of a thread waiting for requests - each handler thread
+ * owns one. parked slots form a LIFO stack, so a wakeup goes to the
+ * thread that parked last, whose caches are the warmest.
+ */
+struct request_waiter {
+    atomic_uint futex;              /* 0 while parked, 1 once woken.    */
+    int parked;                     /* on the queue's parked stack?     */
+    struct request_waiter* next;    /* next parked waiter, NULL if none. */
 };
 
 /* structure for a requests queue */
 struct requests_queue {
-    struct request* requests;       /* head of linked list of requests. */
-    struct request* last_request;   /* pointer to last request.         */
+    struct request* requests[REQUEST_PRIORITIES];     /* head of each class' list. */
+    struct request* last_request[REQUEST_PRIORITIES]; /* last request of each.     */
+    unsigned int pending_classes;   /* bit per class with requests.     */
+    long long aging_ns;             /* when lower classes are promoted. */
     int num_requests;		        /* number of requests in queue.     */
-    pthread_mutex_t* p_mutex;	    /* queue's mutex.                   */
-    pthread_cond_t*  p_cond_var;    /* queue's condition variable.      */
+    pthread_mutex_t mutex;          /* queue's mutex - guards the lists. */
+    struct request_ring* ring;      /* ring of requests, NULL for list. */
+    atomic_int ring_requests;       /* ring slots reserved by requests  */
+                                    /* (not retire tokens) - bounded by */
+                                    /* 'capacity'.                      */
+    struct request* skipped_tokens; /* ring: retire tokens a drop took  */
+                                    /* off its head - taken before the  */
+                                    /* ring (guarded by 'mutex').       */
+    atomic_int num_skipped_tokens;  /* number of those.                 */
+    pthread_mutex_t park_lock;      /* guards the parked waiters stack. */
+    struct request_waiter* parked;  /* stack of parked waiters.         */
+    atomic_int num_parked;          /* number of parked waiters.        */
+    struct object_pool* request_pool; /* allocator of the queue's requests. */
+    struct object_pool* completion_pool; /* allocator of task completions. */
+    atomic_uint completions;        /* tasks finished - a futex word.   */
+    atomic_int num_any_waiters;     /* threads in wait_any_task().      */
+    int capacity;                   /* most requests pending, 0 for no limit. */
+    int overflow_policy;            /* REQUESTS_OVERFLOW_* when full.   */
+    int overflow_timeout_ms;        /* longest block for room, -1 forever. */
+    atomic_uint dequeues;           /* bumped on dequeue while producers */
+                                    /* block for room - a futex word.   */
+    atomic_int num_room_waiters;    /* producers blocked for room.      */
+    atomic_long num_rejected;       /* requests refused (or timed out). */
+    atomic_long num_dropped;        /* pending requests dropped for room. */
+    atomic_long num_caller_runs;    /* requests run by their producer.  */
+    int dispatch;                   /* REQUESTS_DISPATCH_* of a list.   */
+    struct request** deadline_heap; /* EDF: min-heap of requests with   */
+    int heap_size;                  /* deadlines, by deadline - and its */
+    int heap_capacity;              /* number of used and of all slots. */
+    atomic_long num_expired;        /* requests dropped past their deadline. */
+    long num_enqueued;              /* list backend: requests ever added. */
+    long num_dequeued;              /* list backend: requests ever taken. */
 };
 
 /*
- * create a requests queue. associate it with the given mutex
- * and condition variables.
+ * create a requests queue. each queue has its own mutex, and state - so
+ * several queues (and pools) can live side by side in a process.
+ */
+extern struct requests_queue* init_requests_queue(void);
+
+/*
+ * create a requests queue using the given backend. 'capacity' is the
+ * number of slots of a ring backend, and is ignored by the list backend.
+ */
+extern struct requests_queue*
+init_requests_queue_backend(enum requests_queue_backend backend, size_t capacity);
+
+/* create a request structure with the given number, from the queue's pool */
+extern struct request* new_request(struct requests_queue* queue, int request_num);
+
+/*
+ * create a task request, from the queue's pool. the payload's 'size'
+ * bytes are copied - into the request itself if they fit, so small tasks
+ * cost no allocation. if 'completion' is set, the request gets a
+ * completion handle, and *completion is set to it.
+ */
+extern struct request* new_task_request(struct requests_queue* queue,
+                                        task_function function,
+                                        const void* payload, size_t size,
+                                        struct task_completion** completion);
+
+/*
+ * run the task of a task request, and complete its handle with the result.
+ */
+extern void run_task_request(struct requests_queue* queue, struct request* a_request);
+
+/* has the task of the given handle finished (done, or cancelled)? */
+extern int task_completed(struct task_completion* completion);
+
+/* get the result of a task that is done */
+extern long get_task_result(struct task_completion* completion);
+
+/*
+ * wait for a task to finish. returns its state - TASK_DONE,
+ * TASK_CANCELLED or TASK_EXPIRED.
+ */
+extern int wait_task(struct task_completion* completion);
+
+/*
+ * wait up to 'timeout_ms' milliseconds (TASK_WAIT_FOREVER for no limit)
+ * for a task to finish. returns its state - TASK_PENDING on timeout.
+ */
+extern int wait_task_timeout(struct task_completion* completion, int timeout_ms);
+
+/*
+ * wait up to 'timeout_ms' milliseconds for all 'count' tasks to finish.
+ * returns the number of them that finished - 'count' unless timed out.
  */
-extern struct requests_queue* init_requests_queue(pthread_mutex_t* p_mutex, 
-                                                  pthread_cond_t*  p_cond_var);
+extern int wait_all_tasks(struct task_completion** completions, int count, int timeout_ms);
+
+/*
+ * wait up to 'timeout_ms' milliseconds for any of 'count' tasks (all of
+ * the same queue) to finish. returns the index of a finished one, or -1
+ * on timeout.
+ */
+extern int wait_any_task(struct task_completion** completions, int count, int timeout_ms);
+
+/* give up a completion handle - it may not be used afterwards */
+extern void release_task_completion(struct requests_queue* queue,
+                                    struct task_completion* completion);
+
+/*
+ * return a request taken off the queue to the queue's pool. a task that
+ * didn't run is cancelled, and its malloc'ed payload (if any) is freed.
+ */
+extern void release_request(struct requests_queue* queue, struct request* a_request);
+
+/* return the calling thread's cached free requests to the queue's pool */
+extern void flush_request_cache(struct requests_queue* queue);
+
+/* get the allocation counters of the queue's request pool */
+extern void get_requests_allocation_stats(struct requests_queue* queue,
+                                          struct object_pool_stats* stats);
 
 /* add a request to the requests list */
 extern void add_request(struct requests_queue* queue, int request_num);
 
-/* get the first pending request from the requests list */
+/*
+ * add a request of the given priority class, that is only worth handling
+ * within 'timeout_ms' milliseconds from now - a handler thread taking it
+ * later drops it instead.
+ */
+extern void add_request_deadline(struct requests_queue* queue, int request_num,
+                                 int priority, int timeout_ms);
+
+/* set a request's deadline to 'timeout_ms' milliseconds from now */
+extern void set_request_deadline(struct request* a_request, int timeout_ms);
+
+/* has the request's deadline passed, at 'now_ns'? */
+extern int request_expired(const struct request* a_request, long long now_ns);
+
+/*
+ * drop a request taken off the queue past its deadline - a task's handle
+ * gets TASK_EXPIRED - and count it.
+ */
+extern void expire_request(struct requests_queue* queue, struct request* a_request);
+
+/*
+ * choose the order a list backed queue hands out its requests in - see
+ * REQUESTS_DISPATCH_*. a ring backend is FIFO, and ignores it.
+ */
+extern void set_requests_queue_dispatch(struct requests_queue* queue, int dispatch);
+
+/*
+ * add a request of the given priority class to the requests list.
+ * a ring backend is FIFO, and ignores the priority.
+ */
+extern void add_request_prio(struct requests_queue* queue, int request_num, int priority);
+
+/*
+ * add a batch of 'count' requests to the requests list, under a single
+ * lock of the queue's mutex, waking up handler threads once for the batch.
+ */
+extern void add_requests(struct requests_queue* queue, const int* request_nums, int count);
+
+/* add a batch of 'count' requests, all of the given priority class */
+extern void add_requests_prio(struct requests_queue* queue, const int* request_nums,
+                              int count, int priority);
+
+/*
+ * set the aging period of the queue - a request of a lower priority class
+ * that waited longer than 'aging_ms' is served before higher classes.
+ */
+extern void set_requests_queue_aging(struct requests_queue* queue, int aging_ms);
+
+/*
+ * add a retire token (poison pill) to the requests list. the first handler
+ * thread to take it exits - after finishing the request it's handling.
+ * it's put at the head of the highest priority class of a list backend,
+ * so it isn't stuck behind the backlog, and at the tail of a ring backend.
+ */
+extern void add_retire_token(struct requests_queue* queue);
+
+/*
+ * limit the queue to 'capacity' pending requests (0 for no limit, besides
+ * a ring's size), and choose what adding a request to the full queue does
+ * - see REQUESTS_OVERFLOW_*. 'timeout_ms' limits how long a blocked
+ * producer waits for room (TASK_WAIT_FOREVER for no limit). called
+ * before requests are added. retire tokens are never refused.
+ */
+extern void set_requests_queue_limit(struct requests_queue* queue, int capacity,
+                                     int policy, int timeout_ms);
+
+/*
+ * add an already created request to the requests list, applying the
+ * queue's overflow policy if it's full. returns 0 if it was added,
+ * EAGAIN if it was refused, or ETIMEDOUT if no room was made in time -
+ * the caller still owns a request that wasn't added.
+ */
+extern int try_enqueue_request(struct requests_queue* queue, struct request* a_request);
+
+/*
+ * add an already created request to the requests list. a request the
+ * full queue refuses is released (a task's handle gets cancelled).
+ */
+extern void enqueue_request(struct requests_queue* queue, struct request* a_request);
+
+/*
+ * release a request the full queue refused, and that nobody is going to
+ * run - a task's handle gets cancelled.
+ */
+extern void reject_request(struct requests_queue* queue, struct request* a_request);
+
+/* count a request its producer ran itself, since the queue was full */
+extern void count_caller_run_request(struct requests_queue* queue);
+
+/*
+ * get the first pending request from the requests list.
+ * the caller releases it with release_request().
+ */
 extern struct request* get_request(struct requests_queue* queue);
 
+/*
+ * waiting for requests is done in three steps, like with an eventcount:
+ *
+ *     prepare_request_wait(queue, &waiter);
+ *     if (there is something to do) {
+ *         cancel_request_wait(queue, &waiter);
+ *     }
+ *     else {
+ *         wait_for_requests(queue, &waiter);
+ *     }
+ *
+ * a wakeup issued after prepare_request_wait() is never lost.
+ */
+
+/* park the waiter on the queue - from now on, wakeups may pick it */
+extern void prepare_request_wait(struct requests_queue* queue,
+                                 struct request_waiter* waiter);
+
+/* unpark a prepared waiter that found something to do after all */
+extern void cancel_request_wait(struct requests_queue* queue,
+                                struct request_waiter* waiter);
+
+/* sleep until a prepared waiter is woken up */
+extern void wait_for_requests(struct requests_queue* queue,
+                              struct request_waiter* waiter);
+
+/*
+ * wake the last parked waiter, if there is one, after a request was made
+ * available (e.g. by a work stealing scheduler, outside the queue).
+ * costs no system call, nor lock, when no waiter is parked.
+ */
+extern void wake_request_waiter(struct requests_queue* queue);
+
+/* wake the given waiter, if it's parked - e.g. to tell it to retire */
+extern void wake_this_request_waiter(struct requests_queue* queue,
+                                     struct request_waiter* waiter);
+
+/* wake all parked waiters - e.g. when no more requests will be added */
+extern void wake_all_request_waiters(struct requests_queue* queue);
+
+/*
+ * get up to 'max' pending requests from the requests list, under a single
+ * lock of the queue's mutex. returns the number of requests stored in
+ * 'requests'. the caller releases each of them with release_request().
+ */
+extern int get_requests(struct requests_queue* queue, struct request** requests, int max);
+
+/*
+ * get the number of requests (and retire tokens) ever added to, and
+ * taken from, the queue.
+ */
+extern void get_requests_queue_counters(struct requests_queue* queue,
+                                        long* num_enqueued, long* num_dequeued);
+
+/*
+ * get the number of requests the full queue refused, dropped to make
+ * room, and left for their producers to run.
+ */
+extern void get_requests_overflow_counters(struct requests_queue* queue, long* num_rejected,
+                                           long* num_dropped, long* num_caller_runs);
+
+/* get the number of requests dropped past their deadline */
+extern long get_requests_expired(struct requests_queue* queue);
+
 /* get the number of requests in the list */
 extern int get_requests_number(struct requests_queue* queue);
 
-/* free the resources taken by the given requests queue */
+/*
+ * free the resources taken by the given requests queue. task completion
+ * handles must all be released before.
+ */
 extern void delete_requests_queue(struct requests_queue* queue);
 
 #endif /* REQUESTS_QUEUE_H */
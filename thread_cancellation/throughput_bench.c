@@ -0,0 +1,160 @@
+#include <stdio.h>             /* standard I/O routines                      */
+#include <pthread.h>           /* pthread functions and data structures      */
+#include <stdlib.h>            /* atoi() and free()                          */
+#include <string.h>            /* strcmp()                                   */
+#include <unistd.h>            /* dup()                                      */
+#include <time.h>              /* clock_gettime()                            */
+#include <assert.h>            /* assert()                                   */
+
+#include "requests_queue.h"         /* requests queue routines/structs       */
+#include "handler_thread.h"         /* handler thread functions/structs      */
+#include "handler_threads_pool.h"   /* handler thread list functions/structs */
+#include "async_logger.h"           /* asynchronous logger                   */
+
+/* default number of requests handled for each number of handler threads. */
+#define NUM_BENCH_REQUESTS 1000
+
+/* current time, in seconds. */
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * run one round of the benchmark.
+ * algorithm: spawns 'num_threads' handler threads, queues 'num_requests'
+ *            requests, tells the handlers no more requests are coming and
+ *            waits for all of them to finish.
+ * output:    elapsed time in seconds, from the first request queued till
+ *            the last handler thread exited, and the number of slabs the
+ *            requests were allocated from.
+ */
+static double run_round(enum requests_queue_backend backend, int work_stealing,
+                        int num_threads, int num_requests, int spin_us, int placement,
+                        long* num_slabs)
+{
+    int i;                                               /* loop counter          */
+    double start;                                        /* round start time      */
+    struct requests_queue* requests = NULL;              /* pointer to requests queue */
+    struct handler_threads_pool* handler_threads = NULL; /* list of handler threads */
+
+    requests = init_requests_queue_backend(backend, 0);
+    assert(requests);
+    if (work_stealing) {
+        handler_threads = init_work_stealing_pool(requests);
+    }
+    else {
+        handler_threads = init_handler_threads_pool(requests);
+    }
+    assert(handler_threads);
+    set_handler_threads_spin(handler_threads, spin_us);
+    set_handler_threads_placement(handler_threads, placement);
+
+    for (i = 0; i < num_threads; i++) {
+        add_handler_thread(handler_threads);
+    }
+
+    start = now_seconds();
+    for (i = 0; i < num_requests; i++) {
+        add_pool_request(handler_threads, i);
+    }
+
+    /* no new requests will be generated - let the handler threads drain */
+    /* the queue, and exit.                                              */
+    shutdown_handler_threads_pool(handler_threads, POOL_SHUTDOWN_DRAIN, TASK_WAIT_FOREVER);
+
+    delete_handler_threads_pool(handler_threads);
+
+    {
+        double elapsed = now_seconds() - start;
+        struct object_pool_stats stats;
+
+        get_requests_allocation_stats(requests, &stats);
+        *num_slabs = stats.num_slabs;
+        delete_requests_queue(requests);
+        return elapsed;
+    }
+}
+
+/*
+ * measure requests/sec while scaling from 1 to MAX_NUM_HANDLER_THREADS
+ * handler threads. usage:
+ *     throughput-bench [num_requests] [list|ring|steal] [spin_us] [none|core|node]
+ */
+int main(int argc, char* argv[])
+{
+    int num_requests = NUM_BENCH_REQUESTS;
+    int num_threads;
+    enum requests_queue_backend backend = REQUESTS_QUEUE_LIST;
+    int work_stealing = 0;
+    int spin_us = DEFAULT_MAX_SPIN_US;
+    int placement = THREAD_PLACEMENT_NONE;
+    const char* placement_names[] = { "none", "core", "node" };
+    FILE* report;
+
+    if (argc > 1) {
+        num_requests = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        if (strcmp(argv[2], "ring") == 0) {
+            backend = REQUESTS_QUEUE_RING;
+        }
+        else if (strcmp(argv[2], "steal") == 0) {
+            work_stealing = 1;
+        }
+        else if (strcmp(argv[2], "list") != 0) {
+            num_requests = 0;
+        }
+    }
+    if (argc > 3) {
+        spin_us = atoi(argv[3]);
+        if (spin_us < 0) {
+            num_requests = 0;
+        }
+    }
+    if (argc > 4) {
+        for (placement = THREAD_PLACEMENT_NODE; placement > THREAD_PLACEMENT_NONE; placement--) {
+            if (strcmp(argv[4], placement_names[placement]) == 0) {
+                break;
+            }
+        }
+        if (strcmp(argv[4], placement_names[placement]) != 0) {
+            num_requests = 0;
+        }
+    }
+    if (num_requests <= 0) {
+        fprintf(stderr, "usage: %s [num_requests] [list|ring|steal] [spin_us] [none|core|node]\n",
+                argv[0]);
+        exit(1);
+    }
+
+    /* the handler threads print a line per request - keep that */
+    /* out of the report by sending stdout to /dev/null.        */
+    report = fdopen(dup(fileno(stdout)), "w");
+    if (!report || !freopen("/dev/null", "w", stdout)) {
+        perror("throughput-bench");
+        exit(1);
+    }
+    start_logger(fileno(stdout));
+
+    fprintf(report, "backend,threads,requests,seconds,requests_per_sec,request_slabs,spin_us,placement\n");
+    for (num_threads = 1; num_threads <= MAX_NUM_HANDLER_THREADS; num_threads++) {
+        long num_slabs;
+        double elapsed = run_round(backend, work_stealing, num_threads, num_requests,
+                                   spin_us, placement, &num_slabs);
+
+        fprintf(report, "%s,%d,%d,%.4f,%.0f,%ld,%d,%s\n",
+                work_stealing ? "steal" : backend == REQUESTS_QUEUE_RING ? "ring" : "list",
+                num_threads, num_requests, elapsed, num_requests / elapsed, num_slabs,
+                spin_us, placement_names[placement]);
+        fflush(report);
+    }
+
+    stop_logger();
+    fclose(report);
+
+    return 0;
+}
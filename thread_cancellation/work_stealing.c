@@ -0,0 +1,290 @@
+#define _GNU_SOURCE             /* sched_getcpu()                            */
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* malloc() and free()                       */
+#include <sched.h>       /* sched_yield() and sched_getcpu()          */
+#include <assert.h>      /* assert()                                  */
+
+#include "work_stealing.h"       /* work stealing scheduler              */
+
+/* the scheduler and worker slot of the calling handler thread, if any */
+static __thread struct ws_scheduler* current_scheduler = NULL;
+static __thread struct ws_worker*    current_worker = NULL;
+
+/*
+ * create a work stealing scheduler.
+ * algorithm: allocates all worker slots upfront, so thieves can scan
+ *            them without any locking. handler threads wait on the shared
+ *            queue, and are woken through it for our requests too.
+ * input:     the shared requests queue.
+ * output:    pointer to the new scheduler.
+ */
+struct ws_scheduler* init_ws_scheduler(struct requests_queue* requests)
+{
+    struct ws_scheduler* sched;
+    int i;
+
+    assert(requests);
+
+    sched = (struct ws_scheduler*)malloc(sizeof(struct ws_scheduler));
+    if (!sched) {
+        fprintf(stderr, "init_ws_scheduler: out of memory. exiting\n");
+        exit(1);
+    }
+
+    for (i = 0; i < MAX_WS_WORKERS; i++) {
+        init_ws_deque(&sched->workers[i].deque, WS_DEQUE_SIZE);
+        sched->workers[i].inbox = init_request_ring(WS_INBOX_CAPACITY);
+        atomic_init(&sched->workers[i].owned, 0);
+        atomic_init(&sched->workers[i].node, -1);
+    }
+    atomic_init(&sched->num_pending, 0);
+    atomic_init(&sched->num_added, 0);
+    atomic_init(&sched->num_taken, 0);
+    atomic_init(&sched->next_inbox, 0);
+    sched->requests = requests;
+    sched->topology = NULL;
+
+    return sched;
+}
+
+/*
+ * claim a free worker slot for the calling thread, on the given node.
+ * a slot released by a thread that was deleted may still hold requests -
+ * the new owner simply inherits them.
+ */
+int ws_attach_worker(struct ws_scheduler* sched, int node)
+{
+    int i;
+
+    assert(sched);
+
+    for (i = 0; i < MAX_WS_WORKERS; i++) {
+        int expected = 0;
+
+        if (atomic_compare_exchange_strong(&sched->workers[i].owned, &expected, 1)) {
+            atomic_store(&sched->workers[i].node, node);
+            current_scheduler = sched;
+            current_worker = &sched->workers[i];
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * release the calling thread's worker slot. any requests left in it
+ * are still visible to thieves.
+ */
+void ws_detach_worker(struct ws_scheduler* sched, int index)
+{
+    assert(sched);
+
+    current_scheduler = NULL;
+    current_worker = NULL;
+    if (index >= 0) {
+        atomic_store(&sched->workers[index].node, -1);
+        atomic_store(&sched->workers[index].owned, 0);
+    }
+}
+
+/*
+ * add a request to the scheduler.
+ * algorithm: counts the request as pending before publishing it, so a
+ *            thread that sees no pending requests knows it may wait.
+ *            a handler thread of this scheduler pushes to its own deque
+ *            (it will most likely take it back itself, with warm caches).
+ *            other threads push to the inbox of the next owned slot,
+ *            round-robin, and fall back to the shared queue.
+ * input:     pointer to scheduler, request number.
+ */
+void ws_add_request(struct ws_scheduler* sched, int request_num)
+{
+    assert(sched);
+
+    struct request* a_request = new_request(sched->requests, request_num);
+
+    if (ws_enqueue_request(sched, a_request) != 0) {
+        reject_request(sched->requests, a_request);
+    }
+}
+
+/*
+ * push a request to the inbox of the next owned slot, round-robin -
+ * only of slots on the given node, unless it's -1.
+ * output:    0 on success, -1 if there are no such slots with room.
+ */
+static int ws_push_inbox(struct ws_scheduler* sched, struct request* a_request, int node)
+{
+    int i;
+
+    for (i = 0; i < MAX_WS_WORKERS; i++) {
+        unsigned int next = atomic_fetch_add(&sched->next_inbox, 1) % MAX_WS_WORKERS;
+        struct ws_worker* worker = &sched->workers[next];
+
+        if (atomic_load_explicit(&worker->owned, memory_order_relaxed) &&
+            (node < 0 || atomic_load_explicit(&worker->node, memory_order_relaxed) == node) &&
+            request_ring_push(worker->inbox, a_request) == 0) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * get the node the calling thread runs on right now, or -1 if the
+ * scheduler doesn't know the topology (or it has a single node).
+ */
+static int ws_current_node(struct ws_scheduler* sched)
+{
+    if (!sched->topology || sched->topology->num_nodes < 2) {
+        return -1;
+    }
+
+    return topology_cpu_node(sched->topology, sched_getcpu());
+}
+
+/*
+ * add an already created request to the scheduler, see ws_add_request().
+ */
+int ws_enqueue_request(struct ws_scheduler* sched, struct request* a_request)
+{
+    int node;
+
+    assert(sched);
+    assert(a_request);
+
+    if (current_scheduler == sched && current_worker) {
+        atomic_fetch_add(&sched->num_pending, 1);
+        atomic_fetch_add_explicit(&sched->num_added, 1, memory_order_relaxed);
+        ws_deque_push(&current_worker->deque, a_request);
+        wake_request_waiter(sched->requests);
+        return 0;
+    }
+
+    /* the request was allocated on our node - keep it there if we can */
+    atomic_fetch_add(&sched->num_pending, 1);
+    node = ws_current_node(sched);
+    if ((node >= 0 && ws_push_inbox(sched, a_request, node) == 0) ||
+        ws_push_inbox(sched, a_request, -1) == 0) {
+        atomic_fetch_add_explicit(&sched->num_added, 1, memory_order_relaxed);
+        wake_request_waiter(sched->requests);
+        return 0;
+    }
+
+    /* no handler threads, or all their inboxes are full. */
+    atomic_fetch_sub(&sched->num_pending, 1);
+    return try_enqueue_request(sched->requests, a_request);
+}
+
+/*
+ * try to take a request from one worker slot - its deque (owner end if
+ * it's ours, stealing end otherwise), then its inbox.
+ */
+static struct request* ws_take_from(struct ws_scheduler* sched, int index, int own)
+{
+    struct ws_worker* worker = &sched->workers[index];
+    struct request* a_request;
+
+    a_request = own ? ws_deque_take(&worker->deque) : ws_deque_steal(&worker->deque);
+    if (!a_request) {
+        a_request = request_ring_pop(worker->inbox);
+    }
+    if (a_request) {
+        atomic_fetch_sub(&sched->num_pending, 1);
+        atomic_fetch_add_explicit(&sched->num_taken, 1, memory_order_relaxed);
+    }
+
+    return a_request;
+}
+
+/*
+ * steal a request from any slot but 'index' - only from slots on the
+ * given node, unless it's -1 - starting at the slot's neighbour.
+ */
+static struct request* ws_steal(struct ws_scheduler* sched, int index, int node)
+{
+    struct request* a_request;
+    int i;
+
+    for (i = 1; i <= MAX_WS_WORKERS; i++) {
+        int victim = (index + i + MAX_WS_WORKERS) % MAX_WS_WORKERS;
+
+        if (victim == index ||
+            (node >= 0 &&
+             atomic_load_explicit(&sched->workers[victim].node, memory_order_relaxed) != node)) {
+            continue;
+        }
+        if ((a_request = ws_take_from(sched, victim, 0)) != NULL) {
+            return a_request;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * get a request for the worker at 'index'.
+ * algorithm: takes from the worker's own slot, then steals from the
+ *            other slots starting at its neighbour - those on the
+ *            worker's node first, if it's bound to one - then takes from
+ *            the shared queue. a steal may lose a race, so while requests
+ *            are still counted as pending we keep trying.
+ * input:     pointer to scheduler, worker's slot index (-1 for none).
+ * output:    pointer to the request, or NULL if there are none.
+ * memory:    the returned request need to be released by the caller.
+ */
+struct request* ws_get_request(struct ws_scheduler* sched, int index)
+{
+    struct request* a_request;
+    int node = -1;
+
+    assert(sched);
+
+    if (index >= 0) {
+        node = atomic_load_explicit(&sched->workers[index].node, memory_order_relaxed);
+    }
+
+    while (1) {
+        if (index >= 0 && (a_request = ws_take_from(sched, index, 1)) != NULL) {
+            return a_request;
+        }
+        if (node >= 0 && (a_request = ws_steal(sched, index, node)) != NULL) {
+            return a_request;
+        }
+        if ((a_request = ws_steal(sched, index, -1)) != NULL) {
+            return a_request;
+        }
+        if ((a_request = get_request(sched->requests)) != NULL) {
+            return a_request;
+        }
+        if (atomic_load(&sched->num_pending) <= 0) {
+            return NULL;
+        }
+        /* a request is being pushed or stolen by someone else right now */
+        sched_yield();
+    }
+}
+
+/*
+ * delete a work stealing scheduler, once no handler threads use it.
+ * frees requests left in the deques and inboxes, then the slots.
+ */
+void delete_ws_scheduler(struct ws_scheduler* sched)
+{
+    struct request* a_request;
+    int i;
+
+    assert(sched);
+
+    for (i = 0; i < MAX_WS_WORKERS; i++) {
+        while ((a_request = ws_take_from(sched, i, 1)) != NULL) {
+            release_request(sched->requests, a_request);
+        }
+        destroy_ws_deque(&sched->workers[i].deque);
+        delete_request_ring(sched->workers[i].inbox);
+    }
+
+    free(sched);
+}
@@ -0,0 +1,86 @@
+#ifndef WORK_STEALING_H
+#define WORK_STEALING_H
+
+#include <stdatomic.h>   /* C11 atomic types and operations           */
+
+#include "requests_queue.h"      /* requests queue routines/structs      */
+#include "request_ring.h"        /* lock free ring of requests           */
+#include "ws_deque.h"            /* work stealing deque                  */
+#include "cpu_topology.h"        /* NUMA nodes of the CPUs               */
+
+/* maximal number of handler threads owning a local deque at once */
+#define MAX_WS_WORKERS 64
+
+/* initial number of slots of a worker's local deque */
+#define WS_DEQUE_SIZE 64
+
+/* number of slots of a worker's inbox */
+#define WS_INBOX_CAPACITY 128
+
+/* per handler thread state of a work stealing scheduler */
+struct ws_worker {
+    struct ws_deque deque;        /* requests pushed by the owner itself.  */
+    struct request_ring* inbox;   /* requests pushed by other threads.     */
+    atomic_int owned;             /* is a handler thread using this slot?  */
+    atomic_int node;              /* NUMA node its owner is bound to, or -1. */
+    char pad[CACHE_LINE_SIZE];    /* keep workers off each other's lines.  */
+};
+
+/*
+ * work stealing scheduler.
+ * each handler thread owns a local deque, and an inbox other threads
+ * push to round-robin. idle handler threads take from their own deque
+ * and inbox first, then steal from their peers', and last take from the
+ * shared requests queue, which is also where they wait for new requests.
+ * if the scheduler knows the CPU topology, threads bound to a NUMA node
+ * steal from peers of their node first, and outside producers push to
+ * inboxes of threads on their own node first - so requests are mostly
+ * handled on the node whose memory they were allocated from.
+ */
+struct ws_scheduler {
+    struct ws_worker workers[MAX_WS_WORKERS]; /* workers' slots.             */
+    atomic_int num_pending;        /* requests in deques and inboxes.        */
+    atomic_long num_added;         /* requests ever put in deques/inboxes.   */
+    atomic_long num_taken;         /* requests ever taken from them.         */
+    atomic_uint next_inbox;        /* next inbox for outside producers.      */
+    struct requests_queue* requests; /* shared queue, for overflow/waiting.  */
+    const struct cpu_topology* topology; /* CPUs' nodes, or NULL to ignore. */
+};
+
+/* create a work stealing scheduler on top of the given requests queue */
+extern struct ws_scheduler* init_ws_scheduler(struct requests_queue* requests);
+
+/*
+ * claim a worker slot for the calling handler thread, bound to the given
+ * NUMA node (-1 if not bound to one).
+ * returns the slot's index, or -1 if all slots are taken (the thread
+ * can still steal, it just has no local deque).
+ */
+extern int ws_attach_worker(struct ws_scheduler* sched, int node);
+
+/* release the calling handler thread's worker slot */
+extern void ws_detach_worker(struct ws_scheduler* sched, int index);
+
+/*
+ * add a request. a handler thread pushes to its own deque, any other
+ * thread to the next worker's inbox (or the shared queue if all are full).
+ */
+extern void ws_add_request(struct ws_scheduler* sched, int request_num);
+
+/*
+ * add an already created request (e.g. a task), the same way. returns 0,
+ * or the error of adding it to a full shared queue - see
+ * try_enqueue_request(). the caller still owns a request not added.
+ */
+extern int ws_enqueue_request(struct ws_scheduler* sched, struct request* a_request);
+
+/*
+ * get a request for the worker at 'index' (-1 for none) - own deque,
+ * own inbox, peers, then the shared queue. NULL if there are none.
+ */
+extern struct request* ws_get_request(struct ws_scheduler* sched, int index);
+
+/* free the scheduler, and any requests still in its deques and inboxes */
+extern void delete_ws_scheduler(struct ws_scheduler* sched);
+
+#endif /* WORK_STEALING_H */
@@ -0,0 +1,166 @@
+#include <stdio.h>       /* standard I/O routines                     */
+#include <stdlib.h>      /* malloc() and free()                       */
+#include <assert.h>      /* assert()                                  */
+
+#include "ws_deque.h"            /* work stealing deque functions/structs */
+
+/*
+ * allocate an array of 'size' slots, chained to the array it replaces.
+ */
+static struct ws_array* new_ws_array(long size, struct ws_array* retired)
+{
+    struct ws_array* array;
+
+    array = (struct ws_array*)malloc(sizeof(struct ws_array) +
+                                     size * sizeof(_Atomic(struct request*)));
+    if (!array) {
+        fprintf(stderr, "new_ws_array: out of memory. exiting\n");
+        exit(1);
+    }
+    array->size = size;
+    array->retired = retired;
+
+    return array;
+}
+
+/*
+ * initialize a work stealing deque.
+ * input:     pointer to deque, initial number of slots (a power of 2).
+ */
+void init_ws_deque(struct ws_deque* deque, long size)
+{
+    assert(deque);
+    assert(size > 0 && (size & (size - 1)) == 0);
+
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, new_ws_array(size, NULL));
+}
+
+/*
+ * grow the deque's array to twice its size, copying the live slots.
+ * the old array is kept (chained) since thieves may still read from it,
+ * and is only freed with the deque.
+ */
+static struct ws_array* grow_ws_deque(struct ws_deque* deque, struct ws_array* array,
+                                      long top, long bottom)
+{
+    struct ws_array* bigger = new_ws_array(array->size * 2, array);
+    long i;
+
+    for (i = top; i < bottom; i++) {
+        struct request* a_request =
+            atomic_load_explicit(&array->slots[i & (array->size - 1)], memory_order_relaxed);
+        atomic_store_explicit(&bigger->slots[i & (bigger->size - 1)], a_request,
+                              memory_order_relaxed);
+    }
+    atomic_store_explicit(&deque->array, bigger, memory_order_release);
+
+    return bigger;
+}
+
+/*
+ * push a request at the bottom of the deque (owner only).
+ * algorithm: stores the request in the bottom slot, growing the array if
+ *            it's full, then publishes it to thieves by moving 'bottom'.
+ */
+void ws_deque_push(struct ws_deque* deque, struct request* a_request)
+{
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    struct ws_array* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+    if (bottom - top > array->size - 1) {
+        array = grow_ws_deque(deque, array, top, bottom);
+    }
+    atomic_store_explicit(&array->slots[bottom & (array->size - 1)], a_request,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+/*
+ * take the newest request from the bottom of the deque (owner only).
+ * algorithm: reserves the bottom slot by moving 'bottom' down. if that
+ *            was the last request, races the thieves for it with a CAS
+ *            on 'top'.
+ * output:    the request, or NULL if the deque is empty.
+ */
+struct request* ws_deque_take(struct ws_deque* deque)
+{
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    struct ws_array* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    struct request* a_request = NULL;
+    long top;
+
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top <= bottom) { /* deque was not empty */
+        a_request = atomic_load_explicit(&array->slots[bottom & (array->size - 1)],
+                                         memory_order_relaxed);
+        if (top == bottom) { /* last request - a thief may want it too */
+            if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                         memory_order_seq_cst,
+                                                         memory_order_relaxed)) {
+                a_request = NULL;
+            }
+            atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        }
+    }
+    else { /* deque was empty - undo the reservation */
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+
+    return a_request;
+}
+
+/*
+ * steal the oldest request from the top of the deque (any thread).
+ * algorithm: reads the top slot, and claims it by moving 'top' up with
+ *            a CAS. losing the CAS to the owner or another thief means
+ *            the request is theirs.
+ * output:    the request, or NULL if the deque is empty or we lost.
+ */
+struct request* ws_deque_steal(struct ws_deque* deque)
+{
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    long bottom;
+    struct request* a_request = NULL;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top < bottom) {
+        struct ws_array* array = atomic_load_explicit(&deque->array, memory_order_acquire);
+
+        a_request = atomic_load_explicit(&array->slots[top & (array->size - 1)],
+                                         memory_order_relaxed);
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            a_request = NULL;
+        }
+    }
+
+    return a_request;
+}
+
+/*
+ * free the current array of the deque and all the arrays it replaced.
+ */
+void destroy_ws_deque(struct ws_deque* deque)
+{
+    struct ws_array* array;
+
+    assert(deque);
+
+    array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    while (array) {
+        struct ws_array* retired = array->retired;
+        free(array);
+        array = retired;
+    }
+    atomic_store_explicit(&deque->array, NULL, memory_order_relaxed);
+}
@@ -0,0 +1,44 @@
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <stdatomic.h>   /* C11 atomic types and operations           */
+
+struct request;
+
+/* circular array of request pointers used by a work stealing deque. */
+struct ws_array {
+    long size;                          /* number of slots (power of 2).   */
+    struct ws_array* retired;           /* previous, smaller array.        */
+    _Atomic(struct request*) slots[];   /* the slots themselves.           */
+};
+
+/*
+ * Chase-Lev work stealing deque.
+ * only the owner thread pushes and takes at the bottom end, any
+ * other thread may steal from the top end. grows when full.
+ */
+struct ws_deque {
+    atomic_long top;                    /* next slot to steal from.        */
+    atomic_long bottom;                 /* next slot to push to.           */
+    _Atomic(struct ws_array*) array;    /* current array of slots.         */
+};
+
+/* initialize a deque able to hold 'size' requests before growing */
+extern void init_ws_deque(struct ws_deque* deque, long size);
+
+/* push a request at the bottom of the deque. owner thread only. */
+extern void ws_deque_push(struct ws_deque* deque, struct request* a_request);
+
+/* take the newest request from the bottom. owner thread only. NULL if empty. */
+extern struct request* ws_deque_take(struct ws_deque* deque);
+
+/*
+ * steal the oldest request from the top. any thread.
+ * NULL if empty, or if another thread won the race for the request.
+ */
+extern struct request* ws_deque_steal(struct ws_deque* deque);
+
+/* free the arrays of the deque (not the requests in it) */
+extern void destroy_ws_deque(struct ws_deque* deque);
+
+#endif /* WS_DEQUE_H */